@@ -8,9 +8,11 @@
 #include "assets/lang_config.h"
 #include "mcp_server.h"
 #include "assets.h"
+#include "audio_packet_pool.h"
 #include "settings.h"
 
 #include <cstring>
+#include <iterator>
 #include <esp_log.h>
 #include <cJSON.h>
 #include <driver/gpio.h>
@@ -25,6 +27,52 @@
 
 #define TAG "Application"
 
+enum ServerMessageType {
+    kServerMessageUnknown,
+    kServerMessageTts,
+    kServerMessageStt,
+    kServerMessageLlm,
+    kServerMessageMcp,
+    kServerMessageSystem,
+    kServerMessageAlert,
+    kServerMessageCustom,
+};
+
+static constexpr JsonKeyword<ServerMessageType> kServerMessageTypes[] = {
+    {"tts", kServerMessageTts},
+    {"stt", kServerMessageStt},
+    {"llm", kServerMessageLlm},
+    {"mcp", kServerMessageMcp},
+    {"system", kServerMessageSystem},
+    {"alert", kServerMessageAlert},
+#if CONFIG_RECEIVE_CUSTOM_MESSAGE
+    {"custom", kServerMessageCustom},
+#endif
+};
+static constexpr JsonKeywordTable<ServerMessageType, std::size(kServerMessageTypes)> kServerMessageTable(kServerMessageTypes);
+static_assert(kServerMessageTable.perfect(), "Server message types need a perfect hash");
+
+enum TtsState {
+    kTtsStateUnknown,
+    kTtsStateStart,
+    kTtsStateStop,
+    kTtsStateSentenceStart,
+    kTtsStatePlayStart,
+    kTtsStatePlayStop,
+    kTtsStateListenStart,
+};
+
+static constexpr JsonKeyword<TtsState> kTtsStates[] = {
+    {"start", kTtsStateStart},
+    {"stop", kTtsStateStop},
+    {"sentence_start", kTtsStateSentenceStart},
+    {"play_start", kTtsStatePlayStart},
+    {"play_stop", kTtsStatePlayStop},
+    {"listen_start", kTtsStateListenStart},
+};
+static constexpr JsonKeywordTable<TtsState, std::size(kTtsStates)> kTtsStateTable(kTtsStates);
+static_assert(kTtsStateTable.perfect(), "TTS states need a perfect hash");
+
 
 static const char* const STATE_STRINGS[] = {
     "unknown",
@@ -283,9 +331,10 @@ void Application::ToggleChatState() {
             SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
         });
     } else if (device_state_ == kDeviceStateSpeaking) {
+        // Stop the speech before the UI updates that are still queued
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {
         Schedule([this]() {
             protocol_->CloseAudioChannel();
@@ -323,7 +372,7 @@ void Application::StartListening() {
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
             SetListeningMode(kListeningModeManualStop);
-        });
+        }, kSchedulePriorityHigh);
     }
 }
 
@@ -373,7 +422,9 @@ void Application::Start() {
 
     AudioServiceCallbacks callbacks;
     callbacks.on_send_queue_available = [this]() {
-        xEventGroupSetBits(event_group_, MAIN_EVENT_SEND_AUDIO);
+        if (audio_sender_task_handle_ != nullptr) {
+            xTaskNotifyGive(audio_sender_task_handle_);
+        }
     };
     callbacks.on_wake_word_detected = [this](const std::string& wake_word) {
         xEventGroupSetBits(event_group_, MAIN_EVENT_WAKE_WORD_DETECTED);
@@ -389,6 +440,13 @@ void Application::Start() {
         vTaskDelete(NULL);
     }, "main_event_loop", 2048 * 4, this, 3, &main_event_loop_task_handle_);
 
+    // Uplink audio has its own task above the main loop, so scheduled work never delays it.
+    // Websocket sends go through TLS, which needs the same stack as the main loop
+    xTaskCreate([](void* arg) {
+        ((Application*)arg)->AudioSenderTask();
+        vTaskDelete(NULL);
+    }, "audio_sender", 2048 * 4, this, 4, &audio_sender_task_handle_);
+
     /* Start the clock timer to update the status bar */
     esp_timer_start_periodic(clock_timer_handle_, 1000000);
 
@@ -434,6 +492,8 @@ void Application::Start() {
     protocol_->OnIncomingAudio([this](std::unique_ptr<AudioStreamPacket> packet) {
         if (device_state_ == kDeviceStateSpeaking) {
             audio_service_.PushPacketToDecodeQueue(std::move(packet));
+        } else {
+            AudioPacketPool::GetInstance().Release(std::move(packet));
         }
     });
     protocol_->OnAudioChannelOpened([this, codec, &board]() {
@@ -451,19 +511,19 @@ void Application::Start() {
             SetDeviceState(kDeviceStateIdle);
         });
     });
-    protocol_->OnIncomingJson([this, display](const cJSON* root) {
-        // Parse JSON data
-        auto type = cJSON_GetObjectItem(root, "type");
-        if (strcmp(type->valuestring, "tts") == 0) {
-            auto state = cJSON_GetObjectItem(root, "state");
-            if (strcmp(state->valuestring, "start") == 0) {
+    protocol_->OnIncomingJson([this, display](const JsonEnvelope& message) {
+        switch (kServerMessageTable.Find(message.type(), kServerMessageUnknown)) {
+        case kServerMessageTts:
+            switch (kTtsStateTable.Find(message.state(), kTtsStateUnknown)) {
+            case kTtsStateStart:
                 Schedule([this]() {
                     aborted_ = false;
                     if (device_state_ == kDeviceStateIdle || device_state_ == kDeviceStateListening) {
                         SetDeviceState(kDeviceStateSpeaking);
                     }
                 });
-            } else if (strcmp(state->valuestring, "stop") == 0) {
+                break;
+            case kTtsStateStop:
                 Schedule([this]() {
                     if (device_state_ == kDeviceStateSpeaking) {
                         if (listening_mode_ == kListeningModeManualStop) {
@@ -480,19 +540,23 @@ void Application::Start() {
                         }
                     }
                 });
-            } else if (strcmp(state->valuestring, "sentence_start") == 0) {
-                auto text = cJSON_GetObjectItem(root, "text");
-                if (cJSON_IsString(text)) {
-                    ESP_LOGI(TAG, "<< %s", text->valuestring);
-                    Schedule([this, display, message = std::string(text->valuestring)]() {
-                        display->SetChatMessage("assistant", message.c_str());
+                break;
+            case kTtsStateSentenceStart:
+                if (message.text() != nullptr) {
+                    ESP_LOGI(TAG, "<< %s", message.text());
+                    // The envelope buffer is reused by the next message, so the lambda owns a copy.
+                    // The display update stays on the main task to keep its order with scheduled clears.
+                    Schedule([this, display, text = std::string(message.text())]() {
+                        display->SetChatMessage("assistant", text.c_str());
                     });
                 }
-            }else if (strcmp(state->valuestring, "play_start") == 0) {
+                break;
+            case kTtsStatePlayStart:
                 Schedule([this]() {
                     SetDeviceState(kDeviceStateSpeaking);
                 });
-            }else if (strcmp(state->valuestring, "play_stop") == 0) {
+                break;
+            case kTtsStatePlayStop:
                 Schedule([this,display]() {
                     SetDeviceState(kDeviceStateIdle);
                     display->SetChatMessage("system", "");
@@ -500,59 +564,65 @@ void Application::Start() {
                         protocol_->CloseAudioChannel();
                     }
                 });
-            }else if (strcmp(state->valuestring, "listen_start") == 0) {
+                break;
+            case kTtsStateListenStart:
                 Schedule([this,display]() {
                     // SetDeviceState(kDeviceStateListening);
                     SetListeningMode(aec_mode_ == kAecOff ? kListeningModeAutoStop : kListeningModeRealtime);
                     display->SetChatMessage("system", "");
                 });
+                break;
+            default:
+                break;
             }
-        } else if (strcmp(type->valuestring, "stt") == 0) {
-            auto text = cJSON_GetObjectItem(root, "text");
-            if (cJSON_IsString(text)) {
-                ESP_LOGI(TAG, ">> %s", text->valuestring);
-                Schedule([this, display, message = std::string(text->valuestring)]() {
-                    display->SetChatMessage("user", message.c_str());
+            break;
+        case kServerMessageStt:
+            if (message.text() != nullptr) {
+                ESP_LOGI(TAG, ">> %s", message.text());
+                Schedule([this, display, text = std::string(message.text())]() {
+                    display->SetChatMessage("user", text.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "llm") == 0) {
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(emotion)) {
-                Schedule([this, display, emotion_str = std::string(emotion->valuestring)]() {
+            break;
+        case kServerMessageLlm:
+            if (message.emotion() != nullptr) {
+                Schedule([this, display, emotion_str = std::string(message.emotion())]() {
                     display->SetEmotion(emotion_str.c_str());
                 });
             }
-        } else if (strcmp(type->valuestring, "mcp") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
+            break;
+        case kServerMessageMcp: {
+            // The only message that needs the full tree
+            auto payload = cJSON_GetObjectItem(message.root(), "payload");
             if (cJSON_IsObject(payload)) {
                 McpServer::GetInstance().ParseMessage(payload);
             }
-        } else if (strcmp(type->valuestring, "system") == 0) {
-            auto command = cJSON_GetObjectItem(root, "command");
-            if (cJSON_IsString(command)) {
-                ESP_LOGI(TAG, "System command: %s", command->valuestring);
-                if (strcmp(command->valuestring, "reboot") == 0) {
+            break;
+        }
+        case kServerMessageSystem:
+            if (message.command() != nullptr) {
+                ESP_LOGI(TAG, "System command: %s", message.command());
+                if (strcmp(message.command(), "reboot") == 0) {
                     // Do a reboot if user requests a OTA update
                     Schedule([this]() {
                         Reboot();
                     });
                 } else {
-                    ESP_LOGW(TAG, "Unknown system command: %s", command->valuestring);
+                    ESP_LOGW(TAG, "Unknown system command: %s", message.command());
                 }
             }
-        } else if (strcmp(type->valuestring, "alert") == 0) {
-            auto status = cJSON_GetObjectItem(root, "status");
-            auto message = cJSON_GetObjectItem(root, "message");
-            auto emotion = cJSON_GetObjectItem(root, "emotion");
-            if (cJSON_IsString(status) && cJSON_IsString(message) && cJSON_IsString(emotion)) {
-                Alert(status->valuestring, message->valuestring, emotion->valuestring, Lang::Sounds::OGG_VIBRATION);
+            break;
+        case kServerMessageAlert:
+            if (message.status() != nullptr && message.message() != nullptr && message.emotion() != nullptr) {
+                Alert(message.status(), message.message(), message.emotion(), Lang::Sounds::OGG_VIBRATION);
             } else {
                 ESP_LOGW(TAG, "Alert command requires status, message and emotion");
             }
+            break;
 #if CONFIG_RECEIVE_CUSTOM_MESSAGE
-        } else if (strcmp(type->valuestring, "custom") == 0) {
-            auto payload = cJSON_GetObjectItem(root, "payload");
-            ESP_LOGI(TAG, "Received custom message: %s", cJSON_PrintUnformatted(root));
+        case kServerMessageCustom: {
+            auto payload = cJSON_GetObjectItem(message.root(), "payload");
+            ESP_LOGI(TAG, "Received custom message: %s", message.data());
             if (cJSON_IsObject(payload)) {
                 Schedule([this, display, payload_str = std::string(cJSON_PrintUnformatted(payload))]() {
                     display->SetChatMessage("system", payload_str.c_str());
@@ -560,9 +630,12 @@ void Application::Start() {
             } else {
                 ESP_LOGW(TAG, "Invalid custom message format: missing payload");
             }
+            break;
+        }
 #endif
-        } else {
-            ESP_LOGW(TAG, "Unknown message type: %s", type->valuestring);
+        default:
+            ESP_LOGW(TAG, "Unknown message type: %s", message.type());
+            break;
         }
     });
     bool protocol_started = protocol_->Start();
@@ -595,10 +668,35 @@ void Application::Start() {
 }
 
 // Add a async task to MainLoop
-void Application::Schedule(std::function<void()> callback) {
-    {
-        std::lock_guard<std::mutex> lock(mutex_);
-        main_tasks_.push_back(std::move(callback));
+void Application::ScheduleTask(ScheduledTask& task, SchedulePriority priority) {
+    if (task.on_heap()) {
+        heap_tasks_++;
+    }
+    if (!main_tasks_[priority].Push(task)) {
+        // The lane is full, the task waits in the overflow list and nobody blocks
+        schedule_overflows_++;
+        ESP_LOGW(TAG, "Schedule queue %d is full, %lu overflows", priority, schedule_overflows_.load());
+    }
+    xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
+}
+
+void Application::RunScheduledTasks() {
+    ScheduledTask task;
+    // At most a full queue per pass, so tasks that keep scheduling more cannot starve the loop
+    for (int i = 0; i < SCHEDULE_QUEUE_SIZE * kSchedulePriorityCount; i++) {
+        bool popped = false;
+        // Drain the high priority lane before every normal task
+        for (auto& queue : main_tasks_) {
+            if (queue.Pop(task)) {
+                popped = true;
+                break;
+            }
+        }
+        if (!popped) {
+            return;
+        }
+        task();
+        task.Reset();
     }
     xEventGroupSetBits(event_group_, MAIN_EVENT_SCHEDULE);
 }
@@ -609,7 +707,6 @@ void Application::Schedule(std::function<void()> callback) {
 void Application::MainEventLoop() {
     while (true) {
         auto bits = xEventGroupWaitBits(event_group_, MAIN_EVENT_SCHEDULE |
-            MAIN_EVENT_SEND_AUDIO |
             MAIN_EVENT_WAKE_WORD_DETECTED |
             MAIN_EVENT_VAD_CHANGE |
             MAIN_EVENT_CLOCK_TICK |
@@ -643,14 +740,6 @@ void Application::MainEventLoop() {
             Alert(Lang::Strings::ERROR, last_error_message_.c_str(), "circle_xmark", Lang::Sounds::OGG_EXCLAMATION);
         }
 
-        if (bits & MAIN_EVENT_SEND_AUDIO) {
-            while (auto packet = audio_service_.PopPacketFromSendQueue()) {
-                if (protocol_ && !protocol_->SendAudio(std::move(packet))) {
-                    break;
-                }
-            }
-        }
-
         if (bits & MAIN_EVENT_WAKE_WORD_DETECTED) {
             OnWakeWordDetected();
         }
@@ -663,12 +752,7 @@ void Application::MainEventLoop() {
         }
 
         if (bits & MAIN_EVENT_SCHEDULE) {
-            std::unique_lock<std::mutex> lock(mutex_);
-            auto tasks = std::move(main_tasks_);
-            lock.unlock();
-            for (auto& task : tasks) {
-                task();
-            }
+            RunScheduledTasks();
         }
 
         if (bits & MAIN_EVENT_CLOCK_TICK) {
@@ -677,6 +761,7 @@ void Application::MainEventLoop() {
             display->UpdateStatusBar();
             // Print the debug info every 10 seconds
             if (clock_ticks_ % 10 == 0) {
+                ESP_LOGD(TAG, "Scheduled tasks on heap: %lu, overflows: %lu", heap_tasks_.load(), schedule_overflows_.load());
                 // SystemInfo::PrintTaskCpuUsage(pdMS_TO_TICKS(1000));
                 // SystemInfo::PrintTaskList();
                 // SystemInfo::PrintHeapStats();
@@ -685,6 +770,35 @@ void Application::MainEventLoop() {
     }
 }
 
+// Sends every encoded frame that is ready each time it is woken up by the audio service.
+// When the link cannot keep up the send queue fills, and the opus codec task pauses encoding
+// until a frame is popped here.
+void Application::AudioSenderTask() {
+    while (!audio_sender_stop_) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (!audio_sender_stop_) {
+            auto packet = audio_service_.PopPacketFromSendQueue();
+            if (!packet || !protocol_ || !protocol_->SendAudio(std::move(packet))) {
+                break;
+            }
+        }
+    }
+    xEventGroupSetBits(event_group_, MAIN_EVENT_AUDIO_SENDER_STOPPED);
+}
+
+// Returns false if the sender is still inside SendAudio() after the timeout
+bool Application::StopAudioSender() {
+    auto task = audio_sender_task_handle_;
+    if (task == nullptr) {
+        return true;
+    }
+    audio_sender_task_handle_ = nullptr;
+    audio_sender_stop_ = true;
+    xTaskNotifyGive(task);
+    auto bits = xEventGroupWaitBits(event_group_, MAIN_EVENT_AUDIO_SENDER_STOPPED, pdTRUE, pdTRUE, pdMS_TO_TICKS(3000));
+    return (bits & MAIN_EVENT_AUDIO_SENDER_STOPPED) != 0;
+}
+
 void Application::OnWakeWordDetected() {
     if (!protocol_) {
         return;
@@ -851,8 +965,13 @@ void Application::Reboot() {
     if (protocol_ && protocol_->IsAudioChannelOpened()) {
         protocol_->CloseAudioChannel();
     }
-    protocol_.reset();
+    // Nothing may feed or run the audio sender once the protocol is gone
     audio_service_.Stop();
+    if (StopAudioSender()) {
+        protocol_.reset();
+    } else {
+        ESP_LOGW(TAG, "Audio sender did not stop, keep the protocol until the restart");
+    }
 
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
@@ -920,9 +1039,10 @@ void Application::WakeWordInvoke(const std::string& wake_word) {
             }
         }); 
     } else if (device_state_ == kDeviceStateSpeaking) {
+        // Stop the speech before the UI updates that are still queued
         Schedule([this]() {
             AbortSpeaking(kAbortReasonNone);
-        });
+        }, kSchedulePriorityHigh);
     } else if (device_state_ == kDeviceStateListening) {   
         Schedule([this]() {
             if (protocol_) {
@@ -9,22 +9,25 @@
 #include <string>
 #include <mutex>
 #include <deque>
+#include <atomic>
 #include <memory>
 
 #include "protocol.h"
+#include "schedule_queue.h"
 #include "ota.h"
 #include "audio_service.h"
 #include "device_state_event.h"
 
 
 #define MAIN_EVENT_SCHEDULE (1 << 0)
-#define MAIN_EVENT_SEND_AUDIO (1 << 1)
 #define MAIN_EVENT_WAKE_WORD_DETECTED (1 << 2)
 #define MAIN_EVENT_VAD_CHANGE (1 << 3)
 #define MAIN_EVENT_ERROR (1 << 4)
 #define MAIN_EVENT_CHECK_NEW_VERSION_DONE (1 << 5)
 #define MAIN_EVENT_CLOCK_TICK (1 << 6)
 #define MAIN_START_OTA (1 << 7)
+// Set by the audio sender task when it exits
+#define MAIN_EVENT_AUDIO_SENDER_STOPPED (1 << 8)
 
 enum AecMode {
     kAecOff,
@@ -46,7 +49,12 @@ public:
     void MainEventLoop();
     DeviceState GetDeviceState() const { return device_state_; }
     bool IsVoiceDetected() const { return audio_service_.IsVoiceDetected(); }
-    void Schedule(std::function<void()> callback);
+    // Runs callback on the main event loop, small callables are queued without allocating
+    template <typename F>
+    void Schedule(F&& callback, SchedulePriority priority = kSchedulePriorityNormal) {
+        ScheduledTask task(std::forward<F>(callback));
+        ScheduleTask(task, priority);
+    }
     void SetDeviceState(DeviceState state);
     void Alert(const char* status, const char* message, const char* emotion = "", const std::string_view& sound = "");
     void DismissAlert();
@@ -74,8 +82,10 @@ private:
     Application();
     ~Application();
 
-    std::mutex mutex_;
-    std::deque<std::function<void()>> main_tasks_;
+    ScheduleQueue main_tasks_[kSchedulePriorityCount];
+    // Tasks too large to be stored inline, and pushes that found their lane full
+    std::atomic<uint32_t> heap_tasks_ = 0;
+    std::atomic<uint32_t> schedule_overflows_ = 0;
     std::unique_ptr<Protocol> protocol_;
     EventGroupHandle_t event_group_ = nullptr;
     esp_timer_handle_t clock_timer_handle_ = nullptr;
@@ -90,11 +100,17 @@ private:
     int clock_ticks_ = 0;
     TaskHandle_t check_new_version_task_handle_ = nullptr;
     TaskHandle_t main_event_loop_task_handle_ = nullptr;
+    TaskHandle_t audio_sender_task_handle_ = nullptr;
+    std::atomic<bool> audio_sender_stop_ = false;
     TaskHandle_t esphome_loop_task_handle_ = nullptr;
 
     std::string _ota_url;
     std::string _ota_version;
 
+    void ScheduleTask(ScheduledTask& task, SchedulePriority priority);
+    void RunScheduledTasks();
+    void AudioSenderTask();
+    bool StopAudioSender();
     void OnWakeWordDetected();
     void CheckNewVersion(Ota& ota);
     void CheckAssetsVersion();
@@ -4,24 +4,22 @@
 #include "application.h"
 #include "lvgl_theme.h"
 #include "emote_display.h"
+#include "settings.h"
+#include "partition_writer.h"
 
 #include <esp_log.h>
 #include <spi_flash_mmap.h>
 #include <esp_timer.h>
 #include <cbin_font.h>
+#include <mbedtls/sha256.h>
+#include <esp_rom_crc.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
 
 
 #define TAG "Assets"
 
-struct mmap_assets_table {
-    char asset_name[32];          /*!< Name of the asset */
-    uint32_t asset_size;          /*!< Size of the asset */
-    uint32_t asset_offset;        /*!< Offset of the asset */
-    uint16_t asset_width;         /*!< Width of the asset */
-    uint16_t asset_height;        /*!< Height of the asset */
-};
-
-
 Assets::Assets() {
     // Initialize the partition
     InitializePartition();
@@ -34,17 +32,58 @@ Assets::~Assets() {
 }
 
 uint32_t Assets::CalculateChecksum(const char* data, uint32_t length) {
-    uint32_t checksum = 0;
-    for (uint32_t i = 0; i < length; i++) {
+    return UpdateChecksum(0, (const uint8_t*)data, length) & 0xFFFF;
+}
+
+// The checksum is the 16-bit sum of all bytes, added four bytes at a time in two 16-bit lanes
+uint32_t Assets::UpdateChecksum(uint32_t checksum, const uint8_t* data, size_t length) {
+    while (length > 0 && ((uintptr_t)data & 3) != 0) {
+        checksum += *data++;
+        length--;
+    }
+    auto words = (const uint32_t*)data;
+    size_t word_count = length / 4;
+    while (word_count > 0) {
+        // Each word adds at most 2 * 255 to a lane, fold before the 16-bit lanes overflow
+        size_t n = std::min<size_t>(word_count, 128);
+        uint32_t lanes = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t word = words[i];
+            lanes += (word & 0x00FF00FF) + ((word >> 8) & 0x00FF00FF);
+        }
+        checksum += (lanes & 0xFFFF) + (lanes >> 16);
+        words += n;
+        word_count -= n;
+    }
+    data = (const uint8_t*)words;
+    for (size_t i = 0; i < length % 4; i++) {
         checksum += data[i];
     }
-    return checksum & 0xFFFF;
+    return checksum;
 }
 
-bool Assets::InitializePartition() {
+// A partition verified once, by a download or a full checksum scan, is identified by its header
+// and file table, so later boots skip the scan of the whole partition
+std::string Assets::GetVerifiedMarker(uint32_t stored_files, uint32_t stored_len, uint32_t stored_chksum) {
+    size_t table_len = 12 + stored_files * sizeof(mmap_assets_table);
+    if (table_len > partition_->size) {
+        return "";
+    }
+    uint8_t hash[32];
+    mbedtls_sha256((const unsigned char*)mmap_root_, table_len, hash, 0);
+    char marker[96];
+    int len = snprintf(marker, sizeof(marker), "%lu:%lu:", stored_len, stored_chksum);
+    for (int i = 0; i < 16; i++) {
+        len += snprintf(marker + len, sizeof(marker) - len, "%02x", hash[i]);
+    }
+    return marker;
+}
+
+bool Assets::InitializePartition(bool checksum_verified) {
     partition_valid_ = false;
     checksum_valid_ = false;
-    assets_.clear();
+    index_.clear();
+    asset_states_.clear();
 
     partition_ = esp_partition_find_first(ESP_PARTITION_TYPE_ANY, ESP_PARTITION_SUBTYPE_ANY, "assets");
     if (partition_ == nullptr) {
@@ -79,28 +118,124 @@ bool Assets::InitializePartition() {
     }
 
     auto start_time = esp_timer_get_time();
-    uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
-    auto end_time = esp_timer_get_time();
-    ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+    stored_files_ = stored_files;
+    stored_len_ = stored_len;
+    if (LoadIndex()) {
+        // v2: every asset is checked against its CRC32 when it is used for the first time
+        ESP_LOGI(TAG, "Loaded the index of %u assets in %d us", index_.size(), int(esp_timer_get_time() - start_time));
+        checksum_valid_ = true;
+        return true;
+    }
 
-    if (calculated_checksum != stored_chksum) {
-        ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
-        return false;
+    auto marker = GetVerifiedMarker(stored_files, stored_len, stored_chksum);
+    Settings settings("assets", true);
+    if (!checksum_verified && (marker.empty() || settings.GetString("verified") != marker)) {
+        uint32_t calculated_checksum = CalculateChecksum(mmap_root_ + 12, stored_len);
+        auto end_time = esp_timer_get_time();
+        ESP_LOGI(TAG, "The checksum calculation time is %d ms", int((end_time - start_time) / 1000));
+
+        if (calculated_checksum != stored_chksum) {
+            ESP_LOGE(TAG, "The calculated checksum (0x%lx) does not match the stored checksum (0x%lx)", calculated_checksum, stored_chksum);
+            return false;
+        }
+    }
+    if (!marker.empty() && settings.GetString("verified") != marker) {
+        settings.SetString("verified", marker);
     }
 
     checksum_valid_ = true;
 
+    // v1: build the same sorted index in RAM, the whole partition checksum stands in for the CRCs
+    index_.resize(stored_files);
     for (uint32_t i = 0; i < stored_files; i++) {
-        auto item = (const mmap_assets_table*)(mmap_root_ + 12 + i * sizeof(mmap_assets_table));
-        auto asset = Asset{
-            .size = static_cast<size_t>(item->asset_size),
-            .offset = static_cast<size_t>(12 + sizeof(mmap_assets_table) * stored_files + item->asset_offset)
+        auto item = GetTableItem(i);
+        index_[i] = {
+            .name_hash = HashName(item->asset_name, strnlen(item->asset_name, sizeof(item->asset_name))),
+            .table_index = i,
+            .crc32 = 0,
         };
-        assets_[item->asset_name] = asset;
     }
+    std::sort(index_.begin(), index_.end(), [](const AssetIndexEntry& a, const AssetIndexEntry& b) {
+        return a.name_hash < b.name_hash;
+    });
+    ESP_LOGI(TAG, "Indexed %lu assets in %d us", stored_files, int(esp_timer_get_time() - start_time));
     return checksum_valid_;
 }
 
+const mmap_assets_table* Assets::GetTableItem(uint32_t index) const {
+    return (const mmap_assets_table*)(mmap_root_ + 12 + index * sizeof(mmap_assets_table));
+}
+
+// FNV-1a, the same hash as scripts/build_default_assets.py
+uint32_t Assets::HashName(const char* name, size_t length) {
+    uint32_t hash = 0x811c9dc5;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)name[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+// Returns the asset data after its "ZZ" prefix, or nullptr if the table entry points outside the partition
+const char* Assets::GetItemData(const mmap_assets_table* item) const {
+    size_t data_offset = 12 + sizeof(mmap_assets_table) * stored_files_;
+    if ((uint64_t)data_offset + item->asset_offset + item->asset_size + 2 > 12 + (uint64_t)stored_len_) {
+        return nullptr;
+    }
+    auto data = mmap_root_ + data_offset + item->asset_offset;
+    if (data[0] != 'Z' || data[1] != 'Z') {
+        return nullptr;
+    }
+    return data + 2;
+}
+
+// The v2 index is the last asset, a pack without it is read like before
+bool Assets::LoadIndex() {
+    struct IndexHeader {
+        char magic[4];
+        uint32_t count;
+        uint32_t crc32;
+        uint32_t reserved;
+    };
+
+    index_.clear();
+    asset_states_.clear();
+    if (stored_files_ == 0 || 12 + sizeof(mmap_assets_table) * stored_files_ > 12 + stored_len_) {
+        return false;
+    }
+    auto item = GetTableItem(stored_files_ - 1);
+    if (strncmp(item->asset_name, ASSETS_INDEX_NAME, sizeof(item->asset_name)) != 0) {
+        return false;
+    }
+    auto data = GetItemData(item);
+    IndexHeader header;
+    if (data == nullptr || item->asset_size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, "AIX2", 4) != 0 || header.count != stored_files_ - 1 ||
+        item->asset_size != sizeof(header) + header.count * sizeof(AssetIndexEntry)) {
+        ESP_LOGW(TAG, "Unsupported assets index");
+        return false;
+    }
+
+    index_.resize(header.count);
+    memcpy(index_.data(), data + sizeof(header), header.count * sizeof(AssetIndexEntry));
+    if (esp_rom_crc32_le(0, (const uint8_t*)index_.data(), header.count * sizeof(AssetIndexEntry)) != header.crc32) {
+        ESP_LOGE(TAG, "The assets index is corrupted");
+        index_.clear();
+        return false;
+    }
+    for (auto& entry : index_) {
+        if (entry.table_index >= header.count) {
+            ESP_LOGE(TAG, "The assets index is corrupted");
+            index_.clear();
+            return false;
+        }
+    }
+    asset_states_.assign(header.count, kAssetUnchecked);
+    return true;
+}
+
 bool Assets::Apply() {
     void* ptr = nullptr;
     size_t size = 0;
@@ -377,7 +512,16 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
         mmap_root_ = nullptr;
     }
     checksum_valid_ = false;
-    assets_.clear();
+    index_.clear();
+    asset_states_.clear();
+
+    // 下载前清除校验标记，下载中断时启动会重新完整校验
+    {
+        Settings settings("assets", true);
+        settings.EraseKey("verified");
+        // The marker must be gone from flash before the partition is erased
+        Settings::Commit();
+    }
 
     // 下载新的资源文件
     auto network = Board::GetInstance().GetNetwork();
@@ -404,75 +548,56 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
         return false;
     }
 
-    // 定义扇区大小为4KB（ESP32的标准扇区大小）
-    const size_t SECTOR_SIZE = esp_partition_get_main_flash_sector_size();
-    
-    // 计算需要擦除的扇区数量
-    size_t sectors_to_erase = (content_length + SECTOR_SIZE - 1) / SECTOR_SIZE; // 向上取整
-    size_t total_erase_size = sectors_to_erase * SECTOR_SIZE;
-    
-    ESP_LOGI(TAG, "Sector size: %u, content length: %u, sectors to erase: %u, total erase size: %u", 
-             SECTOR_SIZE, content_length, sectors_to_erase, total_erase_size);
-    
-    // 写入新的资源文件到分区，一边erase一边写入
-    char buffer[512];
+    // 网络读取填充缓冲区的同时，写入任务按 64KB 块提前擦除并写入上一个缓冲区
+    PartitionWriter writer(partition_);
+    if (!writer.Begin(0)) {
+        return false;
+    }
+
+    // 边下载边计算文件头中的 16 位校验和，下载完成后无需再扫描整个分区
+    uint32_t header[3] = {};
+    uint32_t checksum = 0;
+
     size_t total_written = 0;
     size_t recent_written = 0;
-    size_t current_sector = 0;
     auto last_calc_time = esp_timer_get_time();
-    
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
-        }
-
-        if (ret == 0) {
+    bool read_error = false;
+    while (total_written < content_length && !read_error) {
+        auto buffer = writer.Acquire();
+        if (buffer == nullptr) {
             break;
         }
-
-        // 检查是否需要擦除新的扇区
-        size_t write_end_offset = total_written + ret;
-        size_t needed_sectors = (write_end_offset + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        
-        // 擦除需要的新扇区
-        while (current_sector < needed_sectors) {
-            size_t sector_start = current_sector * SECTOR_SIZE;
-            size_t sector_end = (current_sector + 1) * SECTOR_SIZE;
-            
-            // 确保擦除范围不超过分区大小
-            if (sector_end > partition_->size) {
-                ESP_LOGE(TAG, "Sector end (%u) exceeds partition size (%lu)", sector_end, partition_->size);
-                return false;
-            }
-            
-            ESP_LOGD(TAG, "Erasing sector %u (offset: %u, size: %u)", current_sector, sector_start, SECTOR_SIZE);
-            esp_err_t err = esp_partition_erase_range(partition_, sector_start, SECTOR_SIZE);
-            if (err != ESP_OK) {
-                ESP_LOGE(TAG, "Failed to erase sector %u at offset %u: %s", current_sector, sector_start, esp_err_to_name(err));
-                return false;
+        while (buffer->len < writer.buffer_size() && total_written + buffer->len < content_length) {
+            size_t size = std::min(writer.buffer_size() - buffer->len, content_length - total_written - buffer->len);
+            int ret = http->Read((char*)buffer->data + buffer->len, size);
+            if (ret <= 0) {
+                ESP_LOGE(TAG, "Failed to read HTTP data: %d", ret);
+                read_error = true;
+                break;
             }
-            
-            current_sector++;
+            buffer->len += ret;
         }
 
-        // 写入数据到分区
-        esp_err_t err = esp_partition_write(partition_, total_written, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write to assets partition at offset %u: %s", total_written, esp_err_to_name(err));
-            return false;
+        const uint8_t* data = buffer->data;
+        size_t len = buffer->len;
+        // 前 12 字节是文件数、校验和与数据长度，不参与校验和
+        if (total_written < sizeof(header)) {
+            size_t n = std::min(len, sizeof(header) - total_written);
+            memcpy((uint8_t*)header + total_written, data, n);
+            data += n;
+            len -= n;
         }
+        checksum = UpdateChecksum(checksum, data, len);
 
-        total_written += ret;
-        recent_written += ret;
+        total_written += buffer->len;
+        recent_written += buffer->len;
+        writer.Submit(buffer);
 
         // 计算进度和速度
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || total_written == content_length || ret == 0) {
+        if (esp_timer_get_time() - last_calc_time >= 1000000 || total_written == content_length) {
             size_t progress = total_written * 100 / content_length;
             size_t speed = recent_written; // 每秒的字节数
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s, Sectors erased: %u", 
-                     progress, total_written, content_length, speed, current_sector);
+            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %u B/s", progress, total_written, content_length, speed);
             if (progress_callback) {
                 progress_callback(progress, speed);
             }
@@ -480,19 +605,28 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
             recent_written = 0; // 重置最近写入的字节数
         }
     }
-    
     http->Close();
 
+    if (!writer.Flush()) {
+        ESP_LOGE(TAG, "Failed to write assets partition");
+        return false;
+    }
+
     if (total_written != content_length) {
         ESP_LOGE(TAG, "Downloaded size (%u) does not match expected size (%u)", total_written, content_length);
         return false;
     }
 
-    ESP_LOGI(TAG, "Assets download completed, total written: %u bytes, total sectors erased: %u", 
-             total_written, current_sector);
+    uint32_t stored_len = header[2];
+    if (stored_len != content_length - sizeof(header) || (checksum & 0xFFFF) != header[1]) {
+        ESP_LOGE(TAG, "Assets checksum mismatch, calculated 0x%lx, stored 0x%lx", checksum & 0xFFFF, header[1]);
+        return false;
+    }
+
+    ESP_LOGI(TAG, "Assets download completed, total written: %u bytes", total_written);
 
-    // 重新初始化资源分区
-    if (!InitializePartition()) {
+    // 重新初始化资源分区，校验和已在下载时验证，不再扫描整个分区
+    if (!InitializePartition(true)) {
         ESP_LOGE(TAG, "Failed to re-initialize assets partition");
         return false;
     }
@@ -501,17 +635,38 @@ bool Assets::Download(std::string url, std::function<void(int progress, size_t s
 }
 
 bool Assets::GetAssetData(const std::string& name, void*& ptr, size_t& size) {
-    auto asset = assets_.find(name);
-    if (asset == assets_.end()) {
-        return false;
-    }
-    auto data = (const char*)(mmap_root_ + asset->second.offset);
-    if (data[0] != 'Z' || data[1] != 'Z') {
-        ESP_LOGE(TAG, "The asset %s is not valid with magic %02x%02x", name.c_str(), data[0], data[1]);
+    if (name.size() > sizeof(mmap_assets_table::asset_name)) {
         return false;
     }
+    uint32_t hash = HashName(name.data(), name.size());
+    auto it = std::lower_bound(index_.begin(), index_.end(), hash, [](const AssetIndexEntry& entry, uint32_t hash) {
+        return entry.name_hash < hash;
+    });
+    for (; it != index_.end() && it->name_hash == hash; ++it) {
+        auto item = GetTableItem(it->table_index);
+        if (strncmp(item->asset_name, name.c_str(), sizeof(item->asset_name)) != 0) {
+            continue;
+        }
 
-    ptr = static_cast<void*>(const_cast<char*>(data + 2));
-    size = asset->second.size;
-    return true;
+        auto data = GetItemData(item);
+        if (data == nullptr) {
+            ESP_LOGE(TAG, "The asset %s is not valid", name.c_str());
+            return false;
+        }
+        // Only v2 packs have per-asset CRCs, v1 packs were checked as a whole
+        if (!asset_states_.empty() && asset_states_[it->table_index] != kAssetValid) {
+            if (asset_states_[it->table_index] == kAssetInvalid ||
+                esp_rom_crc32_le(0, (const uint8_t*)data, item->asset_size) != it->crc32) {
+                ESP_LOGE(TAG, "The asset %s does not match its CRC32", name.c_str());
+                asset_states_[it->table_index] = kAssetInvalid;
+                return false;
+            }
+            asset_states_[it->table_index] = kAssetValid;
+        }
+
+        ptr = static_cast<void*>(const_cast<char*>(data));
+        size = item->asset_size;
+        return true;
+    }
+    return false;
 }
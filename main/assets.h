@@ -1,7 +1,7 @@
 #ifndef ASSETS_H
 #define ASSETS_H
 
-#include <map>
+#include <vector>
 #include <string>
 #include <functional>
 
@@ -10,9 +10,21 @@
 #include <model_path.h>
 
 
-struct Asset {
-    size_t size;
-    size_t offset;
+struct mmap_assets_table {
+    char asset_name[32];          /*!< Name of the asset */
+    uint32_t asset_size;          /*!< Size of the asset */
+    uint32_t asset_offset;        /*!< Offset of the asset */
+    uint16_t asset_width;         /*!< Width of the asset */
+    uint16_t asset_height;        /*!< Height of the asset */
+};
+
+// v2 packs end with this asset: entries sorted by name hash, with the CRC32 of every asset
+#define ASSETS_INDEX_NAME ".assets_index"
+
+struct AssetIndexEntry {
+    uint32_t name_hash;
+    uint32_t table_index;
+    uint32_t crc32;
 };
 
 class Assets {
@@ -36,8 +48,15 @@ private:
     Assets(const Assets&) = delete;
     Assets& operator=(const Assets&) = delete;
 
-    bool InitializePartition();
+    // checksum_verified skips the checksum scan, after a download that already checked it
+    bool InitializePartition(bool checksum_verified = false);
     uint32_t CalculateChecksum(const char* data, uint32_t length);
+    static uint32_t UpdateChecksum(uint32_t checksum, const uint8_t* data, size_t length);
+    std::string GetVerifiedMarker(uint32_t stored_files, uint32_t stored_len, uint32_t stored_chksum);
+    bool LoadIndex();
+    const mmap_assets_table* GetTableItem(uint32_t index) const;
+    const char* GetItemData(const mmap_assets_table* item) const;
+    static uint32_t HashName(const char* name, size_t length);
 
     const esp_partition_t* partition_ = nullptr;
     esp_partition_mmap_handle_t mmap_handle_ = 0;
@@ -46,7 +65,18 @@ private:
     bool checksum_valid_ = false;
     std::string default_assets_url_;
     srmodel_list_t* models_list_ = nullptr;
-    std::map<std::string, Asset> assets_;
+    uint32_t stored_files_ = 0;
+    uint32_t stored_len_ = 0;
+
+    // Sorted by name hash, looked up with a binary search
+    std::vector<AssetIndexEntry> index_;
+    // Per table entry CRC32 state of a v2 pack, empty for v1 packs
+    enum AssetState : uint8_t {
+        kAssetUnchecked,
+        kAssetValid,
+        kAssetInvalid,
+    };
+    std::vector<AssetState> asset_states_;
 };
 
 #endif
@@ -1,6 +1,8 @@
 #include "audio_service.h"
+#include "audio_packet_pool.h"
 #include <esp_log.h>
 #include <cstring>
+#include <algorithm>
 
 #if CONFIG_USE_AUDIO_PROCESSOR
 #include "processors/afe_audio_processor.h"
@@ -34,13 +36,13 @@ void AudioService::Initialize(AudioCodec* codec) {
     codec_->Start();
 
     /* Setup the audio codec */
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(codec->output_sample_rate(), 1, OPUS_FRAME_DURATION_MS);
+    decoder_pool_ = std::make_unique<OpusDecoderPool>(codec->output_sample_rate());
+    decoder_ = decoder_pool_->Get(codec->output_sample_rate(), OPUS_FRAME_DURATION_MS);
     opus_encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, OPUS_FRAME_DURATION_MS);
     opus_encoder_->SetComplexity(0);
 
     if (codec->input_sample_rate() != 16000) {
-        input_resampler_.Configure(codec->input_sample_rate(), 16000);
-        reference_resampler_.Configure(codec->input_sample_rate(), 16000);
+        input_resampler_.Configure(codec->input_sample_rate(), 16000, codec->input_channels());
     }
 
 #if CONFIG_USE_AUDIO_PROCESSOR
@@ -79,6 +81,9 @@ void AudioService::Start() {
 
     esp_timer_start_periodic(audio_power_timer_, 1000000);
 
+    /* Other tasks read the handles under the lock, hold it until xTaskCreate has written them */
+    std::lock_guard<std::mutex> lock(task_handle_mutex_);
+
 #if CONFIG_USE_AUDIO_PROCESSOR
     /* Start the audio input task */
     xTaskCreatePinnedToCore([](void* arg) {
@@ -124,12 +129,46 @@ void AudioService::Stop() {
         AS_EVENT_WAKE_WORD_RUNNING |
         AS_EVENT_AUDIO_PROCESSOR_RUNNING);
 
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    audio_encode_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    CancelSounds();
+    audio_encode_queue_.RequestClear();
+    audio_decode_queue_.RequestClear();
+    audio_playback_queue_.RequestClear();
+    audio_testing_queue_.RequestClear();
+
+    /* Wake up the consumers and any producer waiting for space so they can see the stop flag */
+    xEventGroupSetBits(event_group_, AS_EVENT_ENCODE_QUEUE_SPACE | AS_EVENT_DECODE_QUEUE_SPACE);
+    NotifyTask(audio_output_task_handle_);
+    NotifyTask(opus_codec_task_handle_);
+}
+
+void AudioService::NotifyTask(TaskHandle_t& task) {
+    std::lock_guard<std::mutex> lock(task_handle_mutex_);
+    if (task != nullptr) {
+        xTaskNotifyGive(task);
+    }
+}
+
+void AudioService::ClearTaskHandle(TaskHandle_t& task) {
+    std::lock_guard<std::mutex> lock(task_handle_mutex_);
+    task = nullptr;
+}
+
+// Block the calling producer until has_space() holds, returns false if the service is stopped or the timeout expires
+bool AudioService::WaitForQueueSpace(EventBits_t bit, const std::function<bool()>& has_space, TickType_t timeout) {
+    TimeOut_t time_out;
+    vTaskSetTimeOutState(&time_out);
+    while (!service_stopped_) {
+        // Clear before checking, so a pop between the check and the wait is not missed
+        xEventGroupClearBits(event_group_, bit);
+        if (has_space()) {
+            return true;
+        }
+        if (xTaskCheckForTimeOut(&time_out, &timeout) == pdTRUE) {
+            return false;
+        }
+        xEventGroupWaitBits(event_group_, bit, pdTRUE, pdFALSE, timeout);
+    }
+    return false;
 }
 
 bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples) {
@@ -140,31 +179,13 @@ bool AudioService::ReadAudioData(std::vector<int16_t>& data, int sample_rate, in
     }
 
     if (codec_->input_sample_rate() != sample_rate) {
-        data.resize(samples * codec_->input_sample_rate() / sample_rate * codec_->input_channels());
-        if (!codec_->InputData(data)) {
+        int channels = codec_->input_channels();
+        input_buffer_.resize(samples * codec_->input_sample_rate() / sample_rate * channels);
+        if (!codec_->InputData(input_buffer_)) {
             return false;
         }
-        if (codec_->input_channels() == 2) {
-            auto mic_channel = std::vector<int16_t>(data.size() / 2);
-            auto reference_channel = std::vector<int16_t>(data.size() / 2);
-            for (size_t i = 0, j = 0; i < mic_channel.size(); ++i, j += 2) {
-                mic_channel[i] = data[j];
-                reference_channel[i] = data[j + 1];
-            }
-            auto resampled_mic = std::vector<int16_t>(input_resampler_.GetOutputSamples(mic_channel.size()));
-            auto resampled_reference = std::vector<int16_t>(reference_resampler_.GetOutputSamples(reference_channel.size()));
-            input_resampler_.Process(mic_channel.data(), mic_channel.size(), resampled_mic.data());
-            reference_resampler_.Process(reference_channel.data(), reference_channel.size(), resampled_reference.data());
-            data.resize(resampled_mic.size() + resampled_reference.size());
-            for (size_t i = 0, j = 0; i < resampled_mic.size(); ++i, j += 2) {
-                data[j] = resampled_mic[i];
-                data[j + 1] = resampled_reference[i];
-            }
-        } else {
-            auto resampled = std::vector<int16_t>(input_resampler_.GetOutputSamples(data.size()));
-            input_resampler_.Process(data.data(), data.size(), resampled.data());
-            data = std::move(resampled);
-        }
+        // Deinterleave, resample and reinterleave all channels straight into data
+        input_resampler_.Process(input_buffer_.data(), input_buffer_.size() / channels, data);
     } else {
         data.resize(samples * codec_->input_channels());
         if (!codec_->InputData(data)) {
@@ -258,16 +279,18 @@ void AudioService::AudioInputTask() {
 
 void AudioService::AudioOutputTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() { return !audio_playback_queue_.empty() || service_stopped_; });
         if (service_stopped_) {
             break;
         }
 
-        auto task = std::move(audio_playback_queue_.front());
-        audio_playback_queue_.pop_front();
-        audio_queue_cv_.notify_all();
-        lock.unlock();
+        auto task = audio_playback_queue_.Pop();
+        if (!task) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+        /* The opus codec task may be waiting for playback space */
+        NotifyTask(opus_codec_task_handle_);
+        AUDIO_TRACE(kTracePlaybackDequeue, task->trace_id, 0);
 
         if (!codec_->output_enabled()) {
             esp_timer_stop(audio_power_timer_);
@@ -275,6 +298,7 @@ void AudioService::AudioOutputTask() {
             codec_->EnableOutput(true);
         }
         codec_->OutputData(task->pcm);
+        AUDIO_TRACE(kTraceSpeakerDone, task->trace_id, 0);
 
         /* Update the last output time */
         last_output_time_ = std::chrono::steady_clock::now();
@@ -283,106 +307,139 @@ void AudioService::AudioOutputTask() {
 #if CONFIG_USE_SERVER_AEC
         /* Record the timestamp for server AEC */
         if (task->timestamp > 0) {
-            lock.lock();
+            std::lock_guard<std::mutex> lock(timestamp_mutex_);
             timestamp_queue_.push_back(task->timestamp);
         }
 #endif
     }
 
+    ClearTaskHandle(audio_output_task_handle_);
     ESP_LOGW(TAG, "Audio output task stopped");
 }
 
 void AudioService::OpusCodecTask() {
     while (true) {
-        std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-        audio_queue_cv_.wait(lock, [this]() {
-            return service_stopped_ ||
-                (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) ||
-                (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE);
-        });
         if (service_stopped_) {
             break;
         }
 
-        /* Decode the audio from decode queue */
-        if (!audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE) {
-            auto packet = std::move(audio_decode_queue_.front());
-            audio_decode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
+        if (sound_playing_) {
+            FeedSoundPackets();
+        }
 
-            auto task = std::make_unique<AudioTask>();
-            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
-            task->timestamp = packet->timestamp;
-
-            SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
-            if (opus_decoder_->Decode(std::move(packet->payload), task->pcm)) {
-                // Resample if the sample rate is different
-                if (opus_decoder_->sample_rate() != codec_->output_sample_rate()) {
-                    int target_size = output_resampler_.GetOutputSamples(task->pcm.size());
-                    std::vector<int16_t> resampled(target_size);
-                    output_resampler_.Process(task->pcm.data(), task->pcm.size(), resampled.data());
-                    task->pcm = std::move(resampled);
+        bool can_decode = !audio_decode_queue_.empty() && audio_playback_queue_.size() < MAX_PLAYBACK_TASKS_IN_QUEUE;
+        bool send_queue_full = audio_send_queue_.size() >= MAX_SEND_PACKETS_IN_QUEUE;
+        bool can_encode = !audio_encode_queue_.empty() && !send_queue_full;
+        if (send_queue_full != send_queue_congested_) {
+            /* Encoding resumes when the sender pops a packet, which wakes this task */
+            send_queue_congested_ = send_queue_full;
+            if (send_queue_full) {
+                debug_statistics_.send_stall_count++;
+                ESP_LOGW(TAG, "Send queue is full, encoding paused until the network catches up");
+            }
+        }
+        if (!can_decode && !can_encode) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        /* Decode the audio from decode queue */
+        if (can_decode) {
+            auto packet = audio_decode_queue_.Pop();
+            if (packet) {
+                xEventGroupSetBits(event_group_, AS_EVENT_DECODE_QUEUE_SPACE);
+                AUDIO_TRACE(kTraceDecodeDequeue, packet->trace_id, 0);
+
+                auto task = std::make_unique<AudioTask>();
+                task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+                task->timestamp = packet->timestamp;
+                task->trace_id = packet->trace_id;
+
+                if (decoder_reset_pending_.exchange(false)) {
+                    decoder_->decoder->ResetState();
+                }
+                SetDecodeSampleRate(packet->sample_rate, packet->frame_duration);
+                /* This packet may go through the pooled decoder of a prompt being decoded, which must not be cached then */
+                if (sound_pcm_ && !sound_pcm_->complete) {
+                    sound_cache_.DetachPending();
                 }
+                // An empty payload marks a lost packet, the decoder fills it with concealment
+                if (decoder_->decoder->Decode(std::move(packet->payload), task->pcm)) {
+                    // Resample if the sample rate is different
+                    if (decoder_->need_resample) {
+                        int target_size = decoder_->resampler.GetOutputSamples(task->pcm.size());
+                        std::vector<int16_t> resampled(target_size);
+                        decoder_->resampler.Process(task->pcm.data(), task->pcm.size(), resampled.data());
+                        task->pcm = std::move(resampled);
+                    }
 
-                lock.lock();
-                audio_playback_queue_.push_back(std::move(task));
-                audio_queue_cv_.notify_all();
-            } else {
-                ESP_LOGE(TAG, "Failed to decode audio");
-                lock.lock();
+                    AUDIO_TRACE(kTracePlaybackEnqueue, task->trace_id, audio_playback_queue_.size());
+                    if (audio_playback_queue_.Push(task)) {
+                        NotifyTask(audio_output_task_handle_);
+                    } else {
+                        ESP_LOGW(TAG, "Playback queue is full, dropping decoded audio");
+                    }
+                } else {
+                    ESP_LOGE(TAG, "Failed to decode audio");
+                }
+                AudioPacketPool::GetInstance().Release(std::move(packet));
+                debug_statistics_.decode_count++;
             }
-            debug_statistics_.decode_count++;
         }
-        
+
         /* Encode the audio to send queue */
-        if (!audio_encode_queue_.empty() && audio_send_queue_.size() < MAX_SEND_PACKETS_IN_QUEUE) {
-            auto task = std::move(audio_encode_queue_.front());
-            audio_encode_queue_.pop_front();
-            audio_queue_cv_.notify_all();
-            lock.unlock();
+        if (can_encode) {
+            auto task = audio_encode_queue_.Pop();
+            if (!task) {
+                continue;
+            }
+            xEventGroupSetBits(event_group_, AS_EVENT_ENCODE_QUEUE_SPACE);
+            AUDIO_TRACE(kTraceEncodeDequeue, task->trace_id, 0);
 
-            auto packet = std::make_unique<AudioStreamPacket>();
+            auto packet = AudioPacketPool::GetInstance().Acquire();
             packet->frame_duration = OPUS_FRAME_DURATION_MS;
             packet->sample_rate = 16000;
             packet->timestamp = task->timestamp;
+            packet->trace_id = task->trace_id;
             if (!opus_encoder_->Encode(std::move(task->pcm), packet->payload)) {
                 ESP_LOGE(TAG, "Failed to encode audio");
+                AudioPacketPool::GetInstance().Release(std::move(packet));
                 continue;
             }
 
             if (task->type == kAudioTaskTypeEncodeToSendQueue) {
-                {
-                    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                    audio_send_queue_.push_back(std::move(packet));
-                }
-                if (callbacks_.on_send_queue_available) {
+                AUDIO_TRACE(kTraceSendEnqueue, packet->trace_id, audio_send_queue_.size());
+                if (!audio_send_queue_.Push(packet)) {
+                    ESP_LOGW(TAG, "Send queue is full, dropping encoded audio");
+                    AudioPacketPool::GetInstance().Release(std::move(packet));
+                } else if (callbacks_.on_send_queue_available) {
                     callbacks_.on_send_queue_available();
                 }
             } else if (task->type == kAudioTaskTypeEncodeToTestingQueue) {
-                std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-                audio_testing_queue_.push_back(std::move(packet));
+                if (!audio_testing_queue_.Push(packet)) {
+                    AudioPacketPool::GetInstance().Release(std::move(packet));
+                }
+            } else {
+                AudioPacketPool::GetInstance().Release(std::move(packet));
             }
             debug_statistics_.encode_count++;
-            lock.lock();
         }
     }
 
+    ClearTaskHandle(opus_codec_task_handle_);
     ESP_LOGW(TAG, "Opus codec task stopped");
 }
 
 void AudioService::SetDecodeSampleRate(int sample_rate, int frame_duration) {
-    if (opus_decoder_->sample_rate() == sample_rate && opus_decoder_->duration_ms() == frame_duration) {
+    if (decoder_->decoder->sample_rate() == sample_rate && decoder_->decoder->duration_ms() == frame_duration) {
         return;
     }
 
-    opus_decoder_.reset();
-    opus_decoder_ = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
-
-    auto codec = Board::GetInstance().GetAudioCodec();
-    if (opus_decoder_->sample_rate() != codec->output_sample_rate()) {
-        ESP_LOGI(TAG, "Resampling audio from %d to %d", opus_decoder_->sample_rate(), codec->output_sample_rate());
-        output_resampler_.Configure(opus_decoder_->sample_rate(), codec->output_sample_rate());
+    /* Switch to a warm decoder for this format, a new one is only created the first time a format shows up */
+    uint32_t creations = decoder_pool_->creations();
+    decoder_ = decoder_pool_->Get(sample_rate, frame_duration);
+    if (decoder_pool_->creations() != creations) {
+        ESP_LOGI(TAG, "Created decoder for %d Hz / %d ms, %lu decoders created", sample_rate, frame_duration, decoder_pool_->creations());
     }
 }
 
@@ -390,47 +447,73 @@ void AudioService::PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t
     auto task = std::make_unique<AudioTask>();
     task->type = type;
     task->pcm = std::move(pcm);
-    
-    /* Push the task to the encode queue */
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        task->trace_id = AUDIO_TRACE_NEW_ID();
+    }
+
+    std::lock_guard<std::mutex> lock(encode_producer_mutex_);
 
     /* If the task is to send queue, we need to set the timestamp */
-    if (type == kAudioTaskTypeEncodeToSendQueue && !timestamp_queue_.empty()) {
-        if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
-            task->timestamp = timestamp_queue_.front();
-        } else {
-            ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+    if (type == kAudioTaskTypeEncodeToSendQueue) {
+        std::lock_guard<std::mutex> timestamp_lock(timestamp_mutex_);
+        if (!timestamp_queue_.empty()) {
+            if (timestamp_queue_.size() <= MAX_TIMESTAMPS_IN_QUEUE) {
+                task->timestamp = timestamp_queue_.front();
+            } else {
+                ESP_LOGW(TAG, "Timestamp queue (%u) is full, dropping timestamp", timestamp_queue_.size());
+            }
+            timestamp_queue_.pop_front();
         }
-        timestamp_queue_.pop_front();
     }
 
-    audio_queue_cv_.wait(lock, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; });
-    audio_encode_queue_.push_back(std::move(task));
-    audio_queue_cv_.notify_all();
+    /* Push the task to the encode queue, the input task must not stall behind a paused encoder */
+    if (!WaitForQueueSpace(AS_EVENT_ENCODE_QUEUE_SPACE, [this]() { return audio_encode_queue_.size() < MAX_ENCODE_TASKS_IN_QUEUE; },
+            pdMS_TO_TICKS(AUDIO_ENCODE_QUEUE_WAIT_MS))) {
+        if (!service_stopped_) {
+            if (debug_statistics_.encode_drop_count++ % 50 == 0) {
+                ESP_LOGW(TAG, "Encode queue is full, dropping input audio (%lu dropped)", debug_statistics_.encode_drop_count);
+            }
+        }
+        return;
+    }
+    AUDIO_TRACE(kTraceEncodeEnqueue, task->trace_id, audio_encode_queue_.size());
+    if (!audio_encode_queue_.Push(task)) {
+        ESP_LOGW(TAG, "Encode queue is full, dropping input audio");
+        return;
+    }
+    NotifyTask(opus_codec_task_handle_);
 }
 
 bool AudioService::PushPacketToDecodeQueue(std::unique_ptr<AudioStreamPacket> packet, bool wait) {
-    std::unique_lock<std::mutex> lock(audio_queue_mutex_);
-    if (audio_decode_queue_.size() >= MAX_DECODE_PACKETS_IN_QUEUE) {
-        if (wait) {
-            audio_queue_cv_.wait(lock, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; });
-        } else {
+    while (true) {
+        {
+            std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+            if (audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE) {
+                AUDIO_TRACE(kTraceDecodeEnqueue, packet->trace_id, audio_decode_queue_.size());
+                if (!audio_decode_queue_.Push(packet)) {
+                    AudioPacketPool::GetInstance().Release(std::move(packet));
+                    return false;
+                }
+                break;
+            }
+        }
+        /* Wait without holding the producer lock, so the network task is never blocked by a waiting caller */
+        if (!wait || !WaitForQueueSpace(AS_EVENT_DECODE_QUEUE_SPACE, [this]() { return audio_decode_queue_.size() < MAX_DECODE_PACKETS_IN_QUEUE; })) {
+            AudioPacketPool::GetInstance().Release(std::move(packet));
             return false;
         }
     }
-    audio_decode_queue_.push_back(std::move(packet));
-    audio_queue_cv_.notify_all();
+    NotifyTask(opus_codec_task_handle_);
     return true;
 }
 
 std::unique_ptr<AudioStreamPacket> AudioService::PopPacketFromSendQueue() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    if (audio_send_queue_.empty()) {
-        return nullptr;
+    auto packet = audio_send_queue_.Pop();
+    if (packet) {
+        AUDIO_TRACE(kTraceSendDequeue, packet->trace_id, 0);
+        /* The opus codec task may be waiting for send queue space */
+        NotifyTask(opus_codec_task_handle_);
     }
-    auto packet = std::move(audio_send_queue_.front());
-    audio_send_queue_.pop_front();
-    audio_queue_cv_.notify_all();
     return packet;
 }
 
@@ -499,10 +582,18 @@ void AudioService::EnableAudioTesting(bool enable) {
         xEventGroupSetBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
     } else {
         xEventGroupClearBits(event_group_, AS_EVENT_AUDIO_TESTING_RUNNING);
-        /* Copy audio_testing_queue_ to audio_decode_queue_ */
-        std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-        audio_decode_queue_ = std::move(audio_testing_queue_);
-        audio_queue_cv_.notify_all();
+        /* Move audio_testing_queue_ to audio_decode_queue_, the decode ring is sized to hold it all */
+        {
+            std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+            audio_decode_queue_.RequestClear();
+            while (auto packet = audio_testing_queue_.Pop()) {
+                if (!audio_decode_queue_.Push(packet)) {
+                    AudioPacketPool::GetInstance().Release(std::move(packet));
+                    break;
+                }
+            }
+        }
+        NotifyTask(opus_codec_task_handle_);
     }
 }
 
@@ -527,111 +618,125 @@ void AudioService::PlaySound(const std::string_view& ogg) {
         codec_->EnableOutput(true);
     }
 
-    const uint8_t* buf = reinterpret_cast<const uint8_t*>(ogg.data());
-    size_t size = ogg.size();
-    size_t offset = 0;
-
-    auto find_page = [&](size_t start)->size_t {
-        for (size_t i = start; i + 4 <= size; ++i) {
-            if (buf[i] == 'O' && buf[i+1] == 'g' && buf[i+2] == 'g' && buf[i+3] == 'S') return i;
-        }
-        return static_cast<size_t>(-1);
-    };
-
-    bool seen_head = false;
-    bool seen_tags = false;
-    int sample_rate = 16000; // 默认值
+    /* The opus codec task demuxes the sound, so playback starts with the first page and the caller never blocks */
+    {
+        std::lock_guard<std::mutex> lock(sound_mutex_);
+        pending_sounds_.push_back(ogg);
+        sound_playing_ = true;
+    }
+    NotifyTask(opus_codec_task_handle_);
+}
 
+// Runs on the opus codec task, plays cached prompts from PCM and keeps a few packets of other sounds in the decode queue
+void AudioService::FeedSoundPackets() {
     while (true) {
-        size_t pos = find_page(offset);
-        if (pos == static_cast<size_t>(-1)) break;
-        offset = pos;
-        if (offset + 27 > size) break;
-
-        const uint8_t* page = buf + offset;
-        uint8_t page_segments = page[26];
-        size_t seg_table_off = offset + 27;
-        if (seg_table_off + page_segments > size) break;
-
-        size_t body_size = 0;
-        for (size_t i = 0; i < page_segments; ++i) body_size += page[27 + i];
-
-        size_t body_off = seg_table_off + page_segments;
-        if (body_off + body_size > size) break;
-
-        // Parse packets using lacing
-        size_t cur = body_off;
-        size_t seg_idx = 0;
-        while (seg_idx < page_segments) {
-            size_t pkt_len = 0;
-            size_t pkt_start = cur;
-            bool continued = false;
-            do {
-                uint8_t l = page[27 + seg_idx++];
-                pkt_len += l;
-                cur += l;
-                continued = (l == 255);
-            } while (continued && seg_idx < page_segments);
-
-            if (pkt_len == 0) continue;
-            const uint8_t* pkt_ptr = buf + pkt_start;
-
-            if (!seen_head) {
-                // 解析OpusHead包
-                if (pkt_len >= 19 && std::memcmp(pkt_ptr, "OpusHead", 8) == 0) {
-                    seen_head = true;
-                    
-                    // OpusHead结构：[0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
-                    // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
-                    if (pkt_len >= 12) {
-                        uint8_t version = pkt_ptr[8];
-                        uint8_t channel_count = pkt_ptr[9];
-                        
-                        if (pkt_len >= 16) {
-                            // 读取输入采样率 (little-endian)
-                            sample_rate = pkt_ptr[12] | (pkt_ptr[13] << 8) | 
-                                        (pkt_ptr[14] << 16) | (pkt_ptr[15] << 24);
-                            ESP_LOGI(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", 
-                                   version, channel_count, sample_rate);
-                        }
-                    }
+        if (sound_cancelled_.exchange(false)) {
+            sound_demuxer_.reset();
+            sound_pcm_.reset();
+            sound_cache_.CancelDecode();
+        }
+        if (!sound_demuxer_ && !sound_pcm_) {
+            std::string_view ogg;
+            {
+                std::lock_guard<std::mutex> lock(sound_mutex_);
+                if (pending_sounds_.empty()) {
+                    sound_playing_ = false;
+                    return;
                 }
-                continue;
+                ogg = pending_sounds_.front();
+                pending_sounds_.pop_front();
             }
-            if (!seen_tags) {
-                // Expect OpusTags in second packet
-                if (pkt_len >= 8 && std::memcmp(pkt_ptr, "OpusTags", 8) == 0) {
-                    seen_tags = true;
+            sound_pcm_ = sound_cache_.Get(ogg, codec_->output_sample_rate(), decoder_pool_.get());
+            sound_pcm_offset_ = 0;
+            if (!sound_pcm_) {
+                sound_demuxer_ = std::make_unique<OggDemuxer>(ogg);
+            }
+        }
+
+        if (sound_pcm_) {
+            /* Wait for the packets queued before the sound, so the order of playback is kept */
+            if (!audio_decode_queue_.empty() || audio_playback_queue_.size() >= MAX_PLAYBACK_TASKS_IN_QUEUE) {
+                return;
+            }
+            /* A sound missed in the cache is decoded one packet at a time as it plays */
+            if (sound_pcm_offset_ >= sound_pcm_->sample_count) {
+                if (sound_pcm_->complete || !sound_cache_.DecodeNext()) {
+                    sound_pcm_.reset();
+                    continue;
                 }
+            }
+            size_t frame_samples = OPUS_FRAME_DURATION_MS * codec_->output_sample_rate() / 1000;
+            size_t count = std::min(frame_samples, sound_pcm_->sample_count - sound_pcm_offset_);
+            if (count == 0) {
                 continue;
             }
+            auto task = std::make_unique<AudioTask>();
+            task->type = kAudioTaskTypeDecodeToPlaybackQueue;
+            task->timestamp = 0;
+            task->pcm.assign(sound_pcm_->samples + sound_pcm_offset_, sound_pcm_->samples + sound_pcm_offset_ + count);
+            /* Slots of a cleared playback queue are freed by the output task, try again once it pops */
+            if (!audio_playback_queue_.Push(task)) {
+                return;
+            }
+            sound_pcm_offset_ += count;
+            if (sound_pcm_offset_ >= sound_pcm_->sample_count && sound_pcm_->complete) {
+                sound_pcm_.reset();
+            }
+            NotifyTask(audio_output_task_handle_);
+            continue;
+        }
 
-            // Audio packet (Opus)
-            auto packet = std::make_unique<AudioStreamPacket>();
-            packet->sample_rate = sample_rate;
-            packet->frame_duration = 60;
-            packet->payload.resize(pkt_len);
-            std::memcpy(packet->payload.data(), pkt_ptr, pkt_len);
-            PushPacketToDecodeQueue(std::move(packet), true);
+        if (audio_decode_queue_.size() >= SOUND_LOOKAHEAD_PACKETS) {
+            return;
+        }
+        const uint8_t* data;
+        size_t size;
+        if (!sound_demuxer_->NextPacket(data, size)) {
+            sound_demuxer_.reset();
+            continue;
         }
 
-        offset = body_off + body_size;
+        auto packet = AudioPacketPool::GetInstance().Acquire();
+        packet->sample_rate = sound_demuxer_->sample_rate();
+        packet->frame_duration = OggDemuxer::GetPacketDuration(data, size);
+        if (packet->frame_duration == 0) {
+            packet->frame_duration = OPUS_FRAME_DURATION_MS;
+        }
+        packet->payload.assign(data, data + size);
+
+        std::lock_guard<std::mutex> lock(decode_producer_mutex_);
+        if (!audio_decode_queue_.Push(packet)) {
+            AudioPacketPool::GetInstance().Release(std::move(packet));
+            return;
+        }
     }
 }
 
+void AudioService::CancelSounds() {
+    std::lock_guard<std::mutex> lock(sound_mutex_);
+    pending_sounds_.clear();
+    sound_cancelled_ = true;
+    sound_playing_ = false;
+}
+
 bool AudioService::IsIdle() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    return audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
+    return !sound_playing_ && audio_encode_queue_.empty() && audio_decode_queue_.empty() && audio_playback_queue_.empty() && audio_testing_queue_.empty();
 }
 
 void AudioService::ResetDecoder() {
-    std::lock_guard<std::mutex> lock(audio_queue_mutex_);
-    opus_decoder_->ResetState();
-    timestamp_queue_.clear();
-    audio_decode_queue_.clear();
-    audio_playback_queue_.clear();
-    audio_testing_queue_.clear();
-    audio_queue_cv_.notify_all();
+    CancelSounds();
+    /* The decoder belongs to the opus codec task, it resets the state before the next packet */
+    decoder_reset_pending_ = true;
+    {
+        std::lock_guard<std::mutex> lock(timestamp_mutex_);
+        timestamp_queue_.clear();
+    }
+    audio_decode_queue_.RequestClear();
+    audio_playback_queue_.RequestClear();
+    audio_testing_queue_.RequestClear();
+    xEventGroupSetBits(event_group_, AS_EVENT_DECODE_QUEUE_SPACE);
+    NotifyTask(audio_output_task_handle_);
+    NotifyTask(opus_codec_task_handle_);
 }
 
 void AudioService::CheckAndUpdateAudioPowerState() {
@@ -3,9 +3,10 @@
 
 #include <memory>
 #include <deque>
-#include <condition_variable>
 #include <chrono>
 #include <mutex>
+#include <atomic>
+#include <string_view>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
@@ -22,6 +23,12 @@
 #include "processors/audio_debugger.h"
 #include "wake_word.h"
 #include "protocol.h"
+#include "spsc_ring.h"
+#include "multi_channel_resampler.h"
+#include "ogg_demuxer.h"
+#include "sound_cache.h"
+#include "opus_decoder_pool.h"
+#include "latency_trace.h"
 
 
 /*
@@ -32,7 +39,10 @@
  * We use one task for MIC / Speaker / Processors, and one task for Opus Encoder / Opus Decoder.
  * 
  * Decode Queue and Send Queue are the main queues, because Opus packets are quite smaller than PCM packets.
- * 
+ *
+ * Every queue is a lock-free SPSC ring. Consumers are woken by task notifications and producers
+ * waiting for free space by a per-queue bit in the event group, so a push or pop only wakes the
+ * task that actually has work to do.
  */
 
 #define OPUS_FRAME_DURATION_MS 60
@@ -42,6 +52,26 @@
 #define MAX_SEND_PACKETS_IN_QUEUE (2400 / OPUS_FRAME_DURATION_MS)
 #define AUDIO_TESTING_MAX_DURATION_MS 10000
 #define MAX_TIMESTAMPS_IN_QUEUE 3
+// Packets of a local sound kept ahead in the decode queue while it plays
+#define SOUND_LOOKAHEAD_PACKETS 4
+// Longest the input task waits for encode queue space before dropping the frame,
+// far below one frame so mic reads and wake word detection keep up with I2S
+#define AUDIO_ENCODE_QUEUE_WAIT_MS 10
+
+// Ring capacities must be powers of two and at least twice the MAX_* limits above, since
+// cleared items keep their slots until the consumer's next pop. A push that still finds
+// the ring full drops its item. The decode ring also takes the whole audio testing
+// recording when testing stops.
+#define AUDIO_ENCODE_RING_SIZE 8
+#define AUDIO_PLAYBACK_RING_SIZE 8
+#define AUDIO_DECODE_RING_SIZE 256
+#define AUDIO_SEND_RING_SIZE 64
+#define AUDIO_TESTING_RING_SIZE 256
+
+static_assert(AUDIO_ENCODE_RING_SIZE >= 2 * MAX_ENCODE_TASKS_IN_QUEUE, "Encode ring too small");
+static_assert(AUDIO_PLAYBACK_RING_SIZE >= 2 * MAX_PLAYBACK_TASKS_IN_QUEUE, "Playback ring too small");
+static_assert(AUDIO_DECODE_RING_SIZE >= 2 * MAX_DECODE_PACKETS_IN_QUEUE, "Decode ring too small");
+static_assert(AUDIO_SEND_RING_SIZE >= 2 * MAX_SEND_PACKETS_IN_QUEUE, "Send ring too small");
 
 #define AUDIO_POWER_TIMEOUT_MS 15000
 #define AUDIO_POWER_CHECK_INTERVAL_MS 1000
@@ -51,6 +81,8 @@
 #define AS_EVENT_WAKE_WORD_RUNNING          (1 << 1)
 #define AS_EVENT_AUDIO_PROCESSOR_RUNNING    (1 << 2)
 #define AS_EVENT_PLAYBACK_NOT_EMPTY         (1 << 3)
+#define AS_EVENT_ENCODE_QUEUE_SPACE         (1 << 4)
+#define AS_EVENT_DECODE_QUEUE_SPACE         (1 << 5)
 
 struct AudioServiceCallbacks {
     std::function<void(void)> on_send_queue_available;
@@ -70,6 +102,7 @@ struct AudioTask {
     AudioTaskType type;
     std::vector<int16_t> pcm;
     uint32_t timestamp;
+    uint32_t trace_id = 0;
 };
 
 struct DebugStatistics {
@@ -77,6 +110,10 @@ struct DebugStatistics {
     uint32_t decode_count = 0;
     uint32_t encode_count = 0;
     uint32_t playback_count = 0;
+    // Times encoding was paused because the network did not drain the send queue
+    uint32_t send_stall_count = 0;
+    // Input frames dropped because the encode queue stayed full
+    uint32_t encode_drop_count = 0;
 };
 
 class AudioService {
@@ -91,6 +128,7 @@ public:
     std::unique_ptr<AudioStreamPacket> PopWakeWordPacket();
     const std::string& GetLastWakeWord() const;
     bool IsVoiceDetected() const { return voice_detected_; }
+    bool IsSendQueueCongested() const { return send_queue_congested_; }
     bool IsIdle();
     bool IsWakeWordRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_WAKE_WORD_RUNNING; }
     bool IsAudioProcessorRunning() const { return xEventGroupGetBits(event_group_) & AS_EVENT_AUDIO_PROCESSOR_RUNNING; }
@@ -108,6 +146,8 @@ public:
     void PlaySound(const std::string_view& sound);
     bool ReadAudioData(std::vector<int16_t>& data, int sample_rate, int samples);
     void ResetDecoder();
+    SoundCacheStatistics GetSoundCacheStatistics() { return sound_cache_.statistics(); }
+    void LogSoundCacheStatistics() { sound_cache_.LogStatistics(); }
     void SetModelsList(srmodel_list_t* models_list);
 
 private:
@@ -117,10 +157,13 @@ private:
     std::unique_ptr<WakeWord> wake_word_;
     std::unique_ptr<AudioDebugger> audio_debugger_;
     std::unique_ptr<OpusEncoderWrapper> opus_encoder_;
-    std::unique_ptr<OpusDecoderWrapper> opus_decoder_;
-    OpusResampler input_resampler_;
-    OpusResampler reference_resampler_;
-    OpusResampler output_resampler_;
+    // Warm decoders per format, decoder_ is the one used for the current stream
+    std::unique_ptr<OpusDecoderPool> decoder_pool_;
+    PooledOpusDecoder* decoder_ = nullptr;
+    std::atomic<bool> decoder_reset_pending_ = false;
+    MultiChannelResampler input_resampler_;
+    // Raw codec samples before input resampling, kept to avoid per read allocations
+    std::vector<int16_t> input_buffer_;
     DebugStatistics debug_statistics_;
     srmodel_list_t* models_list_ = nullptr;
 
@@ -128,21 +171,39 @@ private:
 
     // Audio encode / decode
     TaskHandle_t audio_input_task_handle_ = nullptr;
+    // Guards the output and codec handles, an exiting task clears its handle under this lock
+    // so no other task can notify it after it has been deleted
+    std::mutex task_handle_mutex_;
     TaskHandle_t audio_output_task_handle_ = nullptr;
     TaskHandle_t opus_codec_task_handle_ = nullptr;
-    std::mutex audio_queue_mutex_;
-    std::condition_variable audio_queue_cv_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_decode_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_send_queue_;
-    std::deque<std::unique_ptr<AudioStreamPacket>> audio_testing_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_encode_queue_;
-    std::deque<std::unique_ptr<AudioTask>> audio_playback_queue_;
+    SpscRing<AudioStreamPacket, AUDIO_DECODE_RING_SIZE> audio_decode_queue_;
+    SpscRing<AudioStreamPacket, AUDIO_SEND_RING_SIZE> audio_send_queue_;
+    SpscRing<AudioStreamPacket, AUDIO_TESTING_RING_SIZE> audio_testing_queue_;
+    SpscRing<AudioTask, AUDIO_ENCODE_RING_SIZE> audio_encode_queue_;
+    SpscRing<AudioTask, AUDIO_PLAYBACK_RING_SIZE> audio_playback_queue_;
+    // The decode and encode queues have more than one possible producer task,
+    // these only serialize the producers and are never taken by the consumer
+    std::mutex decode_producer_mutex_;
+    std::mutex encode_producer_mutex_;
     // For server AEC
+    std::mutex timestamp_mutex_;
     std::deque<uint32_t> timestamp_queue_;
 
+    // Sounds waiting to be played, the opus codec task demuxes them a few packets at a time
+    std::mutex sound_mutex_;
+    std::deque<std::string_view> pending_sounds_;
+    std::unique_ptr<OggDemuxer> sound_demuxer_;
+    // Short prompts play from decoded PCM straight into the playback queue
+    SoundCache sound_cache_{CONFIG_SOUND_CACHE_SIZE_KB * 1024};
+    std::shared_ptr<const CachedSound> sound_pcm_;
+    size_t sound_pcm_offset_ = 0;
+    std::atomic<bool> sound_playing_ = false;
+    std::atomic<bool> sound_cancelled_ = false;
+
     bool wake_word_initialized_ = false;
     bool audio_processor_initialized_ = false;
     bool voice_detected_ = false;
+    std::atomic<bool> send_queue_congested_ = false;
     bool service_stopped_ = true;
     bool audio_input_need_warmup_ = false;
 
@@ -154,8 +215,13 @@ private:
     void AudioOutputTask();
     void OpusCodecTask();
     void PushTaskToEncodeQueue(AudioTaskType type, std::vector<int16_t>&& pcm);
+    void FeedSoundPackets();
+    void CancelSounds();
     void SetDecodeSampleRate(int sample_rate, int frame_duration);
     void CheckAndUpdateAudioPowerState();
+    void NotifyTask(TaskHandle_t& task);
+    void ClearTaskHandle(TaskHandle_t& task);
+    bool WaitForQueueSpace(EventBits_t bit, const std::function<bool()>& has_space, TickType_t timeout = portMAX_DELAY);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include "latency_trace.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+
+#define TAG "LatencyTrace"
+
+static const char* const kEventNames[kTraceEventCount] = {
+    "encode_enqueue", "encode_dequeue", "send_enqueue", "send_dequeue", "network_sent",
+    "network_received", "decode_enqueue", "decode_dequeue", "playback_enqueue", "playback_dequeue",
+    "speaker_done",
+};
+
+static const struct {
+    const char* name;
+    LatencyTraceEvent from;
+    LatencyTraceEvent to;
+} kStages[] = {
+    {"encode_queue", kTraceEncodeEnqueue, kTraceEncodeDequeue},
+    {"encode", kTraceEncodeDequeue, kTraceSendEnqueue},
+    {"send_queue", kTraceSendEnqueue, kTraceSendDequeue},
+    {"network_send", kTraceSendDequeue, kTraceNetworkSent},
+    {"receive_buffer", kTraceNetworkReceived, kTraceDecodeEnqueue},
+    {"decode_queue", kTraceDecodeEnqueue, kTraceDecodeDequeue},
+    {"decode", kTraceDecodeDequeue, kTracePlaybackEnqueue},
+    {"playback_queue", kTracePlaybackEnqueue, kTracePlaybackDequeue},
+    {"speaker", kTracePlaybackDequeue, kTraceSpeakerDone},
+};
+static constexpr size_t kStageCount = sizeof(kStages) / sizeof(kStages[0]);
+
+// Queue depth is recorded when a frame is pushed
+static const struct {
+    const char* name;
+    LatencyTraceEvent event;
+} kQueues[] = {
+    {"encode", kTraceEncodeEnqueue},
+    {"send", kTraceSendEnqueue},
+    {"decode", kTraceDecodeEnqueue},
+    {"playback", kTracePlaybackEnqueue},
+};
+static constexpr size_t kQueueCount = sizeof(kQueues) / sizeof(kQueues[0]);
+
+// Upper bounds of the depth histogram buckets: 0, 1, 2, 3, 4-7, 8-15, 16-31, 32+
+static int DepthBucket(uint32_t depth) {
+    if (depth < 4) {
+        return depth;
+    }
+    int bucket = 4;
+    for (uint32_t limit = 8; depth >= limit && bucket < LATENCY_TRACE_DEPTH_BUCKETS - 1; limit <<= 1) {
+        bucket++;
+    }
+    return bucket;
+}
+
+uint32_t LatencyTrace::NewId() {
+    uint32_t id = ++next_id_;
+    if (id == 0) {
+        id = ++next_id_;
+    }
+    return id;
+}
+
+void LatencyTrace::Record(LatencyTraceEvent event, uint32_t id, uint32_t queue_depth) {
+    if (id == 0) {
+        return;
+    }
+    if (entries_ == nullptr) {
+        auto entries = (Entry*)heap_caps_calloc(LATENCY_TRACE_RING_SIZE, sizeof(Entry), MALLOC_CAP_SPIRAM);
+        if (entries == nullptr) {
+            entries = (Entry*)calloc(LATENCY_TRACE_RING_SIZE, sizeof(Entry));
+            if (entries == nullptr) {
+                return;
+            }
+        }
+        // Another task may have won the race, keep the first buffer
+        Entry* expected = nullptr;
+        if (!__atomic_compare_exchange_n(&entries_, &expected, entries, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            heap_caps_free(entries);
+        }
+    }
+
+    // Entries are written without a lock, a summary taken while a frame is recorded may see it torn
+    uint32_t index = write_index_.fetch_add(1, std::memory_order_relaxed) % LATENCY_TRACE_RING_SIZE;
+    auto& entry = entries_[index];
+    entry.time_us = (uint32_t)esp_timer_get_time();
+    entry.id = id;
+    entry.depth = queue_depth > UINT16_MAX ? UINT16_MAX : queue_depth;
+    entry.event = event;
+}
+
+void LatencyTrace::Clear() {
+    write_index_ = 0;
+}
+
+size_t LatencyTrace::Snapshot(Entry* out) {
+    if (entries_ == nullptr) {
+        return 0;
+    }
+    uint32_t written = write_index_.load();
+    size_t count = std::min<uint32_t>(written, LATENCY_TRACE_RING_SIZE);
+    // Oldest first
+    for (size_t i = 0; i < count; i++) {
+        out[i] = entries_[(written - count + i) % LATENCY_TRACE_RING_SIZE];
+    }
+    return count;
+}
+
+void LatencyTrace::Summarize(StageSummary* stages, uint32_t (*histograms)[LATENCY_TRACE_DEPTH_BUCKETS]) {
+    std::vector<Entry> entries(LATENCY_TRACE_RING_SIZE);
+    entries.resize(Snapshot(entries.data()));
+
+    for (size_t q = 0; q < kQueueCount; q++) {
+        std::fill(histograms[q], histograms[q] + LATENCY_TRACE_DEPTH_BUCKETS, 0);
+    }
+    for (auto& entry : entries) {
+        for (size_t q = 0; q < kQueueCount; q++) {
+            if (entry.event == kQueues[q].event) {
+                histograms[q][DepthBucket(entry.depth)]++;
+            }
+        }
+    }
+
+    /* Group the events by frame, then pair the events of each stage */
+    std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+        return a.id < b.id;
+    });
+    std::vector<uint32_t> durations[kStageCount];
+    for (size_t begin = 0; begin < entries.size();) {
+        size_t end = begin;
+        uint32_t times[kTraceEventCount];
+        bool seen[kTraceEventCount] = {};
+        for (; end < entries.size() && entries[end].id == entries[begin].id; end++) {
+            auto& entry = entries[end];
+            if (entry.event < kTraceEventCount && !seen[entry.event]) {
+                seen[entry.event] = true;
+                times[entry.event] = entry.time_us;
+            }
+        }
+        for (size_t s = 0; s < kStageCount; s++) {
+            if (seen[kStages[s].from] && seen[kStages[s].to]) {
+                durations[s].push_back(times[kStages[s].to] - times[kStages[s].from]);
+            }
+        }
+        begin = end;
+    }
+
+    for (size_t s = 0; s < kStageCount; s++) {
+        auto& values = durations[s];
+        stages[s] = StageSummary();
+        if (values.empty()) {
+            continue;
+        }
+        std::sort(values.begin(), values.end());
+        stages[s].count = values.size();
+        stages[s].p50_us = values[(values.size() - 1) * 50 / 100];
+        stages[s].p95_us = values[(values.size() - 1) * 95 / 100];
+        stages[s].p99_us = values[(values.size() - 1) * 99 / 100];
+    }
+}
+
+cJSON* LatencyTrace::GetSummaryJson() {
+    StageSummary stages[kStageCount];
+    uint32_t histograms[kQueueCount][LATENCY_TRACE_DEPTH_BUCKETS];
+    Summarize(stages, histograms);
+
+    cJSON* json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "events", std::min<uint32_t>(write_index_.load(), LATENCY_TRACE_RING_SIZE));
+
+    cJSON* stages_json = cJSON_CreateArray();
+    for (size_t s = 0; s < kStageCount; s++) {
+        cJSON* stage = cJSON_CreateObject();
+        cJSON_AddStringToObject(stage, "name", kStages[s].name);
+        cJSON_AddNumberToObject(stage, "count", stages[s].count);
+        cJSON_AddNumberToObject(stage, "p50_us", stages[s].p50_us);
+        cJSON_AddNumberToObject(stage, "p95_us", stages[s].p95_us);
+        cJSON_AddNumberToObject(stage, "p99_us", stages[s].p99_us);
+        cJSON_AddItemToArray(stages_json, stage);
+    }
+    cJSON_AddItemToObject(json, "stages", stages_json);
+
+    cJSON* queues_json = cJSON_CreateArray();
+    for (size_t q = 0; q < kQueueCount; q++) {
+        cJSON* queue = cJSON_CreateObject();
+        cJSON_AddStringToObject(queue, "name", kQueues[q].name);
+        cJSON* histogram = cJSON_CreateArray();
+        for (int b = 0; b < LATENCY_TRACE_DEPTH_BUCKETS; b++) {
+            cJSON_AddItemToArray(histogram, cJSON_CreateNumber(histograms[q][b]));
+        }
+        cJSON_AddItemToObject(queue, "depth_histogram", histogram);
+        cJSON_AddItemToArray(queues_json, queue);
+    }
+    cJSON_AddItemToObject(json, "queues", queues_json);
+    cJSON_AddStringToObject(json, "depth_buckets", "0,1,2,3,4-7,8-15,16-31,32+");
+    return json;
+}
+
+std::string LatencyTrace::GetSummaryText() {
+    StageSummary stages[kStageCount];
+    uint32_t histograms[kQueueCount][LATENCY_TRACE_DEPTH_BUCKETS];
+    Summarize(stages, histograms);
+
+    std::string text;
+    char line[48];
+    for (size_t s = 0; s < kStageCount; s++) {
+        if (stages[s].count == 0) {
+            continue;
+        }
+        snprintf(line, sizeof(line), "%s%s %lu/%lu/%lu", text.empty() ? "" : " ", kStages[s].name,
+            stages[s].p50_us / 1000, stages[s].p95_us / 1000, stages[s].p99_us / 1000);
+        text += line;
+    }
+    return text;
+}
+
+std::string LatencyTrace::DumpRaw() {
+    std::vector<Entry> entries(LATENCY_TRACE_RING_SIZE);
+    entries.resize(Snapshot(entries.data()));
+
+    std::string dump = "time_us,event,id,depth\n";
+    dump.reserve(dump.size() + entries.size() * 40);
+    char line[64];
+    for (auto& entry : entries) {
+        snprintf(line, sizeof(line), "%lu,%s,%lu,%u\n", entry.time_us,
+            entry.event < kTraceEventCount ? kEventNames[entry.event] : "unknown", entry.id, entry.depth);
+        dump += line;
+    }
+    return dump;
+}
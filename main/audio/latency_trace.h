@@ -0,0 +1,96 @@
+#ifndef LATENCY_TRACE_H
+#define LATENCY_TRACE_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+
+#include <cJSON.h>
+
+/*
+ * Timestamped trace of audio frames through the voice pipeline:
+ *
+ *   uplink:   encode enqueue -> encode dequeue -> send enqueue -> send dequeue -> network sent
+ *   downlink: network received -> decode enqueue -> decode dequeue -> playback enqueue
+ *             -> playback dequeue -> speaker done
+ *
+ * Every frame gets a trace id where it enters the pipeline, the id is carried by AudioTask and
+ * AudioStreamPacket, and each stage is the time between two consecutive events of the same id.
+ * Recording is a few stores into a fixed ring, and compiles to nothing unless
+ * CONFIG_USE_AUDIO_LATENCY_TRACE is enabled, so use the AUDIO_TRACE macros.
+ */
+enum LatencyTraceEvent : uint8_t {
+    kTraceEncodeEnqueue,
+    kTraceEncodeDequeue,
+    kTraceSendEnqueue,
+    kTraceSendDequeue,
+    kTraceNetworkSent,
+    kTraceNetworkReceived,
+    kTraceDecodeEnqueue,
+    kTraceDecodeDequeue,
+    kTracePlaybackEnqueue,
+    kTracePlaybackDequeue,
+    kTraceSpeakerDone,
+    kTraceEventCount,
+};
+
+#define LATENCY_TRACE_RING_SIZE 1024
+#define LATENCY_TRACE_DEPTH_BUCKETS 8
+
+class LatencyTrace {
+public:
+    static LatencyTrace& GetInstance() {
+        static LatencyTrace instance;
+        return instance;
+    }
+
+    uint32_t NewId();
+    // Id 0 means the frame is not traced (e.g. local sounds) and is ignored
+    void Record(LatencyTraceEvent event, uint32_t id, uint32_t queue_depth);
+    void Clear();
+
+    // p50 / p95 / p99 per stage and queue depth histograms, caller owns the result
+    cJSON* GetSummaryJson();
+    // One line per stage in milliseconds, short enough for an ESPHome text entity
+    std::string GetSummaryText();
+    // Raw events as "time_us,event,id,depth" lines, input of scripts/latency_timeline.py
+    std::string DumpRaw();
+
+private:
+    struct Entry {
+        uint32_t time_us;
+        uint32_t id;
+        uint16_t depth;
+        uint8_t event;
+    };
+
+    struct StageSummary {
+        uint32_t count = 0;
+        uint32_t p50_us = 0;
+        uint32_t p95_us = 0;
+        uint32_t p99_us = 0;
+    };
+
+    LatencyTrace() = default;
+    LatencyTrace(const LatencyTrace&) = delete;
+    LatencyTrace& operator=(const LatencyTrace&) = delete;
+
+    // Allocated on the first record, so a disabled trace costs no memory
+    Entry* entries_ = nullptr;
+    std::atomic<uint32_t> write_index_ = 0;
+    std::atomic<uint32_t> next_id_ = 0;
+
+    size_t Snapshot(Entry* out);
+    void Summarize(StageSummary* stages, uint32_t (*histograms)[LATENCY_TRACE_DEPTH_BUCKETS]);
+};
+
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+#define AUDIO_TRACE(event, id, depth) LatencyTrace::GetInstance().Record(event, id, depth)
+#define AUDIO_TRACE_NEW_ID() LatencyTrace::GetInstance().NewId()
+#else
+// Arguments are still evaluated so locals kept only for tracing do not warn as unused
+#define AUDIO_TRACE(event, id, depth) do { (void)(event); (void)(id); (void)(depth); } while (0)
+#define AUDIO_TRACE_NEW_ID() 0
+#endif
+
+#endif // LATENCY_TRACE_H
@@ -0,0 +1,77 @@
+#include "multi_channel_resampler.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "MultiChannelResampler"
+
+void MultiChannelResampler::Configure(int input_sample_rate, int output_sample_rate, int channels) {
+    channels_ = channels;
+    resamplers_.clear();
+    for (int i = 0; i < channels; i++) {
+        auto resampler = std::make_unique<OpusResampler>();
+        resampler->Configure(input_sample_rate, output_sample_rate);
+        resamplers_.push_back(std::move(resampler));
+    }
+    ESP_LOGI(TAG, "Resampling %d channel(s) from %d to %d", channels, input_sample_rate, output_sample_rate);
+}
+
+int MultiChannelResampler::GetOutputSamples(int input_samples) const {
+    return resamplers_.front()->GetOutputSamples(input_samples);
+}
+
+void MultiChannelResampler::Process(const int16_t* input, int input_frames, std::vector<int16_t>& output) {
+    int output_frames = GetOutputSamples(input_frames);
+    output.resize(output_frames * channels_);
+
+    if (channels_ == 1) {
+        resamplers_[0]->Process(input, input_frames, output.data());
+        return;
+    }
+
+    channel_input_.resize(input_frames * channels_);
+    channel_output_.resize(output_frames * channels_);
+
+    // Split into planar scratch, stereo reads one 32-bit word per frame
+    if (channels_ == 2 && (reinterpret_cast<uintptr_t>(input) & 3) == 0) {
+        auto frames = reinterpret_cast<const uint32_t*>(input);
+        int16_t* left = channel_input_.data();
+        int16_t* right = left + input_frames;
+        for (int i = 0; i < input_frames; i++) {
+            uint32_t frame = frames[i];
+            left[i] = static_cast<int16_t>(frame & 0xFFFF);
+            right[i] = static_cast<int16_t>(frame >> 16);
+        }
+    } else {
+        for (int c = 0; c < channels_; c++) {
+            int16_t* plane = channel_input_.data() + c * input_frames;
+            const int16_t* src = input + c;
+            for (int i = 0; i < input_frames; i++, src += channels_) {
+                plane[i] = *src;
+            }
+        }
+    }
+
+    for (int c = 0; c < channels_; c++) {
+        resamplers_[c]->Process(channel_input_.data() + c * input_frames, input_frames,
+            channel_output_.data() + c * output_frames);
+    }
+
+    // Interleave back into the caller's buffer
+    if (channels_ == 2 && (reinterpret_cast<uintptr_t>(output.data()) & 3) == 0) {
+        auto frames = reinterpret_cast<uint32_t*>(output.data());
+        const int16_t* left = channel_output_.data();
+        const int16_t* right = left + output_frames;
+        for (int i = 0; i < output_frames; i++) {
+            frames[i] = static_cast<uint16_t>(left[i]) | (static_cast<uint32_t>(static_cast<uint16_t>(right[i])) << 16);
+        }
+    } else {
+        for (int c = 0; c < channels_; c++) {
+            const int16_t* plane = channel_output_.data() + c * output_frames;
+            int16_t* dst = output.data() + c;
+            for (int i = 0; i < output_frames; i++, dst += channels_) {
+                *dst = plane[i];
+            }
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef MULTI_CHANNEL_RESAMPLER_H
+#define MULTI_CHANNEL_RESAMPLER_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <opus_resampler.h>
+
+/*
+ * Resamples an interleaved stream of N channels in one pass: every channel is split into a
+ * preallocated scratch buffer, run through its own OpusResampler and written back interleaved.
+ * All buffers are kept between calls, so steady state processing does not allocate.
+ */
+class MultiChannelResampler {
+public:
+    void Configure(int input_sample_rate, int output_sample_rate, int channels);
+    bool configured() const { return !resamplers_.empty(); }
+    int channels() const { return channels_; }
+
+    // Number of samples per channel produced for the given samples per channel
+    int GetOutputSamples(int input_samples) const;
+    // input holds input_frames interleaved frames, output is resized to the interleaved result
+    void Process(const int16_t* input, int input_frames, std::vector<int16_t>& output);
+
+private:
+    int channels_ = 0;
+    std::vector<std::unique_ptr<OpusResampler>> resamplers_;
+    std::vector<int16_t> channel_input_;
+    std::vector<int16_t> channel_output_;
+};
+
+#endif // MULTI_CHANNEL_RESAMPLER_H
@@ -0,0 +1,173 @@
+#include "ogg_demuxer.h"
+
+#include <esp_log.h>
+#include <cstring>
+
+#define TAG "OggDemuxer"
+
+#define OGG_PAGE_HEADER_SIZE 27
+#define OGG_HEADER_TYPE_CONTINUED 0x01
+
+OggDemuxer::OggDemuxer(std::string_view data)
+    : data_(reinterpret_cast<const uint8_t*>(data.data())), size_(data.size()) {
+}
+
+bool OggDemuxer::NextPage() {
+    while (offset_ + OGG_PAGE_HEADER_SIZE <= size_) {
+        const uint8_t* page = data_ + offset_;
+        if (std::memcmp(page, "OggS", 4) != 0 || page[4] != 0) {
+            // Lost sync, search for the next capture pattern
+            auto next = static_cast<const uint8_t*>(memchr(page + 1, 'O', size_ - offset_ - 1));
+            if (next == nullptr) {
+                break;
+            }
+            offset_ = next - data_;
+            continue;
+        }
+
+        int segment_count = page[26];
+        size_t body_offset = offset_ + OGG_PAGE_HEADER_SIZE + segment_count;
+        if (body_offset > size_) {
+            break;
+        }
+        size_t body_size = 0;
+        for (int i = 0; i < segment_count; i++) {
+            body_size += page[OGG_PAGE_HEADER_SIZE + i];
+        }
+        if (body_offset + body_size > size_) {
+            ESP_LOGW(TAG, "Truncated page at %u", offset_);
+            break;
+        }
+
+        if (!(page[5] & OGG_HEADER_TYPE_CONTINUED) && !continued_.empty()) {
+            ESP_LOGW(TAG, "Dropping incomplete packet of %u bytes", continued_.size());
+            continued_.clear();
+        }
+
+        segments_ = page + OGG_PAGE_HEADER_SIZE;
+        segment_count_ = segment_count;
+        segment_index_ = 0;
+        body_ = data_ + body_offset;
+        offset_ = body_offset + body_size;
+        return true;
+    }
+    offset_ = size_;
+    return false;
+}
+
+bool OggDemuxer::ParseHeaderPacket(const uint8_t* packet, size_t size) {
+    if (!seen_head_) {
+        // OpusHead: [0-7] "OpusHead", [8] version, [9] channel_count, [10-11] pre_skip
+        // [12-15] input_sample_rate, [16-17] output_gain, [18] mapping_family
+        if (size >= 19 && std::memcmp(packet, "OpusHead", 8) == 0) {
+            seen_head_ = true;
+            int sample_rate = packet[12] | (packet[13] << 8) | (packet[14] << 16) | (packet[15] << 24);
+            // The header carries the original input rate, the decoder only runs at Opus rates
+            if (sample_rate == 8000 || sample_rate == 12000 || sample_rate == 16000 || sample_rate == 24000 || sample_rate == 48000) {
+                sample_rate_ = sample_rate;
+            } else {
+                sample_rate_ = 48000;
+            }
+            ESP_LOGD(TAG, "OpusHead: version=%d, channels=%d, sample_rate=%d", packet[8], packet[9], sample_rate);
+        }
+        return true;
+    }
+    if (!seen_tags_) {
+        // Expect OpusTags in second packet
+        if (size >= 8 && std::memcmp(packet, "OpusTags", 8) == 0) {
+            seen_tags_ = true;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool OggDemuxer::NextPacket(const uint8_t*& packet, size_t& size) {
+    if (continued_returned_) {
+        continued_.clear();
+        continued_returned_ = false;
+    }
+
+    while (true) {
+        if (segment_index_ >= segment_count_) {
+            if (!NextPage()) {
+                return false;
+            }
+            continue;
+        }
+
+        // Collect the lacing values of one packet, a value below 255 terminates it
+        const uint8_t* start = body_;
+        size_t length = 0;
+        bool complete = false;
+        while (segment_index_ < segment_count_) {
+            uint8_t lacing = segments_[segment_index_++];
+            length += lacing;
+            if (lacing < 255) {
+                complete = true;
+                break;
+            }
+        }
+        body_ += length;
+
+        if (!complete) {
+            continued_.insert(continued_.end(), start, start + length);
+            continue;
+        }
+        if (!continued_.empty()) {
+            continued_.insert(continued_.end(), start, start + length);
+            start = continued_.data();
+            length = continued_.size();
+            continued_returned_ = true;
+        }
+        if (length == 0 || ParseHeaderPacket(start, length)) {
+            if (continued_returned_) {
+                continued_.clear();
+                continued_returned_ = false;
+            }
+            continue;
+        }
+
+        packet = start;
+        size = length;
+        return true;
+    }
+}
+
+int OggDemuxer::GetPacketDuration(const uint8_t* packet, size_t size) {
+    if (size < 1) {
+        return 0;
+    }
+    // Frame duration in 1/10 ms for each TOC configuration (RFC 6716 section 3.1)
+    static const int silk_durations[] = {100, 200, 400, 600};
+    static const int hybrid_durations[] = {100, 200};
+    static const int celt_durations[] = {25, 50, 100, 200};
+    int config = packet[0] >> 3;
+    int frame_duration;
+    if (config < 12) {
+        frame_duration = silk_durations[config & 3];
+    } else if (config < 16) {
+        frame_duration = hybrid_durations[config & 1];
+    } else {
+        frame_duration = celt_durations[config & 3];
+    }
+
+    int frames;
+    switch (packet[0] & 3) {
+    case 0:
+        frames = 1;
+        break;
+    case 1:
+    case 2:
+        frames = 2;
+        break;
+    default:
+        if (size < 2) {
+            return 0;
+        }
+        frames = packet[1] & 0x3F;
+        break;
+    }
+    // Round up so the decoder buffer always fits the packet
+    return (frame_duration * frames + 9) / 10;
+}
@@ -0,0 +1,51 @@
+#ifndef OGG_DEMUXER_H
+#define OGG_DEMUXER_H
+
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Incremental Ogg/Opus demuxer over a buffer that stays valid while demuxing
+ * (embedded sounds and the mmapped assets partition).
+ *
+ * Pages are walked using the lengths in their headers, the buffer is only scanned
+ * for a capture pattern again when a page is corrupted. OpusHead and OpusTags are
+ * consumed internally, NextPacket() only returns audio packets.
+ */
+class OggDemuxer {
+public:
+    explicit OggDemuxer(std::string_view data);
+
+    // Returns false at the end of the stream, packet stays valid until the next call
+    bool NextPacket(const uint8_t*& packet, size_t& size);
+    int sample_rate() const { return sample_rate_; }
+
+    // Duration of an Opus packet in milliseconds derived from its TOC byte, 0 if invalid
+    static int GetPacketDuration(const uint8_t* packet, size_t size);
+
+private:
+    const uint8_t* data_;
+    size_t size_;
+    size_t offset_ = 0;
+
+    // Current page
+    const uint8_t* segments_ = nullptr;
+    int segment_count_ = 0;
+    int segment_index_ = 0;
+    const uint8_t* body_ = nullptr;
+
+    // A packet continued across pages is assembled here
+    std::vector<uint8_t> continued_;
+    bool continued_returned_ = false;
+
+    bool seen_head_ = false;
+    bool seen_tags_ = false;
+    int sample_rate_ = 16000;
+
+    bool NextPage();
+    bool ParseHeaderPacket(const uint8_t* packet, size_t size);
+};
+
+#endif // OGG_DEMUXER_H
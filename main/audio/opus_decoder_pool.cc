@@ -0,0 +1,43 @@
+#include "opus_decoder_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "OpusDecoderPool"
+
+OpusDecoderPool::OpusDecoderPool(int output_sample_rate) : output_sample_rate_(output_sample_rate) {
+    decoders_.reserve(OPUS_DECODER_POOL_SIZE);
+}
+
+PooledOpusDecoder* OpusDecoderPool::Get(int sample_rate, int frame_duration) {
+    PooledOpusDecoder* oldest = nullptr;
+    for (auto& entry : decoders_) {
+        if (entry->decoder->sample_rate() == sample_rate && entry->decoder->duration_ms() == frame_duration) {
+            entry->decoder->ResetState();
+            if (entry->need_resample) {
+                entry->resampler.Configure(sample_rate, output_sample_rate_);
+            }
+            entry->last_used = ++use_counter_;
+            return entry.get();
+        }
+        if (oldest == nullptr || entry->last_used < oldest->last_used) {
+            oldest = entry.get();
+        }
+    }
+
+    PooledOpusDecoder* entry = oldest;
+    if (decoders_.size() < OPUS_DECODER_POOL_SIZE) {
+        decoders_.push_back(std::make_unique<PooledOpusDecoder>());
+        entry = decoders_.back().get();
+    }
+
+    entry->decoder.reset();
+    entry->decoder = std::make_unique<OpusDecoderWrapper>(sample_rate, 1, frame_duration);
+    entry->need_resample = sample_rate != output_sample_rate_;
+    if (entry->need_resample) {
+        ESP_LOGI(TAG, "Resampling audio from %d to %d", sample_rate, output_sample_rate_);
+        entry->resampler.Configure(sample_rate, output_sample_rate_);
+    }
+    entry->last_used = ++use_counter_;
+    creations_++;
+    return entry;
+}
@@ -0,0 +1,46 @@
+#ifndef OPUS_DECODER_POOL_H
+#define OPUS_DECODER_POOL_H
+
+#include <memory>
+#include <vector>
+#include <cstdint>
+
+#include <opus_decoder.h>
+#include <opus_resampler.h>
+
+// Formats kept warm at the same time, e.g. local prompts, server TTS and one spare
+#define OPUS_DECODER_POOL_SIZE 3
+
+// A decoder together with the resampler from its sample rate to the codec output rate
+struct PooledOpusDecoder {
+    std::unique_ptr<OpusDecoderWrapper> decoder;
+    OpusResampler resampler;
+    bool need_resample = false;
+    uint32_t last_used = 0;
+};
+
+/*
+ * Small LRU of decoder / resampler pairs keyed by (sample rate, frame duration).
+ *
+ * Switching between formats, like 16kHz prompts interleaved with 24kHz TTS, picks up a
+ * warm decoder instead of freeing and allocating a new Opus decoder for every switch.
+ * A reused decoder has its state reset, so no history leaks from the previous stream.
+ * Only used from the opus codec task.
+ */
+class OpusDecoderPool {
+public:
+    explicit OpusDecoderPool(int output_sample_rate);
+
+    PooledOpusDecoder* Get(int sample_rate, int frame_duration);
+
+    // Number of decoders created since boot, stays flat once all formats in use are warm
+    uint32_t creations() const { return creations_; }
+
+private:
+    int output_sample_rate_;
+    std::vector<std::unique_ptr<PooledOpusDecoder>> decoders_;
+    uint32_t use_counter_ = 0;
+    uint32_t creations_ = 0;
+};
+
+#endif // OPUS_DECODER_POOL_H
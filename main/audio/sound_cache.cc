@@ -0,0 +1,191 @@
+#include "sound_cache.h"
+#include "ogg_demuxer.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+
+#define TAG "SoundCache"
+
+CachedSound::~CachedSound() {
+    if (samples != nullptr) {
+        heap_caps_free(samples);
+    }
+}
+
+SoundCache::SoundCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {
+    statistics_.budget_bytes = budget_bytes;
+}
+
+SoundCache::~SoundCache() {
+    Clear();
+}
+
+std::shared_ptr<const CachedSound> SoundCache::Get(const std::string_view& ogg, int output_sample_rate, OpusDecoderPool* decoder_pool) {
+    if (budget_bytes_ == 0) {
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->data == ogg.data() && it->size == ogg.size() && it->output_sample_rate == output_sample_rate) {
+                entries_.splice(entries_.begin(), entries_, it);
+                statistics_.hits++;
+                statistics_.decode_time_saved_us += it->sound->decode_time_us;
+                return it->sound;
+            }
+        }
+        statistics_.misses++;
+    }
+
+    pending_.reset();
+    return StartDecode(ogg, output_sample_rate, decoder_pool);
+}
+
+bool SoundCache::DecodeNext() {
+    if (!pending_) {
+        return false;
+    }
+
+    int64_t start_time = esp_timer_get_time();
+    auto& sound = pending_->sound;
+    auto decoder = pending_->decoder;
+    const uint8_t* data;
+    size_t size;
+    if (!pending_->demuxer.NextPacket(data, size)) {
+        FinishDecode();
+        return false;
+    }
+    /* A pooled decoder handed out for another format in the meantime has lost the state of this sound */
+    if (decoder->decoder->sample_rate() != pending_->sample_rate || decoder->decoder->duration_ms() != pending_->frame_duration) {
+        ESP_LOGW(TAG, "Decoder of a pending sound was taken over, stopping it");
+        pending_.reset();
+        return false;
+    }
+    if (!decoder->decoder->Decode(std::vector<uint8_t>(data, data + size), pcm_)) {
+        ESP_LOGE(TAG, "Failed to decode sound");
+        pending_.reset();
+        return false;
+    }
+    const std::vector<int16_t>* output = &pcm_;
+    if (decoder->need_resample) {
+        resampled_.resize(decoder->resampler.GetOutputSamples(pcm_.size()));
+        decoder->resampler.Process(pcm_.data(), pcm_.size(), resampled_.data());
+        output = &resampled_;
+    }
+    size_t count = std::min(output->size(), pending_->capacity - sound->sample_count);
+    memcpy(sound->samples + sound->sample_count, output->data(), count * sizeof(int16_t));
+    sound->sample_count += count;
+    sound->decode_time_us += esp_timer_get_time() - start_time;
+
+    if (--pending_->packets_left == 0) {
+        FinishDecode();
+    }
+    return true;
+}
+
+void SoundCache::DetachPending() {
+    if (pending_) {
+        pending_->detached = true;
+    }
+}
+
+void SoundCache::CancelDecode() {
+    pending_.reset();
+}
+
+void SoundCache::Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    statistics_.used_bytes = 0;
+}
+
+SoundCacheStatistics SoundCache::statistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
+
+void SoundCache::LogStatistics() {
+    auto stats = statistics();
+    uint32_t lookups = stats.hits + stats.misses;
+    ESP_LOGI(TAG, "hits: %lu/%lu (%lu%%), evictions: %lu, used: %u/%u bytes, decode time saved: %lld ms",
+        stats.hits, lookups, lookups > 0 ? stats.hits * 100 / lookups : 0, stats.evictions,
+        stats.used_bytes, stats.budget_bytes, stats.decode_time_saved_us / 1000);
+}
+
+std::shared_ptr<const CachedSound> SoundCache::StartDecode(const std::string_view& ogg, int output_sample_rate, OpusDecoderPool* decoder_pool) {
+    int64_t start_time = esp_timer_get_time();
+
+    /* Walk the packets once to size the buffer and reject long sounds before decoding anything */
+    OggDemuxer demuxer(ogg);
+    const uint8_t* data;
+    size_t size;
+    int total_duration = 0;
+    int frame_duration = 0;
+    int packets = 0;
+    while (demuxer.NextPacket(data, size)) {
+        int duration = OggDemuxer::GetPacketDuration(data, size);
+        if (duration == 0 || (frame_duration != 0 && duration != frame_duration)) {
+            return nullptr;
+        }
+        frame_duration = duration;
+        total_duration += duration;
+        packets++;
+        if (total_duration > SOUND_CACHE_MAX_DURATION_MS) {
+            return nullptr;
+        }
+    }
+    if (total_duration == 0) {
+        return nullptr;
+    }
+
+    size_t capacity = (size_t)total_duration * output_sample_rate / 1000;
+    if (capacity * sizeof(int16_t) > budget_bytes_) {
+        return nullptr;
+    }
+
+    auto sound = std::make_shared<CachedSound>();
+    sound->samples = (int16_t*)heap_caps_malloc(capacity * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (sound->samples == nullptr) {
+        ESP_LOGW(TAG, "Failed to allocate %u bytes for a sound", capacity * sizeof(int16_t));
+        return nullptr;
+    }
+
+    // The pool resets the state of a warm decoder and configures its resampler for the output rate
+    int sample_rate = demuxer.sample_rate();
+    auto decoder = decoder_pool->Get(sample_rate, frame_duration);
+    sound->decode_time_us = esp_timer_get_time() - start_time;
+    pending_.reset(new PendingSound{{ogg.data(), ogg.size(), output_sample_rate, nullptr}, sound, OggDemuxer(ogg),
+        decoder, sample_rate, frame_duration, packets, capacity});
+    return sound;
+}
+
+void SoundCache::FinishDecode() {
+    auto pending = std::move(pending_);
+    auto& sound = pending->sound;
+    sound->complete = true;
+    if (pending->detached) {
+        return;
+    }
+
+    size_t bytes = sound->sample_count * sizeof(int16_t);
+    ESP_LOGI(TAG, "Cached sound: %u bytes, decoded in %lld us", bytes, sound->decode_time_us);
+    std::lock_guard<std::mutex> lock(mutex_);
+    EvictUntilFits(bytes);
+    pending->entry.sound = sound;
+    entries_.push_front(pending->entry);
+    statistics_.used_bytes += bytes;
+}
+
+void SoundCache::EvictUntilFits(size_t bytes) {
+    while (!entries_.empty() && statistics_.used_bytes + bytes > budget_bytes_) {
+        auto& entry = entries_.back();
+        statistics_.used_bytes -= entry.sound->sample_count * sizeof(int16_t);
+        statistics_.evictions++;
+        entries_.pop_back();
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef SOUND_CACHE_H
+#define SOUND_CACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "opus_decoder_pool.h"
+#include "ogg_demuxer.h"
+
+// Only prompts up to this length are cached, longer sounds are streamed through the decode queue
+#define SOUND_CACHE_MAX_DURATION_MS 3000
+
+struct SoundCacheStatistics {
+    uint32_t hits = 0;
+    uint32_t misses = 0;
+    uint32_t evictions = 0;
+    size_t used_bytes = 0;
+    size_t budget_bytes = 0;
+    // Decode time the hits did not have to spend
+    int64_t decode_time_saved_us = 0;
+};
+
+// Decoded PCM of one sound at the codec output sample rate, stored in PSRAM
+struct CachedSound {
+    int16_t* samples = nullptr;
+    size_t sample_count = 0;
+    // False while a cache miss is still being decoded into samples
+    bool complete = false;
+    int64_t decode_time_us = 0;
+
+    CachedSound() = default;
+    CachedSound(const CachedSound&) = delete;
+    CachedSound& operator=(const CachedSound&) = delete;
+    ~CachedSound();
+};
+
+/*
+ * LRU cache of short UI prompts (success, exclamation, vibration...) decoded and resampled
+ * to the output sample rate, so playing a prompt again skips Ogg parsing and Opus decoding.
+ *
+ * Sounds are keyed by the address of their Ogg data, which is either embedded in the firmware
+ * or mmapped from the assets partition and never moves. Prompts are decoded by the warm decoder
+ * for their format from the decoder pool of the audio service.
+ *
+ * A miss is not decoded at once. Get() returns an empty sound that DecodeNext() fills one packet
+ * at a time while it plays, and the sound joins the cache when its last packet is decoded.
+ * Get(), DecodeNext() and CancelDecode() run on the opus codec task, statistics() may be called
+ * from any task.
+ */
+class SoundCache {
+public:
+    explicit SoundCache(size_t budget_bytes);
+    ~SoundCache();
+
+    // Returns nullptr if the cache is disabled or the sound cannot be cached, stream it instead
+    std::shared_ptr<const CachedSound> Get(const std::string_view& ogg, int output_sample_rate, OpusDecoderPool* decoder_pool);
+    // Appends the next packet to the sound returned by the last miss, false once it is complete or failed
+    bool DecodeNext();
+    // Other audio went through the decoder of the pending sound, finish playing it but do not cache it
+    void DetachPending();
+    void CancelDecode();
+    void Clear();
+
+    SoundCacheStatistics statistics();
+    void LogStatistics();
+
+private:
+    struct Entry {
+        const char* data;
+        size_t size;
+        int output_sample_rate;
+        std::shared_ptr<const CachedSound> sound;
+    };
+
+    // A miss being decoded, only touched by the opus codec task
+    struct PendingSound {
+        Entry entry;
+        std::shared_ptr<CachedSound> sound;
+        OggDemuxer demuxer;
+        PooledOpusDecoder* decoder;
+        int sample_rate;
+        int frame_duration;
+        int packets_left;
+        size_t capacity;
+        bool detached = false;
+    };
+
+    size_t budget_bytes_;
+    std::mutex mutex_;
+    // Most recently used first
+    std::list<Entry> entries_;
+    SoundCacheStatistics statistics_;
+    std::unique_ptr<PendingSound> pending_;
+    std::vector<int16_t> pcm_;
+    std::vector<int16_t> resampled_;
+
+    std::shared_ptr<const CachedSound> StartDecode(const std::string_view& ogg, int output_sample_rate, OpusDecoderPool* decoder_pool);
+    void FinishDecode();
+    void EvictUntilFits(size_t bytes);
+};
+
+#endif // SOUND_CACHE_H
@@ -0,0 +1,78 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+/*
+ * Fixed capacity single-producer / single-consumer ring of owned items.
+ *
+ * Push() must only be called from one task at a time and Pop() from one other task,
+ * the two ends never take a lock and never block each other.
+ * Any task may call RequestClear() to drop everything pushed so far, the consumer
+ * discards those items on its next Pop(), so packets pushed after the request survive.
+ */
+template <typename T, uint32_t Capacity>
+class SpscRing {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+    static constexpr uint32_t capacity() { return Capacity; }
+
+    // Returns false and leaves the item untouched if the ring is full
+    bool Push(std::unique_ptr<T>& item) {
+        uint32_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) >= Capacity) {
+            return false;
+        }
+        slots_[head & kMask] = std::move(item);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    std::unique_ptr<T> Pop() {
+        uint32_t tail = tail_.load(std::memory_order_relaxed);
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t clear_to = clear_to_.load(std::memory_order_acquire);
+        while (tail != head && static_cast<int32_t>(clear_to - tail) > 0) {
+            slots_[tail & kMask].reset();
+            tail++;
+        }
+        if (tail == head) {
+            tail_.store(tail, std::memory_order_release);
+            return nullptr;
+        }
+        auto item = std::move(slots_[tail & kMask]);
+        tail_.store(tail + 1, std::memory_order_release);
+        return item;
+    }
+
+    void RequestClear() {
+        clear_to_.store(head_.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Number of items the consumer will still see, excluding those pending a clear
+    uint32_t size() const {
+        uint32_t head = head_.load(std::memory_order_acquire);
+        uint32_t tail = tail_.load(std::memory_order_acquire);
+        uint32_t clear_to = clear_to_.load(std::memory_order_acquire);
+        if (static_cast<int32_t>(clear_to - tail) > 0) {
+            tail = clear_to;
+        }
+        return head - tail;
+    }
+
+    bool empty() const { return size() == 0; }
+
+private:
+    static constexpr uint32_t kMask = Capacity - 1;
+
+    std::array<std::unique_ptr<T>, Capacity> slots_;
+    std::atomic<uint32_t> head_{0};
+    std::atomic<uint32_t> tail_{0};
+    std::atomic<uint32_t> clear_to_{0};
+};
+
+#endif // SPSC_RING_H
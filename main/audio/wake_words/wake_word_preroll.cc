@@ -0,0 +1,136 @@
+#include "wake_word_preroll.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cassert>
+#include <algorithm>
+
+#define TAG "WakeWordPreroll"
+
+// The Opus encoder needs a deep stack, it lives in PSRAM like the one of the audio processor
+#define WAKE_WORD_PREROLL_TASK_STACK_SIZE (4096 * 7)
+#define WAKE_WORD_PREROLL_FRAME_SAMPLES (16000 / 1000 * WAKE_WORD_PREROLL_FRAME_MS)
+
+WakeWordPreroll::WakeWordPreroll() {
+    pending_pcm_.reserve(WAKE_WORD_PREROLL_FRAME_SAMPLES * WAKE_WORD_PREROLL_PENDING_FRAMES);
+}
+
+WakeWordPreroll::~WakeWordPreroll() {
+    if (encode_task_ != nullptr) {
+        vTaskDelete(encode_task_);
+    }
+    if (encode_task_stack_ != nullptr) {
+        heap_caps_free(encode_task_stack_);
+    }
+    if (encode_task_buffer_ != nullptr) {
+        heap_caps_free(encode_task_buffer_);
+    }
+}
+
+void WakeWordPreroll::StartEncodeTask() {
+    encoder_ = std::make_unique<OpusEncoderWrapper>(16000, 1, WAKE_WORD_PREROLL_FRAME_MS);
+    encoder_->SetComplexity(0); // 0 is the fastest
+
+    encode_task_stack_ = (StackType_t*)heap_caps_malloc(WAKE_WORD_PREROLL_TASK_STACK_SIZE, MALLOC_CAP_SPIRAM);
+    assert(encode_task_stack_ != nullptr);
+    encode_task_buffer_ = (StaticTask_t*)heap_caps_malloc(sizeof(StaticTask_t), MALLOC_CAP_INTERNAL);
+    assert(encode_task_buffer_ != nullptr);
+
+    encode_task_ = xTaskCreateStatic([](void* arg) {
+        auto this_ = (WakeWordPreroll*)arg;
+        this_->EncodeTask();
+    }, "wake_word_preroll", WAKE_WORD_PREROLL_TASK_STACK_SIZE, this, 2, encode_task_stack_, encode_task_buffer_);
+}
+
+void WakeWordPreroll::Feed(const int16_t* data, size_t samples) {
+    if (encode_task_ == nullptr) {
+        StartEncodeTask();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        size_t limit = WAKE_WORD_PREROLL_FRAME_SAMPLES * WAKE_WORD_PREROLL_PENDING_FRAMES;
+        if (pending_pcm_.size() + samples > limit) {
+            // The encoder fell behind, keep the newest audio
+            size_t drop = std::min(pending_pcm_.size(), pending_pcm_.size() + samples - limit);
+            drop -= drop % WAKE_WORD_PREROLL_FRAME_SAMPLES;
+            pending_pcm_.erase(pending_pcm_.begin(), pending_pcm_.begin() + drop);
+            ESP_LOGW(TAG, "Encoder is behind, dropped %u samples", drop);
+        }
+        pending_pcm_.insert(pending_pcm_.end(), data, data + samples);
+        if (pending_pcm_.size() < WAKE_WORD_PREROLL_FRAME_SAMPLES) {
+            return;
+        }
+    }
+    xTaskNotifyGive(encode_task_);
+}
+
+void WakeWordPreroll::EncodeTask() {
+    std::vector<int16_t> pcm;
+    std::vector<uint8_t> opus;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            encoding_ = false;
+            cv_.notify_all();
+            if (pending_pcm_.size() < WAKE_WORD_PREROLL_FRAME_SAMPLES) {
+                lock.unlock();
+                ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+                continue;
+            }
+            encoding_ = true;
+            pcm.assign(pending_pcm_.begin(), pending_pcm_.begin() + WAKE_WORD_PREROLL_FRAME_SAMPLES);
+            pending_pcm_.erase(pending_pcm_.begin(), pending_pcm_.begin() + WAKE_WORD_PREROLL_FRAME_SAMPLES);
+        }
+
+        if (!encoder_->Encode(std::move(pcm), opus)) {
+            ESP_LOGE(TAG, "Failed to encode pre-roll audio");
+            continue;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        // Swap into the slot, so the buffers keep their capacity once the store has wrapped
+        auto& slot = frames_[(frame_head_ + frame_count_) % WAKE_WORD_PREROLL_FRAMES];
+        slot.swap(opus);
+        if (frame_count_ < WAKE_WORD_PREROLL_FRAMES) {
+            frame_count_++;
+        } else {
+            frame_head_ = (frame_head_ + 1) % WAKE_WORD_PREROLL_FRAMES;
+        }
+    }
+}
+
+void WakeWordPreroll::Finish() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (encode_task_ != nullptr) {
+        // Feeding has stopped at detection, pad the tail of the wake word with silence to a full frame
+        size_t partial = pending_pcm_.size() % WAKE_WORD_PREROLL_FRAME_SAMPLES;
+        if (partial != 0) {
+            pending_pcm_.resize(pending_pcm_.size() + WAKE_WORD_PREROLL_FRAME_SAMPLES - partial, 0);
+            xTaskNotifyGive(encode_task_);
+        }
+        // Wait for the last frames (the wake word itself)
+        cv_.wait(lock, [this]() { return !encoding_ && pending_pcm_.empty(); });
+    }
+
+    output_.clear();
+    for (size_t i = 0; i < frame_count_; i++) {
+        output_.emplace_back(frames_[(frame_head_ + i) % WAKE_WORD_PREROLL_FRAMES]);
+    }
+    output_.emplace_back();
+    frame_head_ = 0;
+    frame_count_ = 0;
+    pending_pcm_.clear();
+    if (encoder_) {
+        encoder_->ResetState();
+    }
+    cv_.notify_all();
+}
+
+bool WakeWordPreroll::Pop(std::vector<uint8_t>& opus) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this]() { return !output_.empty(); });
+    opus.swap(output_.front());
+    output_.pop_front();
+    return !opus.empty();
+}
@@ -0,0 +1,69 @@
+#ifndef WAKE_WORD_PREROLL_H
+#define WAKE_WORD_PREROLL_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <array>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <cstdint>
+
+#include <opus_encoder.h>
+
+// Audio kept before the wake word is detected
+#define WAKE_WORD_PREROLL_MS 2000
+#define WAKE_WORD_PREROLL_FRAME_MS 60
+#define WAKE_WORD_PREROLL_FRAMES (WAKE_WORD_PREROLL_MS / WAKE_WORD_PREROLL_FRAME_MS + 1)
+// PCM frames allowed to wait for the encoder, older audio is dropped if it falls behind
+#define WAKE_WORD_PREROLL_PENDING_FRAMES 4
+
+/*
+ * Keeps the last WAKE_WORD_PREROLL_MS of 16kHz mono microphone audio as Opus frames.
+ *
+ * Feed() only copies PCM into a staging buffer, a background task encodes every complete
+ * frame into a fixed circular store as audio arrives. When the wake word is detected Finish()
+ * hands the stored frames to Pop() at once, instead of encoding two seconds of PCM first.
+ */
+class WakeWordPreroll {
+public:
+    WakeWordPreroll();
+    ~WakeWordPreroll();
+
+    // Called from the detection path with 16kHz mono samples
+    void Feed(const int16_t* data, size_t samples);
+    // Encodes the partial last frame padded with silence, queues the stored frames for Pop()
+    // followed by an end marker, and starts a new pre-roll
+    void Finish();
+    // Blocks until a frame is available, returns false at the end marker
+    bool Pop(std::vector<uint8_t>& opus);
+
+private:
+    std::mutex mutex_;
+    std::condition_variable cv_;
+
+    // PCM waiting to be encoded, written by Feed() and read by the encode task
+    std::vector<int16_t> pending_pcm_;
+    bool encoding_ = false;
+
+    // Encoded frames, a circular store that overwrites the oldest frame
+    std::array<std::vector<uint8_t>, WAKE_WORD_PREROLL_FRAMES> frames_;
+    size_t frame_head_ = 0;
+    size_t frame_count_ = 0;
+
+    // Frames handed over by Finish(), an empty frame marks the end
+    std::deque<std::vector<uint8_t>> output_;
+
+    std::unique_ptr<OpusEncoderWrapper> encoder_;
+    TaskHandle_t encode_task_ = nullptr;
+    StaticTask_t* encode_task_buffer_ = nullptr;
+    StackType_t* encode_task_stack_ = nullptr;
+
+    void StartEncodeTask();
+    void EncodeTask();
+};
+
+#endif // WAKE_WORD_PREROLL_H
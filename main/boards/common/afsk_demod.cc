@@ -1,6 +1,7 @@
 #include "afsk_demod.h"
 #include <cstring>
 #include <algorithm>
+#include <limits>
 #include "esp_log.h"
 #include "display.h"
 
@@ -12,6 +13,30 @@ namespace audio_wifi_config
 {
     static const char *kLogTag = "AUDIO_WIFI_CONFIG";
 
+    // Splits "SSID\npassword", connects and restarts the device on success
+    static void ApplyWifiCredentials(WifiConfigurationAp *wifi_ap, Display *display, const std::string &text)
+    {
+        ESP_LOGI(kLogTag, "Received text data: %s", text.c_str());
+        display->SetChatMessage("system", text.c_str());
+
+        // Split SSID and password by newline character
+        size_t newline_position = text.find('\n');
+        if (newline_position == std::string::npos) {
+            ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
+            return;
+        }
+        std::string wifi_ssid = text.substr(0, newline_position);
+        std::string wifi_password = text.substr(newline_position + 1);
+        ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
+
+        if (wifi_ap->ConnectToWifi(wifi_ssid, wifi_password)) {
+            wifi_ap->Save(wifi_ssid, wifi_password);  // Save WiFi credentials
+            esp_restart();                            // Restart device to apply new WiFi configuration
+        } else {
+            ESP_LOGE(kLogTag, "Failed to connect to WiFi with received credentials");
+        }
+    }
+
     void ReceiveWifiCredentialsFromAudio(Application *app,
                                         WifiConfigurationAp *wifi_ap,
                                         Display *display,
@@ -19,10 +44,21 @@ namespace audio_wifi_config
                                     )
     {
         const int kInputSampleRate = 16000;                                    // Input sampling rate
-        const float kDownsampleStep = static_cast<float>(kInputSampleRate) / static_cast<float>(kAudioSampleRate); // Downsampling step
+        const size_t kDownsampleStep = kInputSampleRate / kAudioSampleRate;    // Downsampling step
         std::vector<int16_t> audio_data;
-        AudioSignalProcessor signal_processor(kAudioSampleRate, kMarkFrequency, kSpaceFrequency, kBitRate, kWindowSize);
-        AudioDataBuffer data_buffer;
+        std::vector<float> downsampled_data;
+        std::vector<float> probabilities;
+
+        // Both modes are demodulated at once, the sender picks one
+        std::vector<TonePair> multi_tone_pairs;
+        for (size_t c = 0; c < kMultiToneChannels; ++c) {
+            size_t space_frequency = kMultiToneBaseFrequency + 2 * c * kMultiToneSpacing;
+            multi_tone_pairs.push_back({space_frequency, space_frequency + kMultiToneSpacing});
+        }
+        AudioSignalProcessor compatible_processor(kAudioSampleRate, {{kSpaceFrequency, kMarkFrequency}}, kBitRate);
+        AudioSignalProcessor multi_tone_processor(kAudioSampleRate, multi_tone_pairs, kMultiToneSymbolRate);
+        AudioDataBuffer compatible_buffer;
+        AudioDataBuffer multi_tone_buffer;
 
         while (true)
         {
@@ -40,64 +76,32 @@ namespace audio_wifi_config
                 continue;
             }
 
-            if (input_channels == 2) { // 如果是双声道输入，转换为单声道
-                auto mono_data = std::vector<int16_t>(audio_data.size() / 2);
-                for (size_t i = 0, j = 0; i < mono_data.size(); ++i, j += 2) {
-                    mono_data[i] = audio_data[j];
-                }
-                audio_data = std::move(mono_data);
-            }
-            
-            // Downsample the audio data
-            std::vector<float> downsampled_data;
-            size_t last_index = 0;
-
-            if (kDownsampleStep > 1.0f) {
-                downsampled_data.reserve(audio_data.size() / static_cast<size_t>(kDownsampleStep));
-                for (size_t i = 0; i < audio_data.size(); ++i) {
-                    size_t sample_index = static_cast<size_t>(i / kDownsampleStep);
-                    if ((sample_index + 1) > last_index) {
-                        downsampled_data.push_back(static_cast<float>(audio_data[i]));
-                        last_index = sample_index + 1;
-                    }
-                }
-            } else {
-                downsampled_data.reserve(audio_data.size());
-                for (int16_t sample : audio_data) {
-                    downsampled_data.push_back(static_cast<float>(sample));
+            // Downsample the audio data, averaging the dropped samples keeps the tones above
+            // the new Nyquist frequency from aliasing into the Mark/Space bins.
+            // For stereo input only the first channel is used.
+            size_t stride = input_channels == 2 ? 2 : 1;
+            size_t frames = audio_data.size() / stride;
+            downsampled_data.resize(frames / kDownsampleStep);
+            for (size_t i = 0; i < downsampled_data.size(); ++i) {
+                float sum = 0.0f;
+                for (size_t j = 0; j < kDownsampleStep; ++j) {
+                    sum += static_cast<float>(audio_data[(i * kDownsampleStep + j) * stride]);
                 }
+                downsampled_data[i] = sum / static_cast<float>(kDownsampleStep);
             }
-            
-            // Process audio samples to get probability data
-            auto probabilities = signal_processor.ProcessAudioSamples(downsampled_data);
-            
-            // Feed probability data to the data buffer
-            if (data_buffer.ProcessProbabilityData(probabilities, 0.5f)) {
+
+            // Process audio samples to get probability data and feed it to the data buffer
+            compatible_processor.ProcessAudioSamples(downsampled_data.data(), downsampled_data.size(), probabilities);
+            if (compatible_buffer.ProcessProbabilityData(probabilities, 0.5f) && compatible_buffer.decoded_text.has_value()) {
                 // If complete data was received, extract WiFi credentials
-                if (data_buffer.decoded_text.has_value()) {
-                    ESP_LOGI(kLogTag, "Received text data: %s", data_buffer.decoded_text->c_str());
-                    display->SetChatMessage("system", data_buffer.decoded_text->c_str());
-                    
-                    // Split SSID and password by newline character
-                    std::string wifi_ssid, wifi_password;
-                    size_t newline_position = data_buffer.decoded_text->find('\n');
-                    if (newline_position != std::string::npos) {
-                        wifi_ssid = data_buffer.decoded_text->substr(0, newline_position);
-                        wifi_password = data_buffer.decoded_text->substr(newline_position + 1);
-                        ESP_LOGI(kLogTag, "WiFi SSID: %s, Password: %s", wifi_ssid.c_str(), wifi_password.c_str());
-                    } else {
-                        ESP_LOGE(kLogTag, "Invalid data format, no newline character found");
-                        continue;
-                    }
-                    
-                    if (wifi_ap->ConnectToWifi(wifi_ssid, wifi_password)) {
-                        wifi_ap->Save(wifi_ssid, wifi_password);  // Save WiFi credentials
-                        esp_restart();                            // Restart device to apply new WiFi configuration
-                    } else {
-                        ESP_LOGE(kLogTag, "Failed to connect to WiFi with received credentials");
-                    }
-                    data_buffer.decoded_text.reset();  // Clear processed data
-                }
+                ApplyWifiCredentials(wifi_ap, display, *compatible_buffer.decoded_text);
+                compatible_buffer.decoded_text.reset();  // Clear processed data
+            }
+
+            multi_tone_processor.ProcessAudioSamples(downsampled_data.data(), downsampled_data.size(), probabilities);
+            if (multi_tone_buffer.ProcessProbabilityData(probabilities, 0.5f) && multi_tone_buffer.decoded_text.has_value()) {
+                ApplyWifiCredentials(wifi_ap, display, *multi_tone_buffer.decoded_text);
+                multi_tone_buffer.decoded_text.reset();
             }
             vTaskDelay(pdMS_TO_TICKS(1));  // 1ms delay
         }
@@ -112,109 +116,123 @@ namespace audio_wifi_config
     const std::vector<uint8_t> kDefaultEndTransmissionPattern = {
         0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 1, 0, 0};
 
-    // FrequencyDetector implementation
-    FrequencyDetector::FrequencyDetector(float frequency, size_t window_size)
-        : frequency_(frequency), window_size_(window_size) {
-        frequency_bin_ = std::floor(frequency_ * static_cast<float>(window_size_));
-        angular_frequency_ = 2.0f * M_PI * frequency_;
-        cos_coefficient_ = std::cos(angular_frequency_);
-        sin_coefficient_ = std::sin(angular_frequency_);
-        filter_coefficient_ = 2.0f * cos_coefficient_;
-
-        // Initialize state buffer
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+    // SlidingDftBank implementation
+    SlidingDftBank::SlidingDftBank(const std::vector<float> &frequencies, size_t window_size)
+        : window_size_(window_size), history_index_(0), damping_(0.9995f),
+          history_(window_size, 0.0f), real_(frequencies.size(), 0.0f), imaginary_(frequencies.size(), 0.0f) {
+        damping_pow_window_ = std::pow(damping_, static_cast<float>(window_size_));
+        for (float frequency : frequencies) {
+            float frequency_bin = frequency * static_cast<float>(window_size_);
+            if (std::fabs(frequency_bin - std::round(frequency_bin)) > 0.01f) {
+                // The tone leaks into its neighbours, decoding still works with less margin
+                ESP_LOGW(kLogTag, "Frequency %.4f is not on a bin of window %zu", frequency, window_size_);
+            }
+            float angular_frequency = 2.0f * M_PI * frequency;
+            cos_coefficients_.push_back(std::cos(angular_frequency));
+            sin_coefficients_.push_back(std::sin(angular_frequency));
+        }
     }
 
-    void FrequencyDetector::Reset() {
-        state_buffer_.clear();
-        state_buffer_.push_back(0.0f);
-        state_buffer_.push_back(0.0f);
+    void SlidingDftBank::Reset() {
+        std::fill(history_.begin(), history_.end(), 0.0f);
+        std::fill(real_.begin(), real_.end(), 0.0f);
+        std::fill(imaginary_.begin(), imaginary_.end(), 0.0f);
+        history_index_ = 0;
     }
 
-    void FrequencyDetector::ProcessSample(float sample) {
-        if (state_buffer_.size() < 2) {
-            return;
+    void SlidingDftBank::ProcessSample(float sample) {
+        // X[n] = r * e^(jw) * X[n-1] + x[n] - r^N * x[n-N]
+        float delta = sample - damping_pow_window_ * history_[history_index_];
+        history_[history_index_] = sample;
+        if (++history_index_ == window_size_) {
+            history_index_ = 0;
         }
 
-        float s_minus_2 = state_buffer_.front();  // S[-2]
-        state_buffer_.pop_front();
-        float s_minus_1 = state_buffer_.front();  // S[-1]
-        state_buffer_.pop_front();
-
-        float s_current = sample + filter_coefficient_ * s_minus_1 - s_minus_2;
+        const size_t bin_count = real_.size();
+        for (size_t i = 0; i < bin_count; ++i) {
+            float real_part = damping_ * (cos_coefficients_[i] * real_[i] - sin_coefficients_[i] * imaginary_[i]);
+            float imaginary_part = damping_ * (sin_coefficients_[i] * real_[i] + cos_coefficients_[i] * imaginary_[i]);
+            real_[i] = real_part + delta;
+            imaginary_[i] = imaginary_part;
+        }
+    }
 
-        state_buffer_.push_back(s_minus_1);  // Put S[-1] back
-        state_buffer_.push_back(s_current);  // Add new S[0]
+    float SlidingDftBank::GetAmplitude(size_t bin) const {
+        return std::sqrt(real_[bin] * real_[bin] + imaginary_[bin] * imaginary_[bin]) /
+               (static_cast<float>(window_size_) / 2.0f);
     }
 
-    float FrequencyDetector::GetAmplitude() const {
-        if (state_buffer_.size() < 2) {
-            return 0.0f;
+    // Builds the Space / Mark bin frequencies of every channel, in that order
+    static std::vector<float> GetBinFrequencies(size_t sample_rate, const std::vector<TonePair> &tone_pairs) {
+        std::vector<float> frequencies;
+        for (const auto &pair : tone_pairs) {
+            frequencies.push_back(static_cast<float>(pair.space_frequency) / static_cast<float>(sample_rate));
+            frequencies.push_back(static_cast<float>(pair.mark_frequency) / static_cast<float>(sample_rate));
         }
-
-        float s_minus_1 = state_buffer_[1];                      // S[-1]
-        float s_minus_2 = state_buffer_[0];                      // S[-2]
-        float real_part = cos_coefficient_ * s_minus_1 - s_minus_2;  // Real part
-        float imaginary_part = sin_coefficient_ * s_minus_1;         // Imaginary part
-
-        return std::sqrt(real_part * real_part + imaginary_part * imaginary_part) / 
-               (static_cast<float>(window_size_) / 2.0f);
+        return frequencies;
     }
 
     // AudioSignalProcessor implementation
-    AudioSignalProcessor::AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
-                                             size_t bit_rate, size_t window_size)
-        : input_buffer_size_(window_size), output_sample_count_(0) {
-        if (sample_rate % bit_rate != 0) {
+    AudioSignalProcessor::AudioSignalProcessor(size_t sample_rate, const std::vector<TonePair> &tone_pairs,
+                                             size_t symbol_rate)
+        : channel_count_(tone_pairs.size()), samples_per_symbol_(sample_rate / symbol_rate),
+          sample_phase_(0), samples_since_symbol_(0), symbol_phase_(0),
+          phase_scores_(sample_rate / symbol_rate, 0.0f),
+          dft_bank_(GetBinFrequencies(sample_rate, tone_pairs), sample_rate / symbol_rate) {
+        if (sample_rate % symbol_rate != 0) {
             // On ESP32 we can continue execution, but log the error
-            ESP_LOGW(kLogTag, "Sample rate %zu is not divisible by bit rate %zu", sample_rate, bit_rate);
+            ESP_LOGW(kLogTag, "Sample rate %zu is not divisible by symbol rate %zu", sample_rate, symbol_rate);
         }
-
-        float normalized_mark_freq = static_cast<float>(mark_frequency) / static_cast<float>(sample_rate);
-        float normalized_space_freq = static_cast<float>(space_frequency) / static_cast<float>(sample_rate);
-
-        mark_detector_ = std::make_unique<FrequencyDetector>(normalized_mark_freq, window_size);
-        space_detector_ = std::make_unique<FrequencyDetector>(normalized_space_freq, window_size);
-
-        samples_per_bit_ = sample_rate / bit_rate;  // Number of samples per bit
     }
 
-    std::vector<float> AudioSignalProcessor::ProcessAudioSamples(const std::vector<float> &samples) {
-        std::vector<float> result;
-
-        for (float sample : samples) {
-            if (input_buffer_.size() < input_buffer_size_) {
-                input_buffer_.push_back(sample);  // Just add, don't process yet
-            } else {
-                // Input buffer is full, process the data
-                input_buffer_.pop_front();   // Remove oldest sample
-                input_buffer_.push_back(sample);  // Add new sample
-                output_sample_count_++;
-
-                if (output_sample_count_ >= samples_per_bit_) {
-                    // Process all samples in the window using Goertzel algorithm
-                    for (float window_sample : input_buffer_) {
-                        mark_detector_->ProcessSample(window_sample);
-                        space_detector_->ProcessSample(window_sample);
-                    }
-
-                    float mark_amplitude = mark_detector_->GetAmplitude();   // Mark amplitude
-                    float space_amplitude = space_detector_->GetAmplitude(); // Space amplitude
-
+    void AudioSignalProcessor::ProcessAudioSamples(const float *samples, size_t count, std::vector<float> &probabilities) {
+        // Scores fade over about 16 symbols, long enough to ignore a noisy symbol
+        const float kScoreDecay = 15.0f / 16.0f;
+        // A new symbol phase must be clearly better, so noise does not make the timing jitter
+        const float kPhaseHysteresis = 1.1f;
+
+        probabilities.clear();
+        for (size_t n = 0; n < count; ++n) {
+            dft_bank_.ProcessSample(samples[n]);
+            samples_since_symbol_++;
+
+            // When the window lines up with a symbol every channel holds a single tone,
+            // so the Mark/Space contrast is the highest at that phase
+            float score = 0.0f;
+            for (size_t c = 0; c < channel_count_; ++c) {
+                float space_amplitude = dft_bank_.GetAmplitude(2 * c);
+                float mark_amplitude = dft_bank_.GetAmplitude(2 * c + 1);
+                score += std::fabs(mark_amplitude - space_amplitude);
+            }
+            float &phase_score = phase_scores_[sample_phase_];
+            phase_score = phase_score * kScoreDecay + score;
+
+            // Symbols are at least half a symbol apart, so a phase change never outputs one twice
+            if (sample_phase_ == symbol_phase_ && samples_since_symbol_ >= samples_per_symbol_ / 2) {
+                for (size_t c = 0; c < channel_count_; ++c) {
+                    float space_amplitude = dft_bank_.GetAmplitude(2 * c);
+                    float mark_amplitude = dft_bank_.GetAmplitude(2 * c + 1);
                     // Avoid division by zero
-                    float mark_probability = mark_amplitude / 
-                                           (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon());
-                    result.push_back(mark_probability);
-
-                    // Reset detector windows
-                    mark_detector_->Reset();
-                    space_detector_->Reset();
-                    output_sample_count_ = 0;  // Reset output counter
+                    probabilities.push_back(mark_amplitude /
+                                            (space_amplitude + mark_amplitude + std::numeric_limits<float>::epsilon()));
+                }
+                samples_since_symbol_ = 0;
+
+                auto best = std::max_element(phase_scores_.begin(), phase_scores_.end());
+                if (*best > phase_scores_[symbol_phase_] * kPhaseHysteresis) {
+                    symbol_phase_ = best - phase_scores_.begin();
                 }
             }
+
+            if (++sample_phase_ == samples_per_symbol_) {
+                sample_phase_ = 0;
+            }
         }
+    }
 
+    std::vector<float> AudioSignalProcessor::ProcessAudioSamples(const std::vector<float> &samples) {
+        std::vector<float> result;
+        ProcessAudioSamples(samples.data(), samples.size(), result);
         return result;
     }
 
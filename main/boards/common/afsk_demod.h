@@ -10,11 +10,22 @@
 #include "application.h"
 
 // Audio signal processing constants for WiFi configuration via audio
-const size_t kAudioSampleRate = 6400;
+// The microphone runs at 16kHz, the demodulator works on every other sample
+const size_t kAudioSampleRate = 8000;
+
+// Compatible mode: one Mark/Space pair at 100 bits per second
 const size_t kMarkFrequency = 1800;
 const size_t kSpaceFrequency = 1500;
 const size_t kBitRate = 100;
-const size_t kWindowSize = 64;
+
+// Multi-tone mode: kMultiToneChannels Mark/Space pairs sent at the same time, each carries one bit
+// per symbol, 500 bits per second in total. Channel c uses Space = base + 2 * c * spacing and
+// Mark = Space + spacing, the spacing is a multiple of the symbol rate so every tone falls on a
+// DFT bin of the symbol window and the tones do not leak into each other.
+const size_t kMultiToneChannels = 4;
+const size_t kMultiToneSymbolRate = 125;
+const size_t kMultiToneBaseFrequency = 1000;
+const size_t kMultiToneSpacing = 250;
 
 namespace audio_wifi_config
 {
@@ -23,31 +34,42 @@ namespace audio_wifi_config
                                          size_t input_channels = 1);
 
     /**
-     * Goertzel algorithm implementation for single frequency detection
-     * Used to detect specific audio frequencies in the AFSK demodulation process
+     * Mark/Space frequency pair of one data channel
      */
-    class FrequencyDetector
+    struct TonePair
+    {
+        size_t space_frequency;  // Frequency for digital '0'
+        size_t mark_frequency;   // Frequency for digital '1'
+    };
+
+    /**
+     * Bank of recursive sliding DFT bins over a window of the last window_size samples
+     * Every sample updates each bin in O(1), so the amplitudes of all tones are available
+     * at every sample instead of re-running Goertzel over the whole window
+     */
+    class SlidingDftBank
     {
     private:
-        float frequency_;              // Target frequency (normalized, i.e., f / fs)
-        size_t window_size_;           // Window size for analysis
-        float frequency_bin_;          // Frequency bin
-        float angular_frequency_;      // Angular frequency
-        float cos_coefficient_;        // cos(w)
-        float sin_coefficient_;        // sin(w)
-        float filter_coefficient_;     // 2 * cos(w)
-        std::deque<float> state_buffer_;  // Circular buffer for storing S[-1] and S[-2]
+        size_t window_size_;            // Window size for analysis
+        size_t history_index_;          // Oldest sample in the circular history
+        float damping_;                 // Keeps the recursion stable against rounding errors
+        float damping_pow_window_;      // damping ^ window_size
+        std::vector<float> history_;    // Last window_size samples, circular
+        std::vector<float> cos_coefficients_;  // cos(w) of each bin
+        std::vector<float> sin_coefficients_;  // sin(w) of each bin
+        std::vector<float> real_;       // Real part of each bin
+        std::vector<float> imaginary_;  // Imaginary part of each bin
 
     public:
         /**
          * Constructor
-         * @param frequency Normalized frequency (f / fs)
+         * @param frequencies Normalized frequencies (f / fs) of the bins
          * @param window_size Window size for analysis
          */
-        FrequencyDetector(float frequency, size_t window_size);
+        SlidingDftBank(const std::vector<float> &frequencies, size_t window_size);
 
         /**
-         * Reset the detector state
+         * Reset the bank state
          */
         void Reset();
 
@@ -58,37 +80,46 @@ namespace audio_wifi_config
         void ProcessSample(float sample);
 
         /**
-         * Calculate current amplitude
+         * Calculate the current amplitude of one bin
+         * @param bin Bin index, in the order of the constructor frequencies
          * @return Amplitude value
          */
-        float GetAmplitude() const;
+        float GetAmplitude(size_t bin) const;
     };
 
     /**
-     * Audio signal processor for Mark/Space frequency pair detection
-     * Processes audio signals to extract digital data using AFSK demodulation
+     * Audio signal processor for one or more Mark/Space frequency pairs
+     * Each pair is a channel carrying one bit per symbol, the symbol timing is recovered
+     * from the sample phase where the channels are the most decisive
      */
     class AudioSignalProcessor
     {
     private:
-        std::deque<float> input_buffer_;             // Input sample buffer
-        size_t input_buffer_size_;                   // Input buffer size = window size
-        size_t output_sample_count_;                 // Output sample counter
-        size_t samples_per_bit_;                     // Samples per bit threshold
-        std::unique_ptr<FrequencyDetector> mark_detector_;   // Mark frequency detector
-        std::unique_ptr<FrequencyDetector> space_detector_;  // Space frequency detector
+        size_t channel_count_;                  // Number of Mark/Space pairs
+        size_t samples_per_symbol_;             // Symbol length, also the DFT window
+        size_t sample_phase_;                   // Position of the current sample in the symbol
+        size_t samples_since_symbol_;           // Samples since the last output symbol
+        size_t symbol_phase_;                   // Sample phase where symbols are taken
+        std::vector<float> phase_scores_;       // Smoothed decisiveness of each sample phase
+        SlidingDftBank dft_bank_;               // Space and Mark bins of every channel
 
     public:
         /**
          * Constructor
          * @param sample_rate Audio sampling rate
-         * @param mark_frequency Mark frequency for digital '1'
-         * @param space_frequency Space frequency for digital '0'
-         * @param bit_rate Data transmission bit rate
-         * @param window_size Analysis window size
+         * @param tone_pairs Mark/Space frequencies of each channel
+         * @param symbol_rate Symbols per second, each symbol carries one bit per channel
+         */
+        AudioSignalProcessor(size_t sample_rate, const std::vector<TonePair> &tone_pairs, size_t symbol_rate);
+
+        /**
+         * Process input audio samples
+         * @param samples Input audio samples
+         * @param count Number of samples
+         * @param probabilities Output Mark probability values (0.0 to 1.0), one per channel and
+         *                      symbol in channel order, cleared first
          */
-        AudioSignalProcessor(size_t sample_rate, size_t mark_frequency, size_t space_frequency,
-                           size_t bit_rate, size_t window_size);
+        void ProcessAudioSamples(const float *samples, size_t count, std::vector<float> &probabilities);
 
         /**
          * Process input audio samples
@@ -10,6 +10,9 @@ public:
     virtual bool SetHMirror(bool enabled) = 0;
     virtual bool SetVFlip(bool enabled) = 0;
     virtual std::string Explain(const std::string& question) = 0;
+    // Continuous live preview on the display, stopped by the next Capture()
+    virtual bool StartPreview(int fps) { return false; }
+    virtual void StopPreview() {}
 };
 
 #endif // CAMERA_H
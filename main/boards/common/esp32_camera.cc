@@ -8,6 +8,8 @@
 
 #include <esp_log.h>
 #include <esp_heap_caps.h>
+#include <esp_pthread.h>
+#include <esp_timer.h>
 #include <cstring>
 
 #define TAG "Esp32Camera"
@@ -27,6 +29,7 @@ Esp32Camera::Esp32Camera(const camera_config_t& config) {
 }
 
 Esp32Camera::~Esp32Camera() {
+    StopPreview();
     if (fb_) {
         esp_camera_fb_return(fb_);
         fb_ = nullptr;
@@ -43,6 +46,8 @@ bool Esp32Camera::Capture() {
     if (encoder_thread_.joinable()) {
         encoder_thread_.join();
     }
+    // The captured photo replaces the live preview
+    StopPreview();
 
     auto start_time = esp_timer_get_time();
     int frames_to_get = 2;
@@ -60,29 +65,95 @@ bool Esp32Camera::Capture() {
     auto end_time = esp_timer_get_time();
     ESP_LOGI(TAG, "Camera captured %d frames in %d ms", frames_to_get, int((end_time - start_time) / 1000));
 
-    // 显示预览图片
+    // 显示预览图片，直接从摄像头帧缩放到显示尺寸
     auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
-    if (display != nullptr) {
-        auto data = (uint8_t*)heap_caps_malloc(fb_->len, MALLOC_CAP_SPIRAM);
-        if (data == nullptr) {
-            ESP_LOGE(TAG, "Failed to allocate memory for preview image");
-            return false;
-        }
+    if (display != nullptr && fb_->format == PIXFORMAT_RGB565) {
+        display->ShowPreviewFrame(fb_->buf, fb_->width, fb_->height);
+    }
+    return true;
+}
 
-        auto src = (uint16_t*)fb_->buf;
-        auto dst = (uint16_t*)data;
-        size_t pixel_count = fb_->len / 2;
-        for (size_t i = 0; i < pixel_count; i++) {
-            // 交换每个16位字内的字节
-            dst[i] = __builtin_bswap16(src[i]);
-        }
+bool Esp32Camera::StartPreview(int fps) {
+    auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
+    if (display == nullptr || fps <= 0) {
+        return false;
+    }
+    if (fps > CAMERA_PREVIEW_MAX_FPS) {
+        fps = CAMERA_PREVIEW_MAX_FPS;
+    }
 
-        auto image = std::make_unique<LvglAllocatedImage>(data, fb_->len, fb_->width, fb_->height, fb_->width * 2, LV_COLOR_FORMAT_RGB565);
-        display->SetPreviewImage(std::move(image));
+    StopPreview();
+    if (encoder_thread_.joinable()) {
+        encoder_thread_.join();
+    }
+    // With a single frame buffer the driver cannot deliver new frames while the photo is held
+    if (fb_ != nullptr) {
+        esp_camera_fb_return(fb_);
+        fb_ = nullptr;
     }
+
+    // Try one frame first, so a display without live preview support is reported to the caller
+    auto fb = esp_camera_fb_get();
+    if (fb == nullptr) {
+        ESP_LOGE(TAG, "Camera capture failed");
+        return false;
+    }
+    bool shown = fb->format == PIXFORMAT_RGB565 && display->ShowPreviewFrame(fb->buf, fb->width, fb->height, true);
+    esp_camera_fb_return(fb);
+    if (!shown) {
+        ESP_LOGW(TAG, "Live preview is not supported by this display or pixel format");
+        return false;
+    }
+
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.thread_name = "camera_preview";
+    cfg.stack_size = 4096;
+    cfg.prio = 2;
+    esp_pthread_set_cfg(&cfg);
+    preview_running_ = true;
+    preview_thread_ = std::thread(&Esp32Camera::PreviewLoop, this, fps);
+    cfg = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&cfg);
+    ESP_LOGI(TAG, "Live preview started at %d fps", fps);
     return true;
 }
 
+void Esp32Camera::StopPreview() {
+    preview_running_ = false;
+    if (preview_thread_.joinable()) {
+        preview_thread_.join();
+        ESP_LOGI(TAG, "Live preview stopped");
+    }
+}
+
+void Esp32Camera::PreviewLoop(int fps) {
+    auto display = dynamic_cast<LvglDisplay*>(Board::GetInstance().GetDisplay());
+    const TickType_t period = pdMS_TO_TICKS(1000 / fps) > 0 ? pdMS_TO_TICKS(1000 / fps) : 1;
+    TickType_t last_wake = xTaskGetTickCount();
+    int frames = 0;
+    int64_t render_us = 0;
+    while (preview_running_) {
+        auto fb = esp_camera_fb_get();
+        if (fb == nullptr) {
+            ESP_LOGE(TAG, "Camera capture failed");
+            vTaskDelay(pdMS_TO_TICKS(100));
+            continue;
+        }
+        // Frames go straight from the camera framebuffer into the display double buffer
+        auto start_time = esp_timer_get_time();
+        display->ShowPreviewFrame(fb->buf, fb->width, fb->height, true);
+        render_us += esp_timer_get_time() - start_time;
+        esp_camera_fb_return(fb);
+
+        if (++frames == fps * 10) {
+            ESP_LOGI(TAG, "Live preview: %d frames, %d us per frame", frames, int(render_us / frames));
+            frames = 0;
+            render_us = 0;
+        }
+        xTaskDelayUntil(&last_wake, period);
+    }
+}
+
 bool Esp32Camera::SetHMirror(bool enabled) {
     sensor_t *s = esp_camera_sensor_get();
     if (s == nullptr) {
@@ -144,6 +215,9 @@ std::string Esp32Camera::Explain(const std::string& question) {
     if (explain_url_.empty()) {
         throw std::runtime_error("Image explain URL or token is not set");
     }
+    if (fb_ == nullptr) {
+        throw std::runtime_error("No photo captured");
+    }
 
     // 创建局部的 JPEG 队列, 40 entries is about to store 512 * 40 = 20480 bytes of JPEG data
     QueueHandle_t jpeg_queue = xQueueCreate(40, sizeof(JpegChunk));
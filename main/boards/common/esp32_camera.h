@@ -5,12 +5,15 @@
 #include <lvgl.h>
 #include <thread>
 #include <memory>
+#include <atomic>
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
 #include "camera.h"
 
+#define CAMERA_PREVIEW_MAX_FPS 30
+
 struct JpegChunk {
     uint8_t* data;
     size_t len;
@@ -22,6 +25,10 @@ private:
     std::string explain_url_;
     std::string explain_token_;
     std::thread encoder_thread_;
+    std::thread preview_thread_;
+    std::atomic<bool> preview_running_ = false;
+
+    void PreviewLoop(int fps);
 
 public:
     Esp32Camera(const camera_config_t& config);
@@ -33,6 +40,8 @@ public:
     virtual bool SetHMirror(bool enabled) override;
     virtual bool SetVFlip(bool enabled) override;
     virtual std::string Explain(const std::string& question);
+    virtual bool StartPreview(int fps) override;
+    virtual void StopPreview() override;
 };
 
 #endif // ESP32_CAMERA_H
\ No newline at end of file
@@ -118,6 +118,8 @@ void SleepTimer::CheckTimer() {
             on_enter_deep_sleep_mode_();
         }
 
+        // Deep sleep does not run the shutdown handlers that flush pending settings
+        Settings::Commit();
         esp_deep_sleep_start();
     }
 }
@@ -3,6 +3,7 @@
 #include "display/lcd_display.h"
 #include "system_reset.h"
 #include "application.h"
+#include "settings.h"
 #include "button.h"
 #include "config.h"
 #include "led/single_led.h"
@@ -57,6 +58,7 @@ private:
             // 启用保持功能，确保睡眠期间电平不变
             rtc_gpio_hold_en(GPIO_NUM_1);
             esp_lcd_panel_disp_on_off(panel_, false); //关闭显示
+            Settings::Commit();
             esp_deep_sleep_start(); 
         });
         power_save_timer_->SetEnabled(true);
@@ -6,6 +6,7 @@
 #include <driver/gpio.h>
 #include "adc_battery_estimation.h"
 #include "power_controller.h"
+#include "settings.h"
 #include <driver/rtc_io.h>
 #include <esp_sleep.h>
 
@@ -178,6 +179,7 @@ public:
                     vTaskDelay(200 / portTICK_PERIOD_MS);
                     ESP_LOGI(TAG, "Initiating deep sleep");
 
+                    Settings::Commit();
                     esp_deep_sleep_start();
                     break;
                 }   
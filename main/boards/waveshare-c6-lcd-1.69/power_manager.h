@@ -7,6 +7,7 @@
 #include "esp_adc/adc_oneshot.h"
 #include "esp_adc/adc_cali.h"
 #include "esp_adc/adc_cali_scheme.h"
+#include "settings.h"
 #include <math.h>
 
 
@@ -162,6 +163,7 @@ public:
 
     void PowerOff(void) {
         if (bat_power_pin_ != GPIO_NUM_NC) {
+            Settings::Commit();
             gpio_set_level(bat_power_pin_, 0);
         }
     }
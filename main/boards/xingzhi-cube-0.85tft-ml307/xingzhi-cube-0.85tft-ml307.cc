@@ -121,6 +121,7 @@ private:
             // 启用保持功能，确保睡眠期间电平不变
             rtc_gpio_hold_en(GPIO_NUM_21);
             esp_lcd_panel_disp_on_off(panel_, false); //关闭显示
+            Settings::Commit();
             esp_deep_sleep_start();
         });
         power_save_timer_->SetEnabled(true);
@@ -3,6 +3,7 @@
 #include "display/oled_display.h"
 #include "system_reset.h"
 #include "application.h"
+#include "settings.h"
 #include "button.h"
 #include "config.h"
 #include "power_save_timer.h"
@@ -61,6 +62,7 @@ private:
             // 启用保持功能，确保睡眠期间电平不变
             rtc_gpio_hold_en(GPIO_NUM_21);
             esp_lcd_panel_disp_on_off(panel_, false); //关闭显示
+            Settings::Commit();
             esp_deep_sleep_start();
         });
         power_save_timer_->SetEnabled(true);
@@ -900,6 +900,27 @@ void LcdDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
     ESP_ERROR_CHECK(esp_timer_start_once(preview_timer_, PREVIEW_IMAGE_DURATION_MS * 1000));
 }
 
+// Frames are rendered at the size the preview is shown (half the screen width), so LVGL does not scale them
+bool LcdDisplay::ShowPreviewFrame(const uint8_t* frame, int width, int height, bool live) {
+    if (width <= 0 || height <= 0) {
+        return false;
+    }
+    int preview_width = std::min(width, width_ / 2);
+    int preview_height = height * preview_width / width;
+
+    // Rendered without the display lock, the back buffer is not on screen
+    auto img_dsc = preview_buffer_.Render(frame, width, height, preview_width, preview_height);
+    if (img_dsc == nullptr) {
+        return false;
+    }
+
+    DisplayLockGuard lock(this);
+    // The buffer held an older frame, drop anything LVGL cached for it
+    lv_image_cache_drop(img_dsc);
+    SetPreviewImage(std::make_unique<LvglSourceImage>(img_dsc));
+    return true;
+}
+
 void LcdDisplay::SetChatMessage(const char* role, const char* content) {
     DisplayLockGuard lock(this);
     if (chat_message_label_ == nullptr) {
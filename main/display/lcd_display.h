@@ -2,6 +2,7 @@
 #define LCD_DISPLAY_H
 
 #include "lvgl_display.h"
+#include "lvgl_preview_buffer.h"
 #include "gif/lvgl_gif.h"
 
 #include <esp_lcd_panel_io.h>
@@ -32,6 +33,7 @@ protected:
     lv_obj_t* chat_message_label_ = nullptr;
     esp_timer_handle_t preview_timer_ = nullptr;
     std::unique_ptr<LvglImage> preview_image_cached_ = nullptr;
+    LvglPreviewBuffer preview_buffer_;
 
     void InitializeLcdThemes();
     void SetupUI();
@@ -47,6 +49,9 @@ public:
     virtual void SetEmotion(const char* emotion) override;
     virtual void SetChatMessage(const char* role, const char* content) override; 
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image) override;
+#if !CONFIG_USE_WECHAT_MESSAGE_STYLE
+    virtual bool ShowPreviewFrame(const uint8_t* frame, int width, int height, bool live = false) override;
+#endif
     virtual void setDisplayOnOff(bool on) override;
     // Add theme switching function
     virtual void SetTheme(Theme* theme) override;
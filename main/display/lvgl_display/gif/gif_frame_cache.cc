@@ -0,0 +1,124 @@
+#include "gif_frame_cache.h"
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_rom_crc.h>
+#include <algorithm>
+#include <cstring>
+
+#define TAG "GifFrameCache"
+
+GifCacheEntry::~GifCacheEntry() {
+    for (auto& frame : frames_) {
+        heap_caps_free(const_cast<uint8_t*>(frame.indices));
+        if (frame.lct != nullptr) {
+            heap_caps_free(const_cast<gd_Palette*>(frame.lct));
+        }
+    }
+}
+
+bool GifCacheEntry::AddFrame(const gd_GIF* gif) {
+    size_t size = gif->fw * gif->fh;
+    auto indices = (uint8_t*)heap_caps_malloc(std::max<size_t>(size, 1), MALLOC_CAP_SPIRAM);
+    if (indices == nullptr) {
+        return false;
+    }
+    for (int y = 0; y < gif->fh; y++) {
+        memcpy(&indices[y * gif->fw], &gif->frame[(gif->fy + y) * gif->width + gif->fx], gif->fw);
+    }
+
+    gd_Palette* lct = nullptr;
+    if (gif->palette == &gif->lct) {
+        lct = (gd_Palette*)heap_caps_malloc(sizeof(gd_Palette), MALLOC_CAP_SPIRAM);
+        if (lct == nullptr) {
+            heap_caps_free(indices);
+            return false;
+        }
+        memcpy(lct, &gif->lct, sizeof(gd_Palette));
+        size += sizeof(gd_Palette);
+    }
+
+    if (frames_.empty()) {
+        // The NETSCAPE extension has been read with the first frame
+        loop_count_ = gif->loop_count;
+    }
+    frames_.push_back({
+        .fx = gif->fx,
+        .fy = gif->fy,
+        .fw = gif->fw,
+        .fh = gif->fh,
+        .gce = gif->gce,
+        .lct = lct,
+        .indices = indices,
+    });
+    bytes_ += size + sizeof(gd_Frame);
+    return true;
+}
+
+bool GifFrameCache::IsEnabled() const {
+    return heap_caps_get_total_size(MALLOC_CAP_SPIRAM) > 0;
+}
+
+GifCacheKey GifFrameCache::MakeKey(const void* data, size_t size) {
+    // The address and size identify an asset, the CRC guards against a reused address
+    size_t len = std::min<size_t>(size, GIF_FRAME_CACHE_KEY_BYTES);
+    return {
+        .data = data,
+        .size = size,
+        .crc = esp_rom_crc32_le(0, (const uint8_t*)data, len),
+    };
+}
+
+std::shared_ptr<const GifCacheEntry> GifFrameCache::Lookup(const GifCacheKey& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::find_if(entries_.begin(), entries_.end(), [&key](const auto& item) {
+        return item.first == key;
+    });
+    bool hit = it != entries_.end();
+    if (hit) {
+        hits_++;
+        entries_.splice(entries_.begin(), entries_, it);
+    } else {
+        misses_++;
+    }
+    ESP_LOGI(TAG, "%s, hit rate %lu%% (%lu/%lu), %u KB used", hit ? "Hit" : "Miss",
+        hits_ * 100 / (hits_ + misses_), hits_, hits_ + misses_, bytes_ / 1024);
+    return hit ? entries_.front().second : nullptr;
+}
+
+void GifFrameCache::Insert(const GifCacheKey& key, std::shared_ptr<GifCacheEntry> entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (entry->bytes() > GIF_FRAME_CACHE_BUDGET) {
+        return;
+    }
+    // Another instance of the same animation may have finished first
+    auto it = std::find_if(entries_.begin(), entries_.end(), [&key](const auto& item) {
+        return item.first == key;
+    });
+    if (it != entries_.end()) {
+        return;
+    }
+
+    while (!entries_.empty() && bytes_ + entry->bytes() > GIF_FRAME_CACHE_BUDGET) {
+        EvictLocked();
+    }
+    bytes_ += entry->bytes();
+    entries_.emplace_front(key, std::move(entry));
+    ESP_LOGI(TAG, "Cached %u frames, %u entries, %u KB used, hit rate %lu/%lu", entries_.front().second->frames().size(),
+        entries_.size(), bytes_ / 1024, hits_, hits_ + misses_);
+}
+
+bool GifFrameCache::MakeRoom(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    while (!entries_.empty() && heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < GIF_FRAME_CACHE_PSRAM_RESERVE + size) {
+        EvictLocked();
+    }
+    return heap_caps_get_free_size(MALLOC_CAP_SPIRAM) >= GIF_FRAME_CACHE_PSRAM_RESERVE + size;
+}
+
+void GifFrameCache::EvictLocked() {
+    auto& entry = entries_.back().second;
+    bytes_ -= entry->bytes();
+    ESP_LOGI(TAG, "Evicted %u frames, %u KB left", entry->frames().size(), bytes_ / 1024);
+    // Instances still playing the entry keep it alive until they are done
+    entries_.pop_back();
+}
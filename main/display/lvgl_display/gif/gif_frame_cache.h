@@ -0,0 +1,81 @@
+#pragma once
+
+#include "gifdec.h"
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// PSRAM held by complete animations in the cache
+#define GIF_FRAME_CACHE_BUDGET (1536 * 1024)
+// Entries are evicted while free PSRAM is below this, so the cache never starves the rest
+#define GIF_FRAME_CACHE_PSRAM_RESERVE (512 * 1024)
+// Bytes of the GIF data hashed into the key, with its address and size
+#define GIF_FRAME_CACHE_KEY_BYTES 1024
+
+struct GifCacheKey {
+    const void* data;
+    size_t size;
+    uint32_t crc;
+
+    bool operator==(const GifCacheKey& other) const {
+        return data == other.data && size == other.size && crc == other.crc;
+    }
+};
+
+/**
+ * The LZW decoded frames of one pass of an animation, replayed with gd_put_frame()
+ */
+class GifCacheEntry {
+public:
+    ~GifCacheEntry();
+
+    // Copies the frame gif has just decoded, returns false if there is no memory for it
+    bool AddFrame(const gd_GIF* gif);
+
+    const std::vector<gd_Frame>& frames() const { return frames_; }
+    size_t bytes() const { return bytes_; }
+    int32_t loop_count() const { return loop_count_; }
+
+private:
+    std::vector<gd_Frame> frames_;
+    size_t bytes_ = 0;
+    int32_t loop_count_ = -1;
+};
+
+/**
+ * Shared by all LvglGif instances, so an emoji that is shown again starts from its decoded
+ * frames instead of the LZW stream. Least recently used entries are evicted first.
+ */
+class GifFrameCache {
+public:
+    static GifFrameCache& GetInstance() {
+        static GifFrameCache instance;
+        return instance;
+    }
+
+    // Delete copy constructor and assignment operator
+    GifFrameCache(const GifFrameCache&) = delete;
+    GifFrameCache& operator=(const GifFrameCache&) = delete;
+
+    // Without PSRAM there is nothing to cache into
+    bool IsEnabled() const;
+
+    static GifCacheKey MakeKey(const void* data, size_t size);
+    std::shared_ptr<const GifCacheEntry> Lookup(const GifCacheKey& key);
+    void Insert(const GifCacheKey& key, std::shared_ptr<GifCacheEntry> entry);
+    // Evicts entries until free PSRAM can take size more bytes above the reserve
+    bool MakeRoom(size_t size);
+
+private:
+    GifFrameCache() = default;
+
+    std::mutex mutex_;
+    // Most recently used first
+    std::list<std::pair<GifCacheKey, std::shared_ptr<GifCacheEntry>>> entries_;
+    size_t bytes_ = 0;
+    uint32_t hits_ = 0;
+    uint32_t misses_ = 0;
+
+    void EvictLocked();
+};
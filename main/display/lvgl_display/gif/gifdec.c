@@ -10,23 +10,9 @@
 #define MIN(A, B) ((A) < (B) ? (A) : (B))
 #define MAX(A, B) ((A) > (B) ? (A) : (B))
 
-typedef struct Entry {
-    uint16_t length;
-    uint16_t prefix;
-    uint8_t  suffix;
-} Entry;
-
-typedef struct Table {
-    int bulk;
-    int nentries;
-    Entry * entries;
-} Table;
-
-#if LV_GIF_CACHE_DECODE_DATA
 #define LZW_MAXBITS                 12
 #define LZW_TABLE_SIZE              (1 << LZW_MAXBITS)
-#define LZW_CACHE_SIZE              (LZW_TABLE_SIZE * 4)
-#endif
+#define LZW_TABLE_BYTES             (LZW_TABLE_SIZE * (sizeof(uint32_t) + sizeof(uint16_t)))
 
 static gd_GIF  * gif_open(gd_GIF * gif);
 static bool f_gif_open(gd_GIF * gif, const void * path, bool is_file);
@@ -116,19 +102,12 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
         ESP_LOGW(TAG, "Zero size image");
         goto fail;
     }
-#if LV_GIF_CACHE_DECODE_DATA
-    if(0 == (INT_MAX - sizeof(gd_GIF) - LZW_CACHE_SIZE) / width / height / 5){
+    /* Canvas (4 bytes per pixel), the LZW table, the frame and the LZW output (1 byte per pixel each) */
+    if(0 == (INT_MAX - sizeof(gd_GIF) - LZW_TABLE_BYTES) / width / height / 6){
         ESP_LOGW(TAG, "Image dimensions are too large");
         goto fail;
     } 
-    gif = lv_malloc(sizeof(gd_GIF) + 5 * width * height + LZW_CACHE_SIZE);
-#else
-    if(0 == (INT_MAX - sizeof(gd_GIF)) / width / height / 5){
-        ESP_LOGW(TAG, "Image dimensions are too large");
-        goto fail;
-    } 
-    gif = lv_malloc(sizeof(gd_GIF) + 5 * width * height);
-#endif
+    gif = lv_malloc(sizeof(gd_GIF) + 6 * width * height + LZW_TABLE_BYTES);
     if(!gif) goto fail;
     memcpy(gif, gif_base, sizeof(gd_GIF));
     gif->width  = width;
@@ -140,14 +119,14 @@ static gd_GIF * gif_open(gd_GIF * gif_base)
     gif->palette = &gif->gct;
     gif->bgindex = bgidx;
     gif->canvas = (uint8_t *) &gif[1];
-    gif->frame = &gif->canvas[4 * width * height];
+    gif->lzw_offset = (uint32_t *) &gif->canvas[4 * width * height];
+    gif->lzw_length = (uint16_t *) &gif->lzw_offset[LZW_TABLE_SIZE];
+    gif->frame = (uint8_t *) &gif->lzw_length[LZW_TABLE_SIZE];
+    gif->lzw_out = &gif->frame[width * height];
     if(gif->bgindex) {
         memset(gif->frame, gif->bgindex, gif->width * gif->height);
     }
     bgcolor = &gif->palette->colors[gif->bgindex * 3];
-    #if LV_GIF_CACHE_DECODE_DATA
-    gif->lzw_cache = gif->frame + width * height;
-    #endif
 
 #ifdef GIFDEC_FILL_BG
     GIFDEC_FILL_BG(gif->canvas, gif->width * gif->height, 1, gif->width * gif->height, bgcolor, 0x00);
@@ -299,227 +278,6 @@ read_ext(gd_GIF * gif)
     }
 }
 
-static uint16_t
-get_key(gd_GIF *gif, int key_size, uint8_t *sub_len, uint8_t *shift, uint8_t *byte)
-{
-    int bits_read;
-    int rpad;
-    int frag_size;
-    uint16_t key;
-
-    key = 0;
-    for (bits_read = 0; bits_read < key_size; bits_read += frag_size) {
-        rpad = (*shift + bits_read) % 8;
-        if (rpad == 0) {
-            /* Update byte. */
-            if (*sub_len == 0) {
-                f_gif_read(gif, sub_len, 1); /* Must be nonzero! */
-                if (*sub_len == 0) return 0x1000;
-            }
-            f_gif_read(gif, byte, 1);
-            (*sub_len)--;
-        }
-        frag_size = MIN(key_size - bits_read, 8 - rpad);
-        key |= ((uint16_t) ((*byte) >> rpad)) << bits_read;
-    }
-    /* Clear extra bits to the left. */
-    key &= (1 << key_size) - 1;
-    *shift = (*shift + key_size) % 8;
-    return key;
-}
-
-#if LV_GIF_CACHE_DECODE_DATA
-/* Decompress image pixels.
- * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table) or parse error. */
-static int
-read_image_data(gd_GIF *gif, int interlace)
-{
-    uint8_t sub_len, shift, byte;
-    int ret = 0;
-    int key_size;
-    int y, pass, linesize;
-    uint8_t *ptr = NULL;
-    uint8_t *ptr_row_start = NULL;
-    uint8_t *ptr_base = NULL;
-    size_t start, end;
-    uint16_t key, clear_code, stop_code, curr_code;
-    int frm_off, frm_size,curr_size,top_slot,new_codes,slot;
-    /* The first value of the value sequence corresponding to key */
-    int first_value;
-    int last_key;
-    uint8_t *sp = NULL;
-    uint8_t *p_stack = NULL;
-    uint8_t *p_suffix = NULL;
-    uint16_t *p_prefix = NULL;
-
-    /* get initial key size and clear code, stop code */
-    f_gif_read(gif, &byte, 1);
-    key_size = (int) byte;
-    clear_code = 1 << key_size;
-    stop_code = clear_code + 1;
-    key = 0;
-
-    start = f_gif_seek(gif, 0, LV_FS_SEEK_CUR);
-    discard_sub_blocks(gif);
-    end = f_gif_seek(gif, 0, LV_FS_SEEK_CUR);
-    f_gif_seek(gif, start, LV_FS_SEEK_SET);
-
-    linesize = gif->width;
-    ptr_base = &gif->frame[gif->fy * linesize + gif->fx];
-    ptr_row_start = ptr_base;
-    ptr = ptr_row_start;
-    sub_len = shift = 0;
-    /* decoder */
-    pass = 0;
-    y = 0;
-    p_stack = gif->lzw_cache;
-    p_suffix = gif->lzw_cache + LZW_TABLE_SIZE;
-    p_prefix = (uint16_t*)(gif->lzw_cache + LZW_TABLE_SIZE * 2);
-    frm_off = 0;
-    frm_size = gif->fw * gif->fh;
-    curr_size = key_size + 1;
-    top_slot = 1 << curr_size;
-    new_codes = clear_code + 2;
-    slot = new_codes;
-    first_value = -1;
-    last_key = -1;
-    sp = p_stack;
-
-    while (frm_off < frm_size) {
-        /* copy data to frame buffer */
-        while (sp > p_stack) {
-            if(frm_off >= frm_size){
-                ESP_LOGW(TAG, "LZW table token overflows the frame buffer");
-                return -1;
-            }
-            *ptr++ = *(--sp);
-            frm_off += 1;
-            /* read one line */
-            if ((ptr - ptr_row_start) == gif->fw) {
-                if (interlace) {
-                    switch(pass) {
-                    case 0:
-                    case 1:
-                        y += 8;
-                        ptr_row_start += linesize * 8;
-                        break;
-                    case 2:
-                        y += 4;
-                        ptr_row_start += linesize * 4;
-                        break;
-                    case 3:
-                        y += 2;
-                        ptr_row_start += linesize * 2;
-                        break;
-                    default:
-                        break;
-                    }
-                    while (y >= gif->fh) {
-                        y  = 4 >> pass;
-                        ptr_row_start = ptr_base + linesize * y;
-                        pass++;
-                    }
-                } else {
-                    ptr_row_start += linesize;
-                }
-                ptr = ptr_row_start;
-            }
-        }
-
-        key = get_key(gif, curr_size, &sub_len, &shift, &byte);
-
-        if (key == stop_code || key >= LZW_TABLE_SIZE)
-            break;
-
-        if (key == clear_code) {
-            curr_size = key_size + 1;
-            slot = new_codes;
-            top_slot = 1 << curr_size;
-            first_value = last_key = -1;
-            sp = p_stack;
-            continue;
-        }
-
-        curr_code = key;
-        /*
-         * If the current code is a code that will be added to the decoding
-         * dictionary, it is composed of the data list corresponding to the
-         * previous key and its first data.
-         * */
-        if (curr_code == slot && first_value >= 0) {
-            *sp++ = first_value;
-            curr_code = last_key;
-        }else if(curr_code >= slot)
-            break;
-
-        while (curr_code >= new_codes) {
-            *sp++ = p_suffix[curr_code];
-            curr_code = p_prefix[curr_code];
-        }
-        *sp++ = curr_code;
-
-        /* Add code to decoding dictionary */
-        if (slot < top_slot && last_key >= 0) {
-            p_suffix[slot] = curr_code;
-            p_prefix[slot++] = last_key;
-        }
-        first_value = curr_code;
-        last_key = key;
-        if (slot >= top_slot) {
-            if (curr_size < LZW_MAXBITS) {
-                top_slot <<= 1;
-                curr_size += 1;
-            }
-        }
-    }
-
-    if (key == stop_code) f_gif_read(gif, &sub_len, 1); /* Must be zero! */
-    f_gif_seek(gif, end, LV_FS_SEEK_SET);
-    return ret;
-}
-#else
-static Table *
-new_table(int key_size)
-{
-    int key;
-    int init_bulk = MAX(1 << (key_size + 1), 0x100);
-    Table * table = lv_malloc(sizeof(*table) + sizeof(Entry) * init_bulk);
-    if(table) {
-        table->bulk = init_bulk;
-        table->nentries = (1 << key_size) + 2;
-        table->entries = (Entry *) &table[1];
-        for(key = 0; key < (1 << key_size); key++)
-            table->entries[key] = (Entry) {
-            1, 0xFFF, key
-        };
-    }
-    return table;
-}
-
-/* Add table entry. Return value:
- *  0 on success
- *  +1 if key size must be incremented after this addition
- *  -1 if could not realloc table */
-static int
-add_entry(Table ** tablep, uint16_t length, uint16_t prefix, uint8_t suffix)
-{
-    Table * table = *tablep;
-    if(table->nentries == table->bulk) {
-        table->bulk *= 2;
-        table = lv_realloc(table, sizeof(*table) + sizeof(Entry) * table->bulk);
-        if(!table) return -1;
-        table->entries = (Entry *) &table[1];
-        *tablep = table;
-    }
-    table->entries[table->nentries] = (Entry) {
-        length, prefix, suffix
-    };
-    table->nentries++;
-    if((table->nentries & (table->nentries - 1)) == 0)
-        return 1;
-    return 0;
-}
-
 /* Compute output index of y-th input line, in frame of height h. */
 static int
 interlaced_line_index(int h, int y)
@@ -542,88 +300,131 @@ interlaced_line_index(int h, int y)
     return y * 2 + 1;
 }
 
+/* Decode the LZW stream into gif->lzw_out, fw * fh indices in input line order.
+ * The string of a code is always a run of output that was already written, so the table keeps
+ * only its offset and length there and a code is decoded with one memcpy instead of walking a
+ * prefix chain backwards.
+ * Return the number of decoded pixels or -1 on parse error. */
+static int
+lzw_decode(gd_GIF * gif, int min_key_size, int out_size)
+{
+    uint32_t * offsets = gif->lzw_offset;
+    uint16_t * lengths = gif->lzw_length;
+    uint8_t * out = gif->lzw_out;
+    uint8_t block[255];
+    int block_len = 0, block_pos = 0;
+    uint32_t bits = 0;
+    int nbits = 0;
+    int clear, stop, key_size, key_mask, next_key, key;
+    int prev_offset = 0, prev_length = 0;
+    int pos = 0, start, length;
+
+    if(min_key_size < 1 || min_key_size >= LZW_MAXBITS) return -1;
+    clear = 1 << min_key_size;
+    stop = clear + 1;
+    key_size = min_key_size + 1;
+    key_mask = (1 << key_size) - 1;
+    next_key = clear + 2;
+
+    while(pos < out_size) {
+        /* Refill the bit buffer from the data sub-blocks. */
+        while(nbits < key_size) {
+            if(block_pos == block_len) {
+                uint8_t sub_len = 0;
+                f_gif_read(gif, &sub_len, 1);
+                if(sub_len == 0) return pos;
+                f_gif_read(gif, block, sub_len);
+                block_len = sub_len;
+                block_pos = 0;
+            }
+            bits |= (uint32_t) block[block_pos++] << nbits;
+            nbits += 8;
+        }
+        key = bits & key_mask;
+        bits >>= key_size;
+        nbits -= key_size;
+
+        if(key == clear) {
+            key_size = min_key_size + 1;
+            key_mask = (1 << key_size) - 1;
+            next_key = clear + 2;
+            prev_length = 0;
+            continue;
+        }
+        if(key == stop) break;
+
+        start = pos;
+        if(key < clear) {
+            out[pos++] = key;
+        }
+        else if(key < next_key) {
+            length = lengths[key];
+            if(length > out_size - pos) goto overflow;
+            memcpy(&out[pos], &out[offsets[key]], length);
+            pos += length;
+        }
+        else if(key == next_key && prev_length > 0) {
+            /* The previous string followed by its own first index. */
+            if(prev_length + 1 > out_size - pos) goto overflow;
+            memcpy(&out[pos], &out[prev_offset], prev_length);
+            out[pos + prev_length] = out[prev_offset];
+            pos += prev_length + 1;
+        }
+        else {
+            ESP_LOGW(TAG, "Invalid LZW code");
+            return -1;
+        }
+
+        /* The new string is the previous one plus the first index of this one, both already in out. */
+        if(prev_length > 0 && next_key < LZW_TABLE_SIZE) {
+            offsets[next_key] = prev_offset;
+            lengths[next_key] = prev_length + 1;
+            next_key++;
+            if(next_key > key_mask && key_size < LZW_MAXBITS) {
+                key_size++;
+                key_mask = (1 << key_size) - 1;
+            }
+        }
+        prev_offset = start;
+        prev_length = pos - start;
+    }
+    return pos;
+
+overflow:
+    ESP_LOGW(TAG, "LZW table token overflows the frame buffer");
+    return -1;
+}
+
 /* Decompress image pixels.
- * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table) or parse error. */
+ * Return 0 on success or -1 on parse error. */
 static int
 read_image_data(gd_GIF * gif, int interlace)
 {
-    uint8_t sub_len, shift, byte;
-    int init_key_size, key_size, table_is_full = 0;
-    int frm_off, frm_size, str_len = 0, i, p, x, y;
-    uint16_t key, clear, stop;
-    int ret;
-    Table * table;
-    Entry entry = {0};
+    uint8_t byte;
+    int decoded, rows, y;
     size_t start, end;
 
     f_gif_read(gif, &byte, 1);
-    key_size = (int) byte;
     start = f_gif_seek(gif, 0, LV_FS_SEEK_CUR);
     discard_sub_blocks(gif);
     end = f_gif_seek(gif, 0, LV_FS_SEEK_CUR);
     f_gif_seek(gif, start, LV_FS_SEEK_SET);
-    clear = 1 << key_size;
-    stop = clear + 1;
-    table = new_table(key_size);
-    key_size++;
-    init_key_size = key_size;
-    sub_len = shift = 0;
-    key = get_key(gif, key_size, &sub_len, &shift, &byte); /* clear code */
-    frm_off = 0;
-    ret = 0;
-    frm_size = gif->fw * gif->fh;
-    while(frm_off < frm_size) {
-        if(key == clear) {
-            key_size = init_key_size;
-            table->nentries = (1 << (key_size - 1)) + 2;
-            table_is_full = 0;
-        }
-        else if(!table_is_full) {
-            ret = add_entry(&table, str_len + 1, key, entry.suffix);
-            if(ret == -1) {
-                lv_free(table);
-                return -1;
-            }
-            if(table->nentries == 0x1000) {
-                ret = 0;
-                table_is_full = 1;
-            }
-        }
-        key = get_key(gif, key_size, &sub_len, &shift, &byte);
-        if(key == clear) continue;
-        if(key == stop || key == 0x1000) break;
-        if(ret == 1) key_size++;
-        entry = table->entries[key];
-        str_len = entry.length;
-	if(frm_off + str_len > frm_size){
-		ESP_LOGW(TAG, "LZW table token overflows the frame buffer");
-		lv_free(table);
-		return -1;
-	}
-        for(i = 0; i < str_len; i++) {
-            p = frm_off + entry.length - 1;
-            x = p % gif->fw;
-            y = p / gif->fw;
-            if(interlace)
-                y = interlaced_line_index((int) gif->fh, y);
-            gif->frame[(gif->fy + y) * gif->width + gif->fx + x] = entry.suffix;
-            if(entry.prefix == 0xFFF)
-                break;
-            else
-                entry = table->entries[entry.prefix];
-        }
-        frm_off += str_len;
-        if(key < table->nentries - 1 && !table_is_full)
-            table->entries[table->nentries - 1].suffix = entry.suffix;
-    }
-    lv_free(table);
-    if(key == stop) f_gif_read(gif, &sub_len, 1);  /* Must be zero! */
+
+    decoded = lzw_decode(gif, byte, gif->fw * gif->fh);
     f_gif_seek(gif, end, LV_FS_SEEK_SET);
+    if(decoded < 0) return -1;
+
+    /* Copy the decoded lines into the frame, a truncated image keeps the rest of the old frame. */
+    rows = gif->fw ? decoded / gif->fw : 0;
+    for(y = 0; y <= rows && y < gif->fh; y++) {
+        int len = y < rows ? gif->fw : decoded % gif->fw;
+        int line = interlace ? interlaced_line_index((int) gif->fh, y) : y;
+        if(len == 0) break;
+        memcpy(&gif->frame[(gif->fy + line) * gif->width + gif->fx], &gif->lzw_out[y * gif->fw], len);
+    }
     return 0;
 }
 
-#endif
-
 /* Read image.
  * Return 0 on success or -1 on out-of-memory (w.r.t. LZW code table) or parse error. */
 static int
@@ -668,16 +469,27 @@ render_frame_rect(gd_GIF * gif, uint8_t * buffer)
 #else
     int j, k;
     uint8_t index, * color;
+    uint32_t lut[0x100];
+    uint32_t * dst = (uint32_t *) buffer;
 
+    /* Expand the palette once per frame, then every pixel is a single ARGB8888 store. */
+    for(k = 0; k < 0x100; k++) {
+        color = &gif->palette->colors[k * 3];
+        lut[k] = 0xFF000000 | ((uint32_t) color[0] << 16) | ((uint32_t) color[1] << 8) | color[2];
+    }
     for(j = 0; j < gif->fh; j++) {
-        for(k = 0; k < gif->fw; k++) {
-            index = gif->frame[(gif->fy + j) * gif->width + gif->fx + k];
-            color = &gif->palette->colors[index * 3];
-            if(!gif->gce.transparency || index != gif->gce.tindex) {
-                buffer[(i + k) * 4 + 0] = *(color + 2);
-                buffer[(i + k) * 4 + 1] = *(color + 1);
-                buffer[(i + k) * 4 + 2] = *(color + 0);
-                buffer[(i + k) * 4 + 3] = 0xFF;
+        const uint8_t * src = &gif->frame[(gif->fy + j) * gif->width + gif->fx];
+        if(!gif->gce.transparency) {
+            for(k = 0; k < gif->fw; k++) {
+                dst[i + k] = lut[src[k]];
+            }
+        }
+        else {
+            for(k = 0; k < gif->fw; k++) {
+                index = src[k];
+                if(index != gif->gce.tindex) {
+                    dst[i + k] = lut[index];
+                }
             }
         }
         i += gif->width;
@@ -732,6 +544,7 @@ gd_get_frame(gd_GIF * gif)
     while(sep != ',') {
         if(sep == ';') {
             f_gif_seek(gif, gif->anim_start, LV_FS_SEEK_SET);
+            gif->frame_index = 0;
             if(gif->loop_count == 1 || gif->loop_count < 0) {
                 return 0;
             }
@@ -746,9 +559,34 @@ gd_get_frame(gd_GIF * gif)
     }
     if(read_image(gif) == -1)
         return -1;
+    gif->frame_index++;
     return 1;
 }
 
+/* Same as gd_get_frame() returning 1, with the frame taken from an earlier decode. */
+void
+gd_put_frame(gd_GIF * gif, const gd_Frame * frame)
+{
+    int j;
+
+    dispose(gif);
+    gif->gce = frame->gce;
+    gif->fx = frame->fx;
+    gif->fy = frame->fy;
+    gif->fw = frame->fw;
+    gif->fh = frame->fh;
+    if(frame->lct) {
+        memcpy(&gif->lct, frame->lct, sizeof(gif->lct));
+        gif->palette = &gif->lct;
+    }
+    else
+        gif->palette = &gif->gct;
+    for(j = 0; j < frame->fh; j++) {
+        memcpy(&gif->frame[(frame->fy + j) * gif->width + frame->fx], &frame->indices[j * frame->fw], frame->fw);
+    }
+    gif->frame_index++;
+}
+
 void
 gd_render_frame(gd_GIF * gif, uint8_t * buffer)
 {
@@ -759,6 +597,7 @@ void
 gd_rewind(gd_GIF * gif)
 {
     gif->loop_count = -1;
+    gif->frame_index = 0;
     f_gif_seek(gif, gif->anim_start, LV_FS_SEEK_SET);
 }
 
@@ -44,13 +44,23 @@ typedef struct _gd_GIF {
     void (*comment)(struct _gd_GIF * gif);
     void (*application)(struct _gd_GIF * gif, char id[8], char auth[3]);
     uint16_t fx, fy, fw, fh;
+    int32_t frame_index;
     uint8_t bgindex;
     uint8_t * canvas, * frame;
-#if LV_GIF_CACHE_DECODE_DATA
-    uint8_t *lzw_cache;
-#endif
+    /* LZW string table, every code is a run of earlier output in lzw_out */
+    uint32_t * lzw_offset;
+    uint16_t * lzw_length;
+    uint8_t * lzw_out;
 } gd_GIF;
 
+/* A frame decoded earlier, replayed without LZW decoding */
+typedef struct _gd_Frame {
+    uint16_t fx, fy, fw, fh;
+    gd_GCE gce;
+    const gd_Palette * lct;     /* NULL when the frame uses the global color table */
+    const uint8_t * indices;    /* fw * fh color indices */
+} gd_Frame;
+
 gd_GIF * gd_open_gif_file(const char * fname);
 
 gd_GIF * gd_open_gif_data(const void * data);
@@ -58,6 +68,7 @@ gd_GIF * gd_open_gif_data(const void * data);
 void gd_render_frame(gd_GIF * gif, uint8_t * buffer);
 
 int gd_get_frame(gd_GIF * gif);
+void gd_put_frame(gd_GIF * gif, const gd_Frame * frame);
 void gd_rewind(gd_GIF * gif);
 void gd_close_gif(gd_GIF * gif);
 
@@ -1,5 +1,6 @@
 #include "lvgl_gif.h"
 #include <esp_log.h>
+#include <esp_heap_caps.h>
 #include <cstring>
 
 #define TAG "LvglGif"
@@ -17,6 +18,15 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
         return;
     }
 
+    auto& cache = GifFrameCache::GetInstance();
+    if (cache.IsEnabled()) {
+        cache_key_ = GifFrameCache::MakeKey(img_dsc->data, img_dsc->data_size);
+        cached_ = cache.Lookup(cache_key_);
+        if (cached_ == nullptr) {
+            recording_ = std::make_shared<GifCacheEntry>();
+        }
+    }
+
     // Setup LVGL image descriptor
     memset(&img_dsc_, 0, sizeof(img_dsc_));
     img_dsc_.header.magic = LV_IMAGE_HEADER_MAGIC;
@@ -33,10 +43,43 @@ LvglGif::LvglGif(const lv_img_dsc_t* img_dsc)
         gd_render_frame(gif_, gif_->canvas);
     }
 
+    predecode_ = InitializePredecode();
+
     loaded_ = true;
     ESP_LOGD(TAG, "GIF loaded from image descriptor: %dx%d", gif_->width, gif_->height);
 }
 
+bool LvglGif::InitializePredecode() {
+    size_t frame_size = img_dsc_.data_size;
+    if (heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < frame_size * LVGL_GIF_PREDECODE_FRAMES * 2) {
+        return false;
+    }
+    for (int i = 0; i < LVGL_GIF_PREDECODE_FRAMES; i++) {
+        frames_[i].pixels = (uint8_t*)heap_caps_malloc(frame_size, MALLOC_CAP_SPIRAM);
+        if (frames_[i].pixels == nullptr) {
+            ESP_LOGW(TAG, "Failed to allocate frame ring, decoding on demand");
+            for (int j = 0; j < i; j++) {
+                heap_caps_free(frames_[j].pixels);
+                frames_[j].pixels = nullptr;
+            }
+            return false;
+        }
+    }
+    free_frames_ = xQueueCreate(LVGL_GIF_PREDECODE_FRAMES, sizeof(int));
+    ready_frames_ = xQueueCreate(LVGL_GIF_PREDECODE_FRAMES, sizeof(int));
+    decoder_done_ = xSemaphoreCreateBinary();
+
+    // The first frame of the ring shows the background until the decoder has the first image ready
+    memcpy(frames_[0].pixels, gif_->canvas, frame_size);
+    displayed_frame_ = 0;
+    displayed_delay_ms_ = 0;
+    img_dsc_.data = frames_[0].pixels;
+    for (int i = 1; i < LVGL_GIF_PREDECODE_FRAMES; i++) {
+        xQueueSend(free_frames_, &i, 0);
+    }
+    return true;
+}
+
 // Destructor
 LvglGif::~LvglGif() {
     Cleanup();
@@ -67,6 +110,9 @@ void LvglGif::Start() {
     if (timer_) {
         playing_ = true;
         last_call_ = lv_tick_get();
+        if (predecode_) {
+            StartDecoder();
+        }
         lv_timer_resume(timer_);
         lv_timer_reset(timer_);
         
@@ -93,6 +139,9 @@ void LvglGif::Resume() {
 
     if (timer_) {
         playing_ = true;
+        if (predecode_) {
+            StartDecoder();
+        }
         lv_timer_resume(timer_);
         ESP_LOGD(TAG, "GIF animation resumed");
     }
@@ -105,7 +154,14 @@ void LvglGif::Stop() {
     }
 
     if (gif_) {
+        // The decoder task owns gif_ while it runs
+        StopDecoder();
         gd_rewind(gif_);
+        cached_frame_ = 0;
+        if (recording_) {
+            // The frames so far no longer lead up to the next one
+            recording_ = std::make_shared<GifCacheEntry>();
+        }
         NextFrame();
         ESP_LOGD(TAG, "GIF animation stopped and rewound");
     }
@@ -157,6 +213,11 @@ void LvglGif::NextFrame() {
         return;
     }
 
+    if (predecode_) {
+        NextPredecodedFrame();
+        return;
+    }
+
     // Check if enough time has passed for the next frame
     uint32_t elapsed = lv_tick_elaps(last_call_);
     if (elapsed < gif_->gce.delay * 10) {
@@ -166,7 +227,7 @@ void LvglGif::NextFrame() {
     last_call_ = lv_tick_get();
 
     // Get next frame
-    int has_next = gd_get_frame(gif_);
+    int has_next = ReadFrame();
     if (has_next == 0) {
         // Animation finished, pause timer
         playing_ = false;
@@ -187,6 +248,146 @@ void LvglGif::NextFrame() {
     }
 }
 
+int LvglGif::ReadFrame() {
+    if (cached_) {
+        auto& frames = cached_->frames();
+        if (cached_frame_ == frames.size()) {
+            // End of a pass, with the loop count handling of the GIF trailer
+            cached_frame_ = 0;
+            gif_->frame_index = 0;
+            if (gif_->loop_count == 1 || gif_->loop_count < 0) {
+                return 0;
+            } else if (gif_->loop_count > 1) {
+                gif_->loop_count--;
+            }
+        }
+        if (cached_frame_ == 0 && gif_->loop_count < 0) {
+            gif_->loop_count = cached_->loop_count();
+        }
+        gd_put_frame(gif_, &frames[cached_frame_++]);
+        return 1;
+    }
+
+    int has_next = gd_get_frame(gif_);
+    if (recording_) {
+        RecordFrame(has_next);
+    }
+    return has_next;
+}
+
+void LvglGif::RecordFrame(int result) {
+    auto& cache = GifFrameCache::GetInstance();
+    // A pass is complete at the trailer, or when a looping GIF is back at its first frame
+    bool complete = result == 0 || (result == 1 && gif_->frame_index == 1);
+    if (complete && !recording_->frames().empty()) {
+        cache.Insert(cache_key_, std::move(recording_));
+        return;
+    }
+    if (result != 1) {
+        recording_.reset();
+        return;
+    }
+
+    size_t size = gif_->fw * gif_->fh + sizeof(gd_Palette);
+    if (recording_->bytes() + size > GIF_FRAME_CACHE_BUDGET || !cache.MakeRoom(size) || !recording_->AddFrame(gif_)) {
+        ESP_LOGD(TAG, "GIF does not fit in the frame cache");
+        recording_.reset();
+    }
+}
+
+void LvglGif::NextPredecodedFrame() {
+    if (lv_tick_elaps(last_call_) < displayed_delay_ms_) {
+        return;
+    }
+
+    // Not decoded yet, keep showing the current frame rather than blocking the UI task
+    int index;
+    if (xQueueReceive(ready_frames_, &index, 0) != pdTRUE) {
+        return;
+    }
+    last_call_ = lv_tick_get();
+
+    // LVGL draws the image from its data during rendering, so the old frame can be reused right away
+    xQueueSend(free_frames_, &displayed_frame_, 0);
+    displayed_frame_ = index;
+    displayed_delay_ms_ = frames_[index].delay_ms;
+    img_dsc_.data = frames_[index].pixels;
+
+    if (frames_[index].last) {
+        playing_ = false;
+        if (timer_) {
+            lv_timer_pause(timer_);
+        }
+        ESP_LOGD(TAG, "GIF animation completed");
+    }
+
+    if (frame_callback_) {
+        frame_callback_();
+    }
+}
+
+void LvglGif::StartDecoder() {
+    if (decoder_task_ != nullptr) {
+        if (uxSemaphoreGetCount(decoder_done_) == 0) {
+            return;
+        }
+        // The task stopped by itself after the last frame
+        StopDecoder();
+    }
+
+    decoder_running_ = true;
+    xTaskCreate([](void* arg) {
+        auto gif = static_cast<LvglGif*>(arg);
+        gif->DecoderTask();
+        vTaskDelete(NULL);
+    }, "gif_decoder", 4096, this, 2, &decoder_task_);
+}
+
+void LvglGif::StopDecoder() {
+    if (decoder_task_ == nullptr) {
+        return;
+    }
+
+    decoder_running_ = false;
+    // Wake the task if it waits for a free frame
+    int wake = -1;
+    xQueueSend(free_frames_, &wake, 0);
+    xSemaphoreTake(decoder_done_, portMAX_DELAY);
+    decoder_task_ = nullptr;
+
+    // Frames decoded ahead are dropped, the next run starts from the current gif_ position
+    xQueueReset(free_frames_);
+    xQueueReset(ready_frames_);
+    for (int i = 0; i < LVGL_GIF_PREDECODE_FRAMES; i++) {
+        if (i != displayed_frame_) {
+            xQueueSend(free_frames_, &i, 0);
+        }
+    }
+}
+
+void LvglGif::DecoderTask() {
+    while (decoder_running_) {
+        int index;
+        xQueueReceive(free_frames_, &index, portMAX_DELAY);
+        if (index < 0 || !decoder_running_) {
+            break;
+        }
+
+        auto& frame = frames_[index];
+        int has_next = ReadFrame();
+        gd_render_frame(gif_, gif_->canvas);
+        memcpy(frame.pixels, gif_->canvas, img_dsc_.data_size);
+        frame.delay_ms = gif_->gce.delay * 10;
+        // A decoding error ends the animation like the GIF trailer does
+        frame.last = has_next != 1;
+        xQueueSend(ready_frames_, &index, portMAX_DELAY);
+        if (frame.last) {
+            break;
+        }
+    }
+    xSemaphoreGive(decoder_done_);
+}
+
 void LvglGif::Cleanup() {
     // Stop and delete timer
     if (timer_) {
@@ -194,6 +395,30 @@ void LvglGif::Cleanup() {
         timer_ = nullptr;
     }
 
+    // Stop the decoder task before the GIF and the frames it uses go away
+    StopDecoder();
+    for (auto& frame : frames_) {
+        if (frame.pixels != nullptr) {
+            heap_caps_free(frame.pixels);
+            frame.pixels = nullptr;
+        }
+    }
+    if (free_frames_ != nullptr) {
+        vQueueDelete(free_frames_);
+        free_frames_ = nullptr;
+    }
+    if (ready_frames_ != nullptr) {
+        vQueueDelete(ready_frames_);
+        ready_frames_ = nullptr;
+    }
+    if (decoder_done_ != nullptr) {
+        vSemaphoreDelete(decoder_done_);
+        decoder_done_ = nullptr;
+    }
+    predecode_ = false;
+    cached_.reset();
+    recording_.reset();
+
     // Close GIF decoder
     if (gif_) {
         gd_close_gif(gif_);
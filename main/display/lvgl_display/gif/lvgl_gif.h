@@ -2,13 +2,26 @@
 
 #include "../lvgl_image.h"
 #include "gifdec.h"
+#include "gif_frame_cache.h"
 #include <lvgl.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
 #include <memory>
 #include <functional>
+#include <atomic>
+
+// Frames rendered ahead by the decoder task, plus the one on screen
+#define LVGL_GIF_PREDECODE_FRAMES 3
 
 /**
  * C++ implementation of LVGL GIF widget
  * Provides GIF animation functionality using gifdec library
+ *
+ * When the frames fit in PSRAM, a background task decodes and renders them ahead into a small
+ * ring, so the LVGL timer only swaps the image data. Otherwise frames are decoded on demand
+ * in the timer like before.
  */
 class LvglGif {
 public:
@@ -88,11 +101,53 @@ private:
     
     // Frame update callback
     std::function<void()> frame_callback_;
+
+    // Pre-decoded frames, owned by the decoder task until they are queued as ready
+    struct Frame {
+        uint8_t* pixels;
+        uint32_t delay_ms;
+        bool last;
+    };
+    Frame frames_[LVGL_GIF_PREDECODE_FRAMES] = {};
+    bool predecode_ = false;
+    int displayed_frame_ = 0;
+    uint32_t displayed_delay_ms_ = 0;
+    QueueHandle_t free_frames_ = nullptr;
+    QueueHandle_t ready_frames_ = nullptr;
+    TaskHandle_t decoder_task_ = nullptr;
+    SemaphoreHandle_t decoder_done_ = nullptr;
+    std::atomic<bool> decoder_running_ = false;
+
+    // Decoded frames shared with other instances of the same animation, or recorded for them
+    GifCacheKey cache_key_ = {};
+    std::shared_ptr<const GifCacheEntry> cached_;
+    size_t cached_frame_ = 0;
+    std::shared_ptr<GifCacheEntry> recording_;
     
     /**
      * Update to next frame
      */
     void NextFrame();
+
+    /**
+     * Show the next pre-decoded frame, if the decoder task has one ready
+     */
+    void NextPredecodedFrame();
+
+    /**
+     * Allocate the frame ring, returns false if there is not enough PSRAM
+     */
+    bool InitializePredecode();
+
+    /**
+     * Read the next frame into gif_, from the frame cache when possible, returns like gd_get_frame()
+     */
+    int ReadFrame();
+    void RecordFrame(int result);
+
+    void StartDecoder();
+    void StopDecoder();
+    void DecoderTask();
     
     /**
      * Cleanup resources
@@ -4,9 +4,19 @@
 #include <stddef.h>
 #include <string.h>
 #include <memory>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <system_error>
 #include <esp_attr.h>
 #include <esp_heap_caps.h>
 #include <esp_log.h>
+#include <esp_pthread.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 
 #include "jpeg_encoder.h"  // 使用新的JPEG编码器
 #include "image_to_jpeg.h"
@@ -14,6 +24,9 @@
 
 #define TAG "image_to_jpeg"
 
+// 并行编码时每个条带（restart interval）包含的 MCU 行数
+#define JPEG_STRIP_MCU_ROWS 2
+
 static void *_malloc(size_t size)
 {
     void * res = malloc(size);
@@ -140,17 +153,49 @@ public:
     }
 };
 
-// 使用优化的JPEG编码器进行图像转换，必须在堆上创建编码器
-static bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge2_simple::output_stream *dst_stream)
+// 条带输出缓冲，等待按顺序拼接
+class buffer_stream : public jpge2_simple::output_stream {
+public:
+    std::vector<uint8_t> data;
+
+    virtual ~buffer_stream() { }
+    virtual bool put_buf(const void* pBuf, int len)
+    {
+        if (pBuf && len > 0) {
+            data.insert(data.end(), static_cast<const uint8_t*>(pBuf), static_cast<const uint8_t*>(pBuf) + len);
+        }
+        return true;
+    }
+    virtual jpge2_simple::uint get_size() const
+    {
+        return static_cast<jpge2_simple::uint>(data.size());
+    }
+};
+
+// 编码器的输入通道数：RGB565 由编码器直接转换为 YCbCr，不再经过 RGB888 行缓冲
+static int get_encoder_channels(pixformat_t format)
 {
-    int num_channels = 3;
-    jpge2_simple::subsampling_t subsampling = jpge2_simple::H2V2;
+    if (format == PIXFORMAT_GRAYSCALE) {
+        return 1;
+    } else if (format == PIXFORMAT_RGB565) {
+        return 2;
+    }
+    return 3;
+}
 
-    if(format == PIXFORMAT_GRAYSCALE) {
-        num_channels = 1;
-        subsampling = jpge2_simple::Y_ONLY;
+static const uint8_t* get_scanline(uint8_t *src, pixformat_t format, uint8_t *line, size_t width, size_t y)
+{
+    if (format == PIXFORMAT_GRAYSCALE) {
+        return src + width * y;
+    } else if (format == PIXFORMAT_RGB565) {
+        return src + width * 2 * y;
     }
+    convert_line_format(src, format, line, width, 3, y);
+    return line;
+}
 
+static jpge2_simple::params get_params(pixformat_t format, uint8_t quality, bool rgb565_little_endian)
+{
     if(!quality) {
         quality = 1;
     } else if(quality > 100) {
@@ -158,8 +203,19 @@ static bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixform
     }
 
     jpge2_simple::params comp_params = jpge2_simple::params();
-    comp_params.m_subsampling = subsampling;
+    comp_params.m_subsampling = (format == PIXFORMAT_GRAYSCALE) ? jpge2_simple::Y_ONLY : jpge2_simple::H2V2;
     comp_params.m_quality = quality;
+    comp_params.m_rgb565_little_endian = rgb565_little_endian;
+    // 预览/上传用的快照，AAN 整数 DCT 的误差远低于量化误差
+    comp_params.m_fast_dct = true;
+    return comp_params;
+}
+
+// 使用优化的JPEG编码器进行图像转换，必须在堆上创建编码器
+static bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, bool rgb565_little_endian, jpge2_simple::output_stream *dst_stream)
+{
+    int num_channels = get_encoder_channels(format);
+    jpge2_simple::params comp_params = get_params(format, quality, rgb565_little_endian);
 
     // ⚠️ 关键：必须在堆上创建编码器！约8KB内存从堆分配
     auto dst_image = std::make_unique<jpge2_simple::jpeg_encoder>();
@@ -169,15 +225,14 @@ static bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixform
         return false;
     }
 
-    uint8_t* line = (uint8_t*)_malloc(width * num_channels);
+    uint8_t* line = (uint8_t*)_malloc(width * 3);
     if(!line) {
         ESP_LOGE(TAG, "Scan line malloc failed");
         return false;
     }
 
     for (int i = 0; i < height; i++) {
-        convert_line_format(src, format, line, width, num_channels, i);
-        if (!dst_image->process_scanline(line)) {
+        if (!dst_image->process_scanline(get_scanline(src, format, line, width, i))) {
             ESP_LOGE(TAG, "JPG process line %u failed", i);
             free(line);
             return false;
@@ -194,6 +249,167 @@ static bool convert_image(uint8_t *src, uint16_t width, uint16_t height, pixform
     return true;
 }
 
+#if CONFIG_SOC_CPU_CORES_NUM > 1
+// 并行编码的共享状态：两个核各自取下一个条带编码，调用者线程按顺序输出已完成的条带
+struct strip_job {
+    uint8_t *src;
+    pixformat_t format;
+    uint16_t width;
+    uint16_t height;
+    int num_channels;
+    jpge2_simple::params comp_params;
+    int strip_lines;
+    int strip_count;
+
+    std::vector<buffer_stream> strips;
+    std::vector<uint8_t> done;
+    std::atomic<int> next_strip{0};
+    int next_output = 0;
+    bool failed = false;
+    std::mutex mutex;
+    std::condition_variable cv;
+};
+
+// 输出已完成的连续条带，wait 为 true 时等待全部条带
+static bool output_strips(strip_job *job, jpge2_simple::jpeg_encoder *dst_image, bool wait)
+{
+    while (job->next_output < job->strip_count) {
+        {
+            std::unique_lock<std::mutex> lock(job->mutex);
+            if (!job->done[job->next_output]) {
+                if (!wait) {
+                    return true;
+                }
+                job->cv.wait(lock, [job]() { return job->done[job->next_output] != 0 || job->failed; });
+            }
+            if (job->failed) {
+                return false;
+            }
+        }
+
+        auto& strip = job->strips[job->next_output].data;
+        bool last = job->next_output == job->strip_count - 1;
+        if (!dst_image->put_restart_segment(strip.data(), strip.size(), last)) {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->failed = true;
+            return false;
+        }
+        std::vector<uint8_t>().swap(strip);
+        job->next_output++;
+    }
+    return true;
+}
+
+// 在两个核上运行，dst_image 不为空的是调用者线程，负责按顺序输出
+static void encode_strips(strip_job *job, jpge2_simple::jpeg_encoder *dst_image)
+{
+    auto encoder = std::make_unique<jpge2_simple::jpeg_encoder>();
+    uint8_t* line = (uint8_t*)_malloc(job->width * 3);
+    bool ok = line != nullptr && encoder->init_strips(job->width, job->height, job->num_channels, job->comp_params);
+
+    while (true) {
+        int strip = job->next_strip.fetch_add(1);
+        if (strip >= job->strip_count) {
+            break;
+        }
+
+        if (ok) {
+            encoder->begin_strip(&job->strips[strip]);
+            int first = strip * job->strip_lines;
+            int last = std::min<int>(first + job->strip_lines, job->height);
+            for (int i = first; i < last && ok; i++) {
+                ok = encoder->process_scanline(get_scanline(job->src, job->format, line, job->width, i));
+            }
+            ok = ok && encoder->process_scanline(NULL);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(job->mutex);
+            job->done[strip] = 1;
+            job->failed = job->failed || !ok;
+        }
+        job->cv.notify_all();
+
+        if (dst_image != nullptr && !output_strips(job, dst_image, false)) {
+            // 停止分配新的条带，另一个核完成当前条带后退出
+            job->next_strip = job->strip_count;
+            break;
+        }
+    }
+    free(line);
+}
+
+// 图像按 restart interval 切成条带，两个核并行完成颜色转换、DCT、量化和 Huffman 编码，
+// 输出用 RST 标记拼接，标准解码器解出的像素与顺序编码完全相同
+static bool convert_image_parallel(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, bool rgb565_little_endian, jpge2_simple::output_stream *dst_stream)
+{
+    strip_job job;
+    job.src = src;
+    job.format = format;
+    job.width = width;
+    job.height = height;
+    job.num_channels = get_encoder_channels(format);
+    job.comp_params = get_params(format, quality, rgb565_little_endian);
+
+    int mcu_size = (job.comp_params.m_subsampling == jpge2_simple::H2V2) ? 16 : 8;
+    int mcus_per_row = (width + mcu_size - 1) / mcu_size;
+    job.strip_lines = mcu_size * JPEG_STRIP_MCU_ROWS;
+    job.strip_count = (height + job.strip_lines - 1) / job.strip_lines;
+    if (job.strip_count < 2 || mcus_per_row * JPEG_STRIP_MCU_ROWS > 0xFFFF) {
+        return convert_image(src, width, height, format, quality, rgb565_little_endian, dst_stream);
+    }
+    job.strips.resize(job.strip_count);
+    job.done.resize(job.strip_count, 0);
+
+    auto dst_image = std::make_unique<jpge2_simple::jpeg_encoder>();
+    jpge2_simple::params header_params = job.comp_params;
+    header_params.m_restart_interval = mcus_per_row * JPEG_STRIP_MCU_ROWS;
+    if (!dst_image->init(dst_stream, width, height, job.num_channels, header_params)) {
+        ESP_LOGE(TAG, "JPG encoder init failed");
+        return false;
+    }
+
+    // 辅助线程固定在另一个核上，优先级与调用者相同
+    esp_pthread_cfg_t default_cfg = esp_pthread_get_default_config();
+    esp_pthread_cfg_t previous_cfg;
+    bool has_previous_cfg = esp_pthread_get_cfg(&previous_cfg) == ESP_OK;
+    esp_pthread_cfg_t cfg = default_cfg;
+    cfg.thread_name = "jpeg_strip";
+    cfg.stack_size = 4096;
+    cfg.prio = uxTaskPriorityGet(NULL);
+    cfg.pin_to_core = !xPortGetCoreID();
+    esp_pthread_set_cfg(&cfg);
+
+    std::thread helper;
+    try {
+        helper = std::thread(encode_strips, &job, nullptr);
+    } catch (const std::system_error& e) {
+        // 没有辅助线程时调用者线程独自编码所有条带
+        ESP_LOGW(TAG, "Failed to start JPG strip thread: %s", e.what());
+    }
+    esp_pthread_set_cfg(has_previous_cfg ? &previous_cfg : &default_cfg);
+
+    encode_strips(&job, dst_image.get());
+    bool ok = output_strips(&job, dst_image.get(), true);
+    if (helper.joinable()) {
+        helper.join();
+    }
+    if (!ok) {
+        ESP_LOGE(TAG, "JPG parallel encoding failed");
+    }
+    return ok;
+}
+#endif
+
+static bool encode_image(uint8_t *src, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpge2_simple::output_stream *dst_stream, bool rgb565_little_endian = false)
+{
+#if CONFIG_SOC_CPU_CORES_NUM > 1
+    return convert_image_parallel(src, width, height, format, quality, rgb565_little_endian, dst_stream);
+#else
+    return convert_image(src, width, height, format, quality, rgb565_little_endian, dst_stream);
+#endif
+}
+
 // 🚀 主要函数：高效的图像到JPEG转换实现，节省8KB SRAM
 bool image_to_jpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, uint8_t ** out, size_t * out_len)
 {
@@ -209,7 +425,7 @@ bool image_to_jpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height
     }
     memory_stream dst_stream(jpg_buf, jpg_buf_len);
 
-    if(!convert_image(src, width, height, format, quality, &dst_stream)) {
+    if(!encode_image(src, width, height, format, quality, &dst_stream)) {
         free(jpg_buf);
         return false;
     }
@@ -223,6 +439,12 @@ bool image_to_jpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height
 bool image_to_jpeg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, pixformat_t format, uint8_t quality, jpg_out_cb cb, void *arg)
 {
     callback_stream dst_stream(cb, arg);
-    return convert_image(src, width, height, format, quality, &dst_stream);
+    return encode_image(src, width, height, format, quality, &dst_stream);
 }
 
+// 小端 RGB565 由编码器直接读取，不需要先对整幅图像交换字节
+bool rgb565le_to_jpeg_cb(uint8_t *src, uint16_t width, uint16_t height, uint8_t quality, jpg_out_cb cb, void *arg)
+{
+    callback_stream dst_stream(cb, arg);
+    return encode_image(src, width, height, PIXFORMAT_RGB565, quality, &dst_stream, true);
+}
@@ -61,6 +61,22 @@ bool image_to_jpeg(uint8_t *src, size_t src_len, uint16_t width, uint16_t height
 bool image_to_jpeg_cb(uint8_t *src, size_t src_len, uint16_t width, uint16_t height, 
                       pixformat_t format, uint8_t quality, jpg_out_cb cb, void *arg);
 
+/**
+ * @brief 将小端 RGB565 图像（LVGL 绘制缓冲的格式）转换为JPEG（回调版本）
+ * 
+ * 编码器直接读取小端像素，调用者不需要先对整幅图像交换字节
+ * 
+ * @param src       源图像数据
+ * @param width     图像宽度
+ * @param height    图像高度
+ * @param quality   JPEG质量 (1-100)
+ * @param cb        输出回调函数
+ * @param arg       传递给回调函数的用户参数
+ * 
+ * @return true 成功, false 失败
+ */
+bool rgb565le_to_jpeg_cb(uint8_t *src, uint16_t width, uint16_t height, uint8_t quality, jpg_out_cb cb, void *arg);
+
 #ifdef __cplusplus
 }
 #endif
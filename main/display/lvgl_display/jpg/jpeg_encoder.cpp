@@ -34,7 +34,7 @@ namespace jpge2_simple {
     static inline void jpge_free(void *p) { free(p); }
 
     // Various JPEG enums and tables.
-    enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_APP0 = 0xE0 };
+    enum { M_SOF0 = 0xC0, M_DHT = 0xC4, M_RST0 = 0xD0, M_SOI = 0xD8, M_EOI = 0xD9, M_SOS = 0xDA, M_DQT = 0xDB, M_DRI = 0xDD, M_APP0 = 0xE0 };
     enum { DC_LUM_CODES = 12, AC_LUM_CODES = 256, DC_CHROMA_CODES = 12, AC_CHROMA_CODES = 256, MAX_HUFF_SYMBOLS = 257, MAX_HUFF_CODESIZE = 32 };
 
     static const uint8 s_zag[64] = { 0,1,8,16,9,2,3,10,17,24,32,25,18,11,4,5,12,19,26,33,40,48,41,34,27,20,13,6,7,14,21,28,35,42,49,56,57,50,43,36,29,22,15,23,30,37,44,51,58,59,52,45,38,31,39,46,53,60,61,54,47,55,62,63 };
@@ -89,6 +89,29 @@ namespace jpge2_simple {
         }
     }
 
+    // RGB565 直接转换，与先展开为 RGB888（低位补 0）再转换的结果逐位一致。
+    // RGB565 的分量最大为 248/252，Cb/Cr 不会越界，因此不需要 clamp，循环里没有分支
+    // HIGH_BYTE 为高字节在像素内的偏移：大端为 0，小端为 1
+    template <int HIGH_BYTE>
+    static void RGB565_to_YCC(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for (int i = 0; i < num_pixels; i++) {
+            const int hi = pSrc[i * 2 + HIGH_BYTE], lo = pSrc[i * 2 + 1 - HIGH_BYTE];
+            const int r = hi & 0xF8, g = ((hi & 0x07) << 5) | ((lo & 0xE0) >> 3), b = (lo & 0x1F) << 3;
+            pDst[i * 3 + 0] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+            pDst[i * 3 + 1] = static_cast<uint8>(128 + ((r * CB_R + g * CB_G + b * CB_B + 32768) >> 16));
+            pDst[i * 3 + 2] = static_cast<uint8>(128 + ((r * CR_R + g * CR_G + b * CR_B + 32768) >> 16));
+        }
+    }
+
+    template <int HIGH_BYTE>
+    static void RGB565_to_Y(uint8* pDst, const uint8 *pSrc, int num_pixels) {
+        for (int i = 0; i < num_pixels; i++) {
+            const int hi = pSrc[i * 2 + HIGH_BYTE], lo = pSrc[i * 2 + 1 - HIGH_BYTE];
+            const int r = hi & 0xF8, g = ((hi & 0x07) << 5) | ((lo & 0xE0) >> 3), b = (lo & 0x1F) << 3;
+            pDst[i] = static_cast<uint8>((r * YR + g * YG + b * YB + 32768) >> 16);
+        }
+    }
+
     static void Y_to_YCC(uint8* pDst, const uint8* pSrc, int num_pixels) {
         for( ; num_pixels; pDst += 3, pSrc++, num_pixels--) {
             pDst[0] = pSrc[0];
@@ -133,6 +156,40 @@ namespace jpge2_simple {
         }
     }
 
+    // Forward DCT - AAN (Arai, Agui, Nakajima) fixed point butterfly, derived from jfdctfst.
+    // 每个一维变换只有 5 次乘法，常数为 8 位，所有中间结果都在 int16 范围内，行和列都可以按 8 路并行。
+    // 输出是按 s(u) * s(v) * 8 缩放的系数，缩放并入量化表（m_quantization_aan_recip）。
+    enum { AAN_CONST_BITS = 8 };
+#define AAN_MUL(var, c) (((var) * static_cast<int32>(c) + (1 << (AAN_CONST_BITS - 1))) >> AAN_CONST_BITS)
+#define AAN1D(s0, s1, s2, s3, s4, s5, s6, s7) \
+    int32 t0 = s0 + s7, t7 = s0 - s7, t1 = s1 + s6, t6 = s1 - s6, t2 = s2 + s5, t5 = s2 - s5, t3 = s3 + s4, t4 = s3 - s4; \
+    int32 t10 = t0 + t3, t13 = t0 - t3, t11 = t1 + t2, t12 = t1 - t2; \
+    s0 = t10 + t11; s4 = t10 - t11; \
+    int32 z1 = AAN_MUL(t12 + t13, 181); \
+    s2 = t13 + z1; s6 = t13 - z1; \
+    t10 = t4 + t5; t11 = t5 + t6; t12 = t6 + t7; \
+    int32 z5 = AAN_MUL(t10 - t12, 98); \
+    int32 z2 = AAN_MUL(t10, 139) + z5, z4 = AAN_MUL(t12, 334) + z5, z3 = AAN_MUL(t11, 181); \
+    int32 z11 = t7 + z3, z13 = t7 - z3; \
+    s5 = z13 + z2; s3 = z13 - z2; s1 = z11 + z4; s7 = z11 - z4;
+
+    static void DCT2D_AAN(int32 *p) {
+        int32 c, *q = p;
+        for (c = 7; c >= 0; c--, q += 8) {
+            int32 s0 = q[0], s1 = q[1], s2 = q[2], s3 = q[3], s4 = q[4], s5 = q[5], s6 = q[6], s7 = q[7];
+            AAN1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0] = s0; q[1] = s1; q[2] = s2; q[3] = s3; q[4] = s4; q[5] = s5; q[6] = s6; q[7] = s7;
+        }
+        for (q = p, c = 7; c >= 0; c--, q++) {
+            int32 s0 = q[0*8], s1 = q[1*8], s2 = q[2*8], s3 = q[3*8], s4 = q[4*8], s5 = q[5*8], s6 = q[6*8], s7 = q[7*8];
+            AAN1D(s0, s1, s2, s3, s4, s5, s6, s7);
+            q[0*8] = s0; q[1*8] = s1; q[2*8] = s2; q[3*8] = s3; q[4*8] = s4; q[5*8] = s5; q[6*8] = s6; q[7*8] = s7;
+        }
+    }
+
+    // s(0) = 1, s(k) = cos(k * pi / 16) * sqrt(2)
+    static const double s_aan_scale[8] = { 1.0, 1.387039845, 1.306562965, 1.175875602, 1.0, 0.785694958, 0.541196100, 0.275899379 };
+
     // Compute the actual canonical Huffman codes/code sizes given the JPEG huff bits and val arrays.
     // 简化版本：直接使用成员变量，不需要动态分配
     void jpeg_encoder::compute_huffman_table(uint *codes, uint8 *code_sizes, uint8 *bits, uint8 *val)
@@ -308,6 +365,37 @@ namespace jpge2_simple {
         emit_byte(0);
     }
 
+    // Emit restart interval
+    void jpeg_encoder::emit_dri()
+    {
+        emit_marker(M_DRI);
+        emit_word(4);
+        emit_word(m_params.m_restart_interval);
+    }
+
+    // 补齐当前字节后写入 RSTn，DC 预测从 0 重新开始
+    void jpeg_encoder::emit_restart()
+    {
+        put_bits(0x7F, 7);
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+        emit_marker(M_RST0 + m_restart_index);
+        m_restart_index = (m_restart_index + 1) & 7;
+        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+    }
+
+    void jpeg_encoder::begin_mcu()
+    {
+        if (m_params.m_restart_interval == 0) {
+            return;
+        }
+        if (m_mcus_until_restart == 0) {
+            emit_restart();
+            m_mcus_until_restart = m_params.m_restart_interval;
+        }
+        m_mcus_until_restart--;
+    }
+
     void jpeg_encoder::load_block_8_8_grey(int x)
     {
         uint8 *pSrc;
@@ -368,28 +456,34 @@ namespace jpge2_simple {
         }
     }
 
+    // 四舍五入的 |x| / q，用倒数乘法和符号掩码实现，没有除法和分支
     void jpeg_encoder::load_quantized_coefficients(int component_num)
     {
-        int32 *q = m_quantization_tables[component_num > 0];
+        const int32 *q = m_quantization_tables[component_num > 0];
+        const uint32 *recip = m_quantization_recip[component_num > 0];
         int16 *pDst = m_coefficient_array;
         for (int i = 0; i < 64; i++)
         {
             sample_array_t j = m_sample_array[s_zag[i]];
-            if (j < 0)
-            {
-                if ((j = -j + (*q >> 1)) < *q)
-                    *pDst++ = 0;
-                else
-                    *pDst++ = static_cast<int16>(-(j / *q));
-            }
-            else
-            {
-                if ((j = j + (*q >> 1)) < *q)
-                    *pDst++ = 0;
-                else
-                    *pDst++ = static_cast<int16>((j / *q));
-            }
-            q++;
+            int32 sign = j >> 31;
+            uint32 magnitude = static_cast<uint32>((j ^ sign) - sign) + (q[i] >> 1);
+            int32 quotient = static_cast<int32>((static_cast<uint64_t>(magnitude) * recip[i]) >> 31);
+            pDst[i] = static_cast<int16>((quotient ^ sign) - sign);
+        }
+    }
+
+    // 四舍五入的 |x| / (q * s(u) * s(v) * 8)，AAN DCT 的输出最大约 2^15，乘积不超过 64 位
+    void jpeg_encoder::load_quantized_coefficients_aan(int component_num)
+    {
+        const uint32 *recip = m_quantization_aan_recip[component_num > 0];
+        int16 *pDst = m_coefficient_array;
+        for (int i = 0; i < 64; i++)
+        {
+            sample_array_t j = m_sample_array[s_zag[i]];
+            int32 sign = j >> 31;
+            uint32 magnitude = static_cast<uint32>((j ^ sign) - sign);
+            int32 quotient = static_cast<int32>((static_cast<uint64_t>(magnitude) * recip[i] + (1U << 30)) >> 31);
+            pDst[i] = static_cast<int16>((quotient ^ sign) - sign);
         }
     }
 
@@ -459,8 +553,13 @@ namespace jpge2_simple {
 
     void jpeg_encoder::code_block(int component_num)
     {
-        DCT2D(m_sample_array);
-        load_quantized_coefficients(component_num);
+        if (m_params.m_fast_dct) {
+            DCT2D_AAN(m_sample_array);
+            load_quantized_coefficients_aan(component_num);
+        } else {
+            DCT2D(m_sample_array);
+            load_quantized_coefficients(component_num);
+        }
         code_coefficients_pass_two(component_num);
     }
 
@@ -470,6 +569,7 @@ namespace jpge2_simple {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                begin_mcu();
                 load_block_8_8_grey(i); code_block(0);
             }
         }
@@ -477,6 +577,7 @@ namespace jpge2_simple {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                begin_mcu();
                 load_block_8_8(i, 0, 0); code_block(0); load_block_8_8(i, 0, 1); code_block(1); load_block_8_8(i, 0, 2); code_block(2);
             }
         }
@@ -484,6 +585,7 @@ namespace jpge2_simple {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                begin_mcu();
                 load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
                 load_block_16_8_8(i, 1); code_block(1); load_block_16_8_8(i, 2); code_block(2);
             }
@@ -492,6 +594,7 @@ namespace jpge2_simple {
         {
             for (int i = 0; i < m_mcus_per_row; i++)
             {
+                begin_mcu();
                 load_block_8_8(i * 2 + 0, 0, 0); code_block(0); load_block_8_8(i * 2 + 1, 0, 0); code_block(0);
                 load_block_8_8(i * 2 + 0, 1, 0); code_block(0); load_block_8_8(i * 2 + 1, 1, 0); code_block(0);
                 load_block_16_8(i, 1); code_block(1); load_block_16_8(i, 2); code_block(2);
@@ -508,11 +611,15 @@ namespace jpge2_simple {
         if (m_num_components == 1) {
             if (m_image_bpp == 3)
                 RGB_to_Y(pDst, Psrc, m_image_x);
+            else if (m_image_bpp == 2)
+                m_params.m_rgb565_little_endian ? RGB565_to_Y<1>(pDst, Psrc, m_image_x) : RGB565_to_Y<0>(pDst, Psrc, m_image_x);
             else
                 memcpy(pDst, Psrc, m_image_x);
         } else {
             if (m_image_bpp == 3)
                 RGB_to_YCC(pDst, Psrc, m_image_x);
+            else if (m_image_bpp == 2)
+                m_params.m_rgb565_little_endian ? RGB565_to_YCC<1>(pDst, Psrc, m_image_x) : RGB565_to_YCC<0>(pDst, Psrc, m_image_x);
             else
                 Y_to_YCC(pDst, Psrc, m_image_x);
         }
@@ -538,7 +645,7 @@ namespace jpge2_simple {
     }
 
     // Quantization table generation.
-    void jpeg_encoder::compute_quant_table(int32 *pDst, const int16 *pSrc)
+    void jpeg_encoder::compute_quant_table(int32 *pDst, uint32 *pRecip, uint32 *pAanRecip, const int16 *pSrc)
     {
         int32 q;
         if (m_params.m_quality < 50)
@@ -548,7 +655,14 @@ namespace jpge2_simple {
         for (int i = 0; i < 64; i++)
         {
             int32 j = *pSrc++; j = (j * q + 50L) / 100L;
-            *pDst++ = JPGE_MIN(JPGE_MAX(j, 1), 255);
+            j = JPGE_MIN(JPGE_MAX(j, 1), 255);
+            *pDst++ = j;
+            // floor(x * recip / 2^31) == floor(x / j) for every x < 2^31 / 255, far above the DCT range
+            *pRecip++ = static_cast<uint32>((1UL << 31) / j + 1);
+            // 最小的除数 1 * s(7) * s(7) * 8 约为 0.61，倒数仍在 32 位以内
+            int k = s_zag[i];
+            double divisor = j * s_aan_scale[k >> 3] * s_aan_scale[k & 7] * 8.0;
+            *pAanRecip++ = static_cast<uint32>(2147483648.0 / divisor + 0.5);
         }
     }
 
@@ -607,8 +721,8 @@ namespace jpge2_simple {
 
         if(m_last_quality != m_params.m_quality){
             m_last_quality = m_params.m_quality;
-            compute_quant_table(m_quantization_tables[0], s_std_lum_quant);
-            compute_quant_table(m_quantization_tables[1], s_std_croma_quant);
+            compute_quant_table(m_quantization_tables[0], m_quantization_recip[0], m_quantization_aan_recip[0], s_std_lum_quant);
+            compute_quant_table(m_quantization_tables[1], m_quantization_recip[1], m_quantization_aan_recip[1], s_std_croma_quant);
         }
 
         if(!m_huff_initialized){
@@ -625,13 +739,10 @@ namespace jpge2_simple {
             compute_huffman_table(m_huff_codes[2+1], m_huff_code_sizes[2+1], m_huff_bits[2+1], m_huff_val[2+1]);
         }
 
-        m_out_buf_left = JPGE_OUT_BUF_SIZE;
-        m_pOut_buf = m_out_buf;
-        m_bit_buffer = 0;
-        m_bits_in = 0;
-        m_mcu_y_ofs = 0;
-        m_pass_num = 2;
-        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+        begin_scan();
+        if (m_strip_mode) {
+            return true;
+        }
 
         // Emit all markers at beginning of image file.
         emit_marker(M_SOI);
@@ -639,11 +750,27 @@ namespace jpge2_simple {
         emit_dqt();
         emit_sof();
         emit_dhts();
+        if (m_params.m_restart_interval) {
+            emit_dri();
+        }
         emit_sos();
 
         return m_all_stream_writes_succeeded;
     }
 
+    void jpeg_encoder::begin_scan()
+    {
+        m_out_buf_left = JPGE_OUT_BUF_SIZE;
+        m_pOut_buf = m_out_buf;
+        m_bit_buffer = 0;
+        m_bits_in = 0;
+        m_mcu_y_ofs = 0;
+        m_pass_num = 2;
+        m_mcus_until_restart = m_params.m_restart_interval;
+        m_restart_index = 0;
+        memset(m_last_dc_val, 0, 3 * sizeof(m_last_dc_val[0]));
+    }
+
     bool jpeg_encoder::process_end_of_image()
     {
         if (m_mcu_y_ofs) {
@@ -656,6 +783,12 @@ namespace jpge2_simple {
         }
 
         put_bits(0x7F, 7);
+        if (m_strip_mode) {
+            // 条带只包含熵编码数据，标记由拼接的编码器写入
+            flush_output_buffer();
+            m_pass_num++;
+            return true;
+        }
         emit_marker(M_EOI);
         flush_output_buffer();
         m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
@@ -668,6 +801,7 @@ namespace jpge2_simple {
         m_mcu_lines[0] = NULL;
         m_pass_num = 0;
         m_all_stream_writes_succeeded = true;
+        m_strip_mode = false;
         
         // 简单版本：成员变量自动初始化，不需要额外处理
         m_last_quality = 0;
@@ -687,7 +821,7 @@ namespace jpge2_simple {
     bool jpeg_encoder::init(output_stream *pStream, int width, int height, int src_channels, const params &comp_params)
     {
         deinit();
-        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels != 1) && (src_channels != 3) && (src_channels != 4)) || (!comp_params.check())) return false;
+        if (((!pStream) || (width < 1) || (height < 1)) || ((src_channels < 1) || (src_channels > 4)) || (!comp_params.check())) return false;
         
         // 简单版本：不需要动态分配内存，成员变量已经存在
         m_pStream = pStream;
@@ -695,6 +829,46 @@ namespace jpge2_simple {
         return jpg_open(width, height, src_channels);
     }
 
+    bool jpeg_encoder::init_strips(int width, int height, int src_channels, const params &comp_params)
+    {
+        deinit();
+        if (((width < 1) || (height < 1)) || ((src_channels < 1) || (src_channels > 4)) || (!comp_params.check())) return false;
+
+        m_pStream = NULL;
+        m_params = comp_params;
+        m_params.m_restart_interval = 0;  // 条带之间的 RST 由拼接的编码器写入
+        m_strip_mode = true;
+        return jpg_open(width, height, src_channels);
+    }
+
+    void jpeg_encoder::begin_strip(output_stream *pStream)
+    {
+        m_pStream = pStream;
+        m_all_stream_writes_succeeded = true;
+        begin_scan();
+    }
+
+    bool jpeg_encoder::put_restart_segment(const void* pData, int len, bool last)
+    {
+        if ((m_pass_num != 2) || m_strip_mode || (m_params.m_restart_interval == 0)) {
+            return false;
+        }
+        flush_output_buffer();
+        if (len > 0) {
+            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(pData, len);
+        }
+        if (last) {
+            emit_marker(M_EOI);
+            flush_output_buffer();
+            m_all_stream_writes_succeeded = m_all_stream_writes_succeeded && m_pStream->put_buf(NULL, 0);
+            m_pass_num++;
+        } else {
+            emit_marker(M_RST0 + m_restart_index);
+            m_restart_index = (m_restart_index + 1) & 7;
+        }
+        return m_all_stream_writes_succeeded;
+    }
+
     void jpeg_encoder::deinit()
     {
         jpge_free(m_mcu_lines[0]);
@@ -16,14 +16,21 @@ namespace jpge2_simple
     enum subsampling_t { Y_ONLY = 0, H1V1 = 1, H2V1 = 2, H2V2 = 3 };
 
     struct params {
-        inline params() : m_quality(85), m_subsampling(H2V2) { }
+        inline params() : m_quality(85), m_subsampling(H2V2), m_restart_interval(0), m_rgb565_little_endian(false), m_fast_dct(false) { }
         inline bool check() const {
             if ((m_quality < 1) || (m_quality > 100)) return false;
             if ((uint)m_subsampling > (uint)H2V2) return false;
+            if ((m_restart_interval < 0) || (m_restart_interval > 0xFFFF)) return false;
             return true;
         }
         int m_quality;
         subsampling_t m_subsampling;
+        // 每隔多少个 MCU 插入一个 RST 标记，0 表示不使用
+        int m_restart_interval;
+        // RGB565 输入的字节序，摄像头输出为大端，LVGL 绘制缓冲为小端
+        bool m_rgb565_little_endian;
+        // 使用 AAN 整数 DCT（中间结果在 16 位以内，便于 SIMD），比默认的 jfdctint 快，系数略有误差
+        bool m_fast_dct;
     };
     
     class output_stream {
@@ -35,6 +42,12 @@ namespace jpge2_simple
     
     // 简单版本：直接在类中声明数组
     // 警告：必须在堆上创建实例！（使用 new）
+    //
+    // src_channels: 1 灰度，2 RGB565（大端，高字节在前），3 RGB888
+    //
+    // 条带模式用于并行编码：图像按 restart interval 切成条带，每个条带由 init_strips() 初始化的
+    // 编码器独立编码（不输出文件头，结尾按字节对齐），再由 init() 输出文件头的编码器通过
+    // put_restart_segment() 按顺序拼接并插入 RST 标记，结果与顺序编码解码出的像素完全相同。
     class jpeg_encoder {
         public:
             jpeg_encoder();
@@ -44,6 +57,12 @@ namespace jpge2_simple
             bool process_scanline(const void* pScanline);
             void deinit();
 
+            // 条带模式：只生成熵编码数据，process_scanline(NULL) 结束当前条带
+            bool init_strips(int width, int height, int src_channels, const params &comp_params = params());
+            void begin_strip(output_stream *pStream);
+            // 输出一个条带的数据，之后写入 RST 标记，最后一个条带之后写入 EOI
+            bool put_restart_segment(const void* pData, int len, bool last);
+
         private:
             jpeg_encoder(const jpeg_encoder &);
             jpeg_encoder &operator =(const jpeg_encoder &);
@@ -73,10 +92,15 @@ namespace jpge2_simple
             uint m_bits_in;
             uint8 m_pass_num;
             bool m_all_stream_writes_succeeded;
+            bool m_strip_mode;
+            int m_mcus_until_restart;
+            uint8 m_restart_index;
 
             // 直接声明为类成员变量（约8KB）
             int32 m_last_quality;
             int32 m_quantization_tables[2][64];      // 512 bytes
+            uint32 m_quantization_recip[2][64];      // 512 bytes, 2^31 / q 向上取整，量化时用乘法代替除法
+            uint32 m_quantization_aan_recip[2][64];  // 512 bytes, AAN DCT 的比例因子并入量化：2^31 / (q * s(u) * s(v) * 8)
             bool m_huff_initialized;
             uint m_huff_codes[4][256];               // 4096 bytes
             uint8 m_huff_code_sizes[4][256];         // 1024 bytes  
@@ -99,8 +123,13 @@ namespace jpge2_simple
             void emit_dht(uint8 *bits, uint8 *val, int index, bool ac_flag);
             void emit_dhts();
             void emit_sos();
-            void compute_quant_table(int32 *dst, const int16 *src);
+            void emit_dri();
+            void emit_restart();
+            void begin_scan();
+            void begin_mcu();
+            void compute_quant_table(int32 *dst, uint32 *recip, uint32 *aan_recip, const int16 *src);
             void load_quantized_coefficients(int component_num);
+            void load_quantized_coefficients_aan(int component_num);
             void load_block_8_8_grey(int x);
             void load_block_8_8(int x, int y, int c);
             void load_block_16_8(int x, int c);
@@ -12,6 +12,10 @@
 #include "settings.h"
 #include "assets/lang_config.h"
 #include "jpg/image_to_jpeg.h"
+#include "lvgl_preview_buffer.h"
+
+#include <esp_heap_caps.h>
+#include <algorithm>
 
 #define TAG "Display"
 
@@ -205,6 +209,34 @@ void LvglDisplay::UpdateStatusBar(bool update_all) {
 void LvglDisplay::SetPreviewImage(std::unique_ptr<LvglImage> image) {
 }
 
+bool LvglDisplay::ShowPreviewFrame(const uint8_t* frame, int width, int height, bool live) {
+    if (live || width <= 0 || height <= 0) {
+        return false;
+    }
+
+    // Fit the screen, the preview never needs more pixels than the display has
+    int preview_width = std::min(width, width_);
+    int preview_height = height * preview_width / width;
+    if (preview_height > height_) {
+        preview_height = height_;
+        preview_width = width * preview_height / height;
+    }
+    if (preview_width <= 0 || preview_height <= 0) {
+        return false;
+    }
+
+    size_t size = (size_t)preview_width * preview_height * sizeof(uint16_t);
+    auto data = (uint16_t*)heap_caps_malloc(size, MALLOC_CAP_SPIRAM);
+    if (data == nullptr) {
+        ESP_LOGE(TAG, "Failed to allocate memory for preview image");
+        return false;
+    }
+    LvglPreviewBuffer::ScaleSwap(frame, width, height, data, preview_width, preview_height);
+    SetPreviewImage(std::make_unique<LvglAllocatedImage>(data, size, preview_width, preview_height,
+        preview_width * sizeof(uint16_t), LV_COLOR_FORMAT_RGB565));
+    return true;
+}
+
 void LvglDisplay::SetPowerSaveMode(bool on) {
     if (on) {
         SetChatMessage("system", "");
@@ -226,18 +258,11 @@ bool LvglDisplay::SnapshotToJpeg(std::string& jpeg_data, int quality) {
         return false;
     }
 
-    // swap bytes
-    uint16_t* data = (uint16_t*)draw_buffer->data;
-    size_t pixel_count = draw_buffer->data_size / 2;
-    for (size_t i = 0; i < pixel_count; i++) {
-        data[i] = __builtin_bswap16(data[i]);
-    }
-
     // 清空输出字符串并使用回调版本，避免预分配大内存块
     jpeg_data.clear();
 
-    // 🚀 使用回调版本的JPEG编码器，进一步节省内存
-    bool ret = image_to_jpeg_cb(draw_buffer->data, draw_buffer->data_size, draw_buffer->header.w, draw_buffer->header.h, PIXFORMAT_RGB565, quality,
+    // 🚀 使用回调版本的JPEG编码器，编码器直接读取小端 RGB565，不需要先交换字节
+    bool ret = rgb565le_to_jpeg_cb(draw_buffer->data, draw_buffer->header.w, draw_buffer->header.h, quality,
         [](void *arg, size_t index, const void *data, size_t len) -> size_t {
         std::string* output = static_cast<std::string*>(arg);
         if (data && len > 0) {
@@ -21,6 +21,9 @@ public:
     virtual void ShowNotification(const char* notification, int duration_ms = 3000);
     virtual void ShowNotification(const std::string &notification, int duration_ms = 3000);
     virtual void SetPreviewImage(std::unique_ptr<LvglImage> image);
+    // Shows a big-endian RGB565 camera frame downscaled to the preview size, without a full-frame copy.
+    // Live frames need a display that keeps a preview double buffer, returns false otherwise.
+    virtual bool ShowPreviewFrame(const uint8_t* frame, int width, int height, bool live = false);
     virtual void UpdateStatusBar(bool update_all = false);
     virtual void SetPowerSaveMode(bool on);
     virtual bool SnapshotToJpeg(std::string& jpeg_data, int quality = 80);
@@ -0,0 +1,91 @@
+#include "lvgl_preview_buffer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <cstring>
+
+#define TAG "LvglPreviewBuffer"
+
+LvglPreviewBuffer::~LvglPreviewBuffer() {
+    for (auto buffer : buffers_) {
+        if (buffer != nullptr) {
+            heap_caps_free(buffer);
+        }
+    }
+}
+
+const lv_img_dsc_t* LvglPreviewBuffer::Render(const uint8_t* frame, int frame_width, int frame_height, int width, int height) {
+    if (frame == nullptr || width <= 0 || height <= 0 || width > frame_width || height > frame_height) {
+        return nullptr;
+    }
+
+    size_t pixels = (size_t)width * height;
+    if (pixels > capacity_) {
+        // Grows once to the preview size and is reused for every following frame
+        for (auto& buffer : buffers_) {
+            if (buffer != nullptr) {
+                heap_caps_free(buffer);
+            }
+            buffer = (uint16_t*)heap_caps_malloc(pixels * sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+        }
+        if (buffers_[0] == nullptr || buffers_[1] == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate preview buffers for %dx%d", width, height);
+            capacity_ = 0;
+            return nullptr;
+        }
+        capacity_ = pixels;
+    }
+
+    uint16_t* dst = buffers_[back_];
+    ScaleSwap(frame, frame_width, frame_height, dst, width, height);
+
+    auto& dsc = image_dscs_[back_];
+    memset(&dsc, 0, sizeof(dsc));
+    dsc.header.magic = LV_IMAGE_HEADER_MAGIC;
+    dsc.header.cf = LV_COLOR_FORMAT_RGB565;
+    dsc.header.w = width;
+    dsc.header.h = height;
+    dsc.header.stride = width * sizeof(uint16_t);
+    dsc.data_size = pixels * sizeof(uint16_t);
+    dsc.data = (const uint8_t*)dst;
+    back_ ^= 1;
+    return &dsc;
+}
+
+static inline uint32_t SwapPixelPair(uint32_t pair) {
+    return ((pair & 0x00FF00FF) << 8) | ((pair >> 8) & 0x00FF00FF);
+}
+
+void LvglPreviewBuffer::ScaleSwap(const uint8_t* frame, int frame_width, int frame_height, uint16_t* dst, int width, int height) {
+    // 16.16 fixed point steps between the source rows and columns
+    uint32_t x_step = ((uint32_t)frame_width << 16) / width;
+    uint32_t y_step = ((uint32_t)frame_height << 16) / height;
+    bool word_aligned = ((uintptr_t)frame & 3) == 0 && ((uintptr_t)dst & 3) == 0 && (frame_width & 1) == 0 && (width & 1) == 0;
+
+    for (int y = 0; y < height; y++) {
+        const uint16_t* src_row = (const uint16_t*)frame + (size_t)((y * y_step) >> 16) * frame_width;
+        uint16_t* dst_row = dst + (size_t)y * width;
+
+        if (word_aligned && x_step == (1u << 16)) {
+            // Same width, swap two pixels per 32-bit word
+            auto src32 = (const uint32_t*)src_row;
+            auto dst32 = (uint32_t*)dst_row;
+            for (int x = 0; x < width / 2; x++) {
+                dst32[x] = SwapPixelPair(src32[x]);
+            }
+        } else if (word_aligned && x_step == (2u << 16)) {
+            // Half width, keep the first pixel of every 32-bit word
+            auto src32 = (const uint32_t*)src_row;
+            auto dst32 = (uint32_t*)dst_row;
+            for (int x = 0; x < width / 2; x++) {
+                uint32_t pair = (src32[2 * x] & 0xFFFF) | (src32[2 * x + 1] << 16);
+                dst32[x] = SwapPixelPair(pair);
+            }
+        } else {
+            uint32_t src_x = 0;
+            for (int x = 0; x < width; x++, src_x += x_step) {
+                dst_row[x] = __builtin_bswap16(src_row[src_x >> 16]);
+            }
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef LVGL_PREVIEW_BUFFER_H
+#define LVGL_PREVIEW_BUFFER_H
+
+#include <lvgl.h>
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/*
+ * Double buffer for camera preview frames at display resolution.
+ *
+ * Render() downscales a big-endian RGB565 camera frame (the byte order esp32-camera outputs)
+ * and swaps it to the native byte order in a single pass, straight from the camera framebuffer.
+ * Frames alternate between two buffers, so the one LVGL is showing is never written.
+ * Render() must be called from one task at a time.
+ */
+class LvglPreviewBuffer {
+public:
+    LvglPreviewBuffer() = default;
+    ~LvglPreviewBuffer();
+    LvglPreviewBuffer(const LvglPreviewBuffer&) = delete;
+    LvglPreviewBuffer& operator=(const LvglPreviewBuffer&) = delete;
+
+    // Returns the descriptor of the rendered frame, valid until the call after next, or nullptr
+    const lv_img_dsc_t* Render(const uint8_t* frame, int frame_width, int frame_height, int width, int height);
+
+    // Nearest neighbour downscale with byte swap, dst holds width * height native RGB565 pixels
+    static void ScaleSwap(const uint8_t* frame, int frame_width, int frame_height, uint16_t* dst, int width, int height);
+
+private:
+    uint16_t* buffers_[2] = {nullptr, nullptr};
+    size_t capacity_ = 0;   // Pixels per buffer
+    lv_img_dsc_t image_dscs_[2] = {};
+    int back_ = 0;
+};
+
+#endif // LVGL_PREVIEW_BUFFER_H
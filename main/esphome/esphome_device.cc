@@ -6,6 +6,7 @@
 #include "application.h"
 #include "assets/lang_config.h"
 #include "settings.h"
+#include "latency_trace.h"
 
 #define TAG "ESPHomeDevice"
 
@@ -78,6 +79,25 @@ public:
 
 AskAndExecuteCommandText *ask_and_execute_command_text_id;
 
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+// Writing any text refreshes the latency summary, writing "clear" also starts a new trace
+class LatencyTraceText : public esphome::text::Text
+{
+public:
+  void control(const std::string &value) override
+  {
+    auto &trace = LatencyTrace::GetInstance();
+    if (value == "clear")
+    {
+      trace.Clear();
+    }
+    publish_state(trace.GetSummaryText());
+  };
+};
+
+LatencyTraceText *latency_trace_text_id;
+#endif
+
 
 ESPHomeDevice &ESPHomeDevice::GetInstance()
 {
@@ -195,6 +215,17 @@ void ESPHomeDevice::setup()
   ask_and_execute_command_text_id->traits.set_mode(esphome::text::TEXT_MODE_TEXT);
   ask_and_execute_command_text_id->publish_state("");
 
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+  latency_trace_text_id = new LatencyTraceText();
+  esphome::App.register_text(latency_trace_text_id);
+  latency_trace_text_id->set_name("Latency Trace");
+  latency_trace_text_id->set_object_id("latency_trace_text");
+  latency_trace_text_id->set_disabled_by_default(false);
+  latency_trace_text_id->traits.set_min_length(0);
+  latency_trace_text_id->traits.set_max_length(255);
+  latency_trace_text_id->traits.set_mode(esphome::text::TEXT_MODE_TEXT);
+  latency_trace_text_id->publish_state("");
+#endif
 
   esphome::App.setup();
 }
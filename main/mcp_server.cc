@@ -17,11 +17,67 @@
 #include "settings.h"
 #include "lvgl_theme.h"
 #include "lvgl_display.h"
+#include "latency_trace.h"
 
 #include "esphome_device.h"
 
 #define TAG "MCP"
 
+static thread_local McpCallContext* current_call = nullptr;
+
+McpCallContext::McpCallContext(int id, const cJSON* progress_token) : id_(id) {
+    if (progress_token != nullptr) {
+        progress_token_ = cJSON_Duplicate(progress_token, true);
+    }
+    deadline_ = esp_timer_get_time() + MCP_TOOL_CALL_TIMEOUT_MS * 1000LL;
+}
+
+McpCallContext::~McpCallContext() {
+    if (progress_token_ != nullptr) {
+        cJSON_Delete(progress_token_);
+    }
+}
+
+McpCallContext* McpCallContext::Current() {
+    return current_call;
+}
+
+bool McpCallContext::IsCancelled() const {
+    return state_ != kStateRunning;
+}
+
+bool McpCallContext::Transition(State from, State to) {
+    int expected = from;
+    return state_.compare_exchange_strong(expected, to);
+}
+
+bool McpCallContext::End(State to) {
+    return Transition(kStatePending, to) || Transition(kStateRunning, to);
+}
+
+void McpCallContext::ReportProgress(int progress, int total, const std::string& message) {
+    if (progress_token_ == nullptr || state_ != kStateRunning) {
+        return;
+    }
+    auto json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "jsonrpc", "2.0");
+    cJSON_AddStringToObject(json, "method", "notifications/progress");
+    auto params = cJSON_CreateObject();
+    cJSON_AddItemToObject(params, "progressToken", cJSON_Duplicate(progress_token_, true));
+    cJSON_AddNumberToObject(params, "progress", progress);
+    if (total > 0) {
+        cJSON_AddNumberToObject(params, "total", total);
+    }
+    if (!message.empty()) {
+        cJSON_AddStringToObject(params, "message", message.c_str());
+    }
+    cJSON_AddItemToObject(json, "params", params);
+    auto payload = cJSON_PrintUnformatted(json);
+    Application::GetInstance().SendMcpMessage(payload);
+    cJSON_free(payload);
+    cJSON_Delete(json);
+}
+
 McpServer::McpServer() {
 }
 
@@ -39,6 +95,10 @@ void McpServer::AddCommonTools() {
 
     // Backup the original tools list and restore it after adding the common tools.
     auto original_tools = std::move(tools_);
+    auto original_tools_json = std::move(tools_json_);
+    tools_.clear();
+    tools_json_.clear();
+    tools_index_.clear();
     auto& board = Board::GetInstance();
 
     // Do not add custom tools here.
@@ -101,6 +161,8 @@ void McpServer::AddCommonTools() {
 
     auto camera = board.GetCamera();
     if (camera) {
+        // The camera tools run on the MCP workers, so they take turns on the camera
+        auto camera_mutex = std::make_shared<std::mutex>();
         AddTool("self.camera.take_photo",
             "Take a photo and explain it. Use this tool after the user asks you to see something.\n"
             "Args:\n"
@@ -110,21 +172,55 @@ void McpServer::AddCommonTools() {
             PropertyList({
                 Property("question", kPropertyTypeString)
             }),
-            [camera](const PropertyList& properties) -> ReturnValue {
+            [camera, camera_mutex](const PropertyList& properties) -> ReturnValue {
+                std::lock_guard<std::mutex> lock(*camera_mutex);
                 // Lower the priority to do the camera capture
                 TaskPriorityReset priority_reset(1);
 
+                auto call = McpCallContext::Current();
                 if (!camera->Capture()) {
                     throw std::runtime_error("Failed to capture photo");
                 }
+                if (call != nullptr) {
+                    if (call->IsCancelled()) {
+                        throw std::runtime_error("Cancelled");
+                    }
+                    call->ReportProgress(1, 2, "Captured, explaining");
+                }
                 auto question = properties["question"].value<std::string>();
                 return camera->Explain(question);
-            });
+            })->set_background(true);
+
+        AddTool("self.camera.set_preview",
+            "Show or hide the live camera view on the screen. Taking a photo stops the live view.\n"
+            "Args:\n"
+            "  `enabled`: Whether to show the live camera view.\n"
+            "  `fps`: Frames per second of the live view.",
+            PropertyList({
+                Property("enabled", kPropertyTypeBoolean),
+                Property("fps", kPropertyTypeInteger, 10, 1, 30)
+            }),
+            [camera, camera_mutex](const PropertyList& properties) -> ReturnValue {
+                std::lock_guard<std::mutex> lock(*camera_mutex);
+                if (!properties["enabled"].value<bool>()) {
+                    camera->StopPreview();
+                    return true;
+                }
+                return camera->StartPreview(properties["fps"].value<int>());
+            })->set_background(true);
     }
 #endif
 
     // Restore the original tools list to the end of the tools list
-    tools_.insert(tools_.end(), original_tools.begin(), original_tools.end());
+    for (size_t i = 0; i < original_tools.size(); i++) {
+        // A common tool with the same name stays the one that is called, like with the linear search
+        tools_index_.emplace(original_tools[i]->name(), tools_.size());
+        tools_.push_back(original_tools[i]);
+        tools_json_.push_back(std::move(original_tools_json[i]));
+    }
+    for (auto& pages : tools_list_pages_) {
+        pages.clear();
+    }
 }
 
 void McpServer::AddUserOnlyTools() {
@@ -137,6 +233,22 @@ void McpServer::AddUserOnlyTools() {
             return board.GetSystemInfoJson();
         });
 
+#if CONFIG_USE_AUDIO_LATENCY_TRACE
+    AddUserOnlyTool("self.audio.get_latency_trace",
+        "Get the latency of each stage of the voice pipeline (p50 / p95 / p99 in microseconds) and the queue depth histograms.\n"
+        "Set `raw` to get the trace events instead, they can be turned into a timeline by scripts/latency_timeline.py",
+        PropertyList({
+            Property("raw", kPropertyTypeBoolean, false)
+        }),
+        [](const PropertyList& properties) -> ReturnValue {
+            auto& trace = LatencyTrace::GetInstance();
+            if (properties["raw"].value<bool>()) {
+                return trace.DumpRaw();
+            }
+            return trace.GetSummaryJson();
+        });
+#endif
+
     AddUserOnlyTool("self.reboot", "Reboot the system",
         PropertyList(),
         [this](const PropertyList& properties) -> ReturnValue {
@@ -243,7 +355,7 @@ void McpServer::AddUserOnlyTools() {
                 http->Close();
                 ESP_LOGI(TAG, "Snapshot screen result: %s", result.c_str());
                 return true;
-            });
+            })->set_background(true);
         
         AddUserOnlyTool("self.screen.preview_image", "Preview an image on the screen",
             PropertyList({
@@ -283,7 +395,7 @@ void McpServer::AddUserOnlyTools() {
                 auto image = std::make_unique<LvglAllocatedImage>(data, content_length);
                 display->SetPreviewImage(std::move(image));
                 return true;
-            });
+            })->set_background(true);
 #endif // CONFIG_LV_USE_SNAPSHOT
     }
 #endif // HAVE_LVGL
@@ -304,25 +416,32 @@ void McpServer::AddUserOnlyTools() {
     // }
 }
 
-void McpServer::AddTool(McpTool* tool) {
+McpTool* McpServer::AddTool(McpTool* tool) {
     // Prevent adding duplicate tools
-    if (std::find_if(tools_.begin(), tools_.end(), [tool](const McpTool* t) { return t->name() == tool->name(); }) != tools_.end()) {
+    auto it = tools_index_.find(tool->name());
+    if (it != tools_index_.end()) {
         ESP_LOGW(TAG, "Tool %s already added", tool->name().c_str());
-        return;
+        return tools_[it->second];
     }
 
     ESP_LOGI(TAG, "Add tool: %s%s", tool->name().c_str(), tool->user_only() ? " [user]" : "");
+    tools_index_[tool->name()] = tools_.size();
     tools_.push_back(tool);
+    tools_json_.push_back(tool->to_json());
+    for (auto& pages : tools_list_pages_) {
+        pages.clear();
+    }
+    return tool;
 }
 
-void McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
-    AddTool(new McpTool(name, description, properties, callback));
+McpTool* McpServer::AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
+    return AddTool(new McpTool(name, description, properties, callback));
 }
 
-void McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
+McpTool* McpServer::AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback) {
     auto tool = new McpTool(name, description, properties, callback);
     tool->set_user_only(true);
-    AddTool(tool);
+    return AddTool(tool);
 }
 
 void McpServer::ParseMessage(const std::string& message) {
@@ -370,6 +489,14 @@ void McpServer::ParseMessage(const cJSON* json) {
     }
     
     auto method_str = std::string(method->valuestring);
+    if (method_str == "notifications/cancelled") {
+        auto params = cJSON_GetObjectItem(json, "params");
+        auto request_id = cJSON_GetObjectItem(params, "requestId");
+        if (cJSON_IsNumber(request_id)) {
+            CancelCall(request_id->valueint);
+        }
+        return;
+    }
     if (method_str.find("notifications") == 0) {
         return;
     }
@@ -432,7 +559,12 @@ void McpServer::ParseMessage(const cJSON* json) {
             ReplyError(id_int, "Invalid arguments");
             return;
         }
-        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments);
+        auto meta = cJSON_GetObjectItem(params, "_meta");
+        auto progress_token = cJSON_GetObjectItem(meta, "progressToken");
+        if (!cJSON_IsString(progress_token) && !cJSON_IsNumber(progress_token)) {
+            progress_token = nullptr;
+        }
+        DoToolCall(id_int, std::string(tool_name->valuestring), tool_arguments, progress_token);
     } else {
         ESP_LOGE(TAG, "Method not implemented: %s", method_str.c_str());
         ReplyError(id_int, "Method not implemented: " + method_str);
@@ -456,75 +588,98 @@ void McpServer::ReplyError(int id, const std::string& message) {
     Application::GetInstance().SendMcpMessage(payload);
 }
 
-void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
+// Fills result with the tools from index on that fit in one payload, index is left at the first
+// tool of the next page. Returns false if not even the first tool fits.
+bool McpServer::BuildToolsListPage(size_t& index, bool list_user_only_tools, std::string& result) {
     const int max_payload_size = 8000;
-    std::string json = "{\"tools\":[";
-    
-    bool found_cursor = cursor.empty();
-    auto it = tools_.begin();
+    result = "{\"tools\":[";
     std::string next_cursor = "";
-    
-    while (it != tools_.end()) {
-        // 如果我们还没有找到起始位置，继续搜索
-        if (!found_cursor) {
-            if ((*it)->name() == cursor) {
-                found_cursor = true;
-            } else {
-                ++it;
-                continue;
-            }
-        }
 
-        if (!list_user_only_tools && (*it)->user_only()) {
-            ++it;
+    for (; index < tools_.size(); ++index) {
+        if (!list_user_only_tools && tools_[index]->user_only()) {
             continue;
         }
-        
+
         // 添加tool前检查大小
-        std::string tool_json = (*it)->to_json() + ",";
-        if (json.length() + tool_json.length() + 30 > max_payload_size) {
+        const std::string& tool_json = tools_json_[index];
+        if (result.length() + tool_json.length() + 1 + 30 > max_payload_size) {
             // 如果添加这个tool会超出大小限制，设置next_cursor并退出循环
-            next_cursor = (*it)->name();
+            next_cursor = tools_[index]->name();
             break;
         }
-        
-        json += tool_json;
-        ++it;
-    }
-    
-    if (json.back() == ',') {
-        json.pop_back();
+        result += tool_json;
+        result += ',';
     }
-    
-    if (json.back() == '[' && !tools_.empty()) {
+
+    if (result.back() == ',') {
+        result.pop_back();
+    } else if (!next_cursor.empty()) {
         // 如果没有添加任何tool，返回错误
-        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", next_cursor.c_str());
-        ReplyError(id, "Failed to add tool " + next_cursor + " because of payload size limit");
-        return;
+        result = next_cursor;
+        return false;
     }
 
     if (next_cursor.empty()) {
-        json += "]}";
+        result += "]}";
     } else {
-        json += "],\"nextCursor\":\"" + next_cursor + "\"}";
+        result += "],\"nextCursor\":\"" + next_cursor + "\"}";
     }
-    
-    ReplyResult(id, json);
+    return true;
 }
 
-void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments) {
-    auto tool_iter = std::find_if(tools_.begin(), tools_.end(), 
-                                 [&tool_name](const McpTool* tool) { 
-                                     return tool->name() == tool_name; 
-                                 });
-    
-    if (tool_iter == tools_.end()) {
+void McpServer::GetToolsList(int id, const std::string& cursor, bool list_user_only_tools) {
+    auto& pages = tools_list_pages_[list_user_only_tools ? 1 : 0];
+    if (pages.empty()) {
+        // Split the whole list once, the pages stay valid until the next AddTool
+        size_t index = 0;
+        do {
+            ToolsListPage page;
+            page.cursor = index == 0 ? "" : tools_[index]->name();
+            if (!BuildToolsListPage(index, list_user_only_tools, page.result)) {
+                ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", page.result.c_str());
+                ReplyError(id, "Failed to add tool " + page.result + " because of payload size limit");
+                pages.clear();
+                return;
+            }
+            pages.push_back(std::move(page));
+        } while (index < tools_.size());
+    }
+
+    for (const auto& page : pages) {
+        if (page.cursor == cursor) {
+            ReplyResult(id, page.result);
+            return;
+        }
+    }
+
+    // A cursor that is not the start of a page still lists from that tool on
+    auto it = tools_index_.find(cursor);
+    if (it == tools_index_.end()) {
+        ESP_LOGE(TAG, "tools/list: Invalid cursor: %s", cursor.c_str());
+        ReplyError(id, "Invalid cursor: " + cursor);
+        return;
+    }
+    size_t index = it->second;
+    std::string result;
+    if (!BuildToolsListPage(index, list_user_only_tools, result)) {
+        ESP_LOGE(TAG, "tools/list: Failed to add tool %s because of payload size limit", result.c_str());
+        ReplyError(id, "Failed to add tool " + result + " because of payload size limit");
+        return;
+    }
+    ReplyResult(id, result);
+}
+
+void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, const cJSON* progress_token) {
+    auto tool_iter = tools_index_.find(tool_name);
+    if (tool_iter == tools_index_.end()) {
         ESP_LOGE(TAG, "tools/call: Unknown tool: %s", tool_name.c_str());
         ReplyError(id, "Unknown tool: " + tool_name);
         return;
     }
+    // The pointer stays valid when more tools are added, unlike an iterator into tools_
+    McpTool* tool = tools_[tool_iter->second];
 
-    PropertyList arguments = (*tool_iter)->properties();
+    PropertyList arguments = tool->properties();
     try {
         for (auto& argument : arguments) {
             bool found = false;
@@ -554,14 +709,157 @@ void McpServer::DoToolCall(int id, const std::string& tool_name, const cJSON* to
         return;
     }
 
+    auto context = std::make_shared<McpCallContext>(id, progress_token);
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        calls_[id] = context;
+        if (timeout_timer_ == nullptr) {
+            esp_timer_create_args_t timer_args = {
+                .callback = [](void* arg) {
+                    static_cast<McpServer*>(arg)->CheckCallTimeouts();
+                },
+                .arg = this,
+                .dispatch_method = ESP_TIMER_TASK,
+                .name = "mcp_timeout",
+                .skip_unhandled_events = true,
+            };
+            esp_timer_create(&timer_args, &timeout_timer_);
+        }
+        if (!esp_timer_is_active(timeout_timer_)) {
+            esp_timer_start_periodic(timeout_timer_, 1000000);
+        }
+    }
+
+    if (tool->background()) {
+        // Slow tools run on the workers, so the main loop keeps handling audio and events
+        StartWorkers();
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex_);
+            jobs_.push_back({tool, std::move(arguments), std::move(context)});
+        }
+        jobs_cv_.notify_one();
+        return;
+    }
+
     // Use main thread to call the tool
     auto& app = Application::GetInstance();
-    app.Schedule([this, id, tool_iter, arguments = std::move(arguments)]() {
-        try {
-            ReplyResult(id, (*tool_iter)->Call(arguments));
-        } catch (const std::exception& e) {
-            ESP_LOGE(TAG, "tools/call: %s", e.what());
-            ReplyError(id, e.what());
-        }
+    app.Schedule([this, tool, arguments = std::move(arguments), context = std::move(context)]() {
+        RunTool(tool, arguments, *context);
     });
 }
+
+void McpServer::RunTool(McpTool* tool, const PropertyList& arguments, McpCallContext& context) {
+    // The call may have been cancelled or timed out while it was waiting
+    if (!context.Transition(McpCallContext::kStatePending, McpCallContext::kStateRunning)) {
+        ESP_LOGW(TAG, "tools/call: Skip %s, call %d has ended", tool->name().c_str(), context.id());
+        RemoveCall(context);
+        return;
+    }
+
+    std::string result;
+    std::string error;
+    current_call = &context;
+    try {
+        result = tool->Call(arguments);
+    } catch (const std::exception& e) {
+        ESP_LOGE(TAG, "tools/call: %s", e.what());
+        error = e.what();
+    }
+    current_call = nullptr;
+
+    // A call that was cancelled or timed out has been answered already, or must not be
+    if (context.Transition(McpCallContext::kStateRunning, McpCallContext::kStateDone)) {
+        if (error.empty()) {
+            ReplyResult(context.id(), result);
+        } else {
+            ReplyError(context.id(), error);
+        }
+    } else {
+        ESP_LOGW(TAG, "tools/call: Drop the result of %s, call %d has ended", tool->name().c_str(), context.id());
+    }
+    RemoveCall(context);
+}
+
+void McpServer::RemoveCall(const McpCallContext& context) {
+    std::lock_guard<std::mutex> lock(calls_mutex_);
+    // The id may have been reused by a newer call
+    auto it = calls_.find(context.id());
+    if (it != calls_.end() && it->second.get() == &context) {
+        calls_.erase(it);
+    }
+}
+
+void McpServer::CancelCall(int id) {
+    std::shared_ptr<McpCallContext> context;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        auto it = calls_.find(id);
+        if (it == calls_.end()) {
+            return;
+        }
+        context = it->second;
+        calls_.erase(it);
+    }
+    // The client does not expect a response to a cancelled request
+    if (context->End(McpCallContext::kStateCancelled)) {
+        ESP_LOGI(TAG, "tools/call: Call %d cancelled", id);
+    }
+}
+
+void McpServer::CheckCallTimeouts() {
+    std::vector<std::shared_ptr<McpCallContext>> expired;
+    {
+        std::lock_guard<std::mutex> lock(calls_mutex_);
+        auto now = esp_timer_get_time();
+        for (auto it = calls_.begin(); it != calls_.end();) {
+            if (now >= it->second->deadline_) {
+                expired.push_back(std::move(it->second));
+                it = calls_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        if (calls_.empty()) {
+            esp_timer_stop(timeout_timer_);
+        }
+    }
+    for (auto& context : expired) {
+        if (context->End(McpCallContext::kStateTimedOut)) {
+            ESP_LOGW(TAG, "tools/call: Call %d timed out", context->id());
+            ReplyError(context->id(), "Tool call timed out");
+        }
+    }
+}
+
+void McpServer::StartWorkers() {
+    std::lock_guard<std::mutex> lock(jobs_mutex_);
+    if (workers_started_) {
+        return;
+    }
+    workers_started_ = true;
+
+    esp_pthread_cfg_t cfg = esp_pthread_get_default_config();
+    cfg.thread_name = "mcp_worker";
+    cfg.stack_size = MCP_WORKER_STACK_SIZE;
+    cfg.prio = 2;
+    esp_pthread_set_cfg(&cfg);
+    for (int i = 0; i < MCP_WORKER_COUNT; i++) {
+        // The server lives as long as the application, so the workers are never joined
+        std::thread(&McpServer::WorkerLoop, this).detach();
+    }
+    cfg = esp_pthread_get_default_config();
+    esp_pthread_set_cfg(&cfg);
+}
+
+void McpServer::WorkerLoop() {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex_);
+            jobs_cv_.wait(lock, [this]() { return !jobs_.empty(); });
+            job = std::move(jobs_.front());
+            jobs_.pop_front();
+        }
+        RunTool(job.tool, job.arguments, *job.context);
+    }
+}
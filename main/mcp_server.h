@@ -4,12 +4,19 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <functional>
 #include <variant>
 #include <optional>
 #include <stdexcept>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <atomic>
 #include <mbedtls/base64.h>
+#include <esp_timer.h>
 
 #include <cJSON.h>
 
@@ -212,6 +219,7 @@ private:
     PropertyList properties_;
     std::function<ReturnValue(const PropertyList&)> callback_;
     bool user_only_ = false;
+    bool background_ = false;
 
 public:
     McpTool(const std::string& name, 
@@ -224,10 +232,13 @@ public:
         callback_(callback) {}
 
     void set_user_only(bool user_only) { user_only_ = user_only; }
+    // Background tools run on the MCP workers, the others on the main event loop
+    void set_background(bool background) { background_ = background; }
     inline const std::string& name() const { return name_; }
     inline const std::string& description() const { return description_; }
     inline const PropertyList& properties() const { return properties_; }
     inline bool user_only() const { return user_only_; }
+    inline bool background() const { return background_; }
 
     std::string to_json() const {
         std::vector<std::string> required = properties_.GetRequired();
@@ -311,6 +322,49 @@ public:
     }
 };
 
+#define MCP_WORKER_COUNT 2
+#define MCP_WORKER_STACK_SIZE (2048 * 4)
+#define MCP_TOOL_CALL_TIMEOUT_MS 30000
+
+/**
+ * One tools/call request, shared by the thread running the tool, the timeout check and
+ * notifications/cancelled. Only the first of finishing, timing out or being cancelled counts,
+ * so a request gets at most one reply.
+ */
+class McpCallContext {
+public:
+    McpCallContext(int id, const cJSON* progress_token);
+    ~McpCallContext();
+
+    // The call running on this thread, nullptr outside of a tool callback
+    static McpCallContext* Current();
+
+    inline int id() const { return id_; }
+    // Long running tools should check this between steps and give up when it is set
+    bool IsCancelled() const;
+    // Sends notifications/progress if the client passed a progress token
+    void ReportProgress(int progress, int total, const std::string& message = "");
+
+private:
+    friend class McpServer;
+    enum State {
+        kStatePending,
+        kStateRunning,
+        kStateDone,
+        kStateCancelled,
+        kStateTimedOut,
+    };
+
+    int id_;
+    cJSON* progress_token_ = nullptr;
+    int64_t deadline_;
+    std::atomic<int> state_ = kStatePending;
+
+    bool Transition(State from, State to);
+    // Ends a pending or running call in the given state, false if it has already ended
+    bool End(State to);
+};
+
 class McpServer {
 public:
     static McpServer& GetInstance() {
@@ -320,9 +374,10 @@ public:
 
     void AddCommonTools();
     void AddUserOnlyTools();
-    void AddTool(McpTool* tool);
-    void AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
-    void AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    // Returns the registered tool, which is the earlier one if the name is already taken
+    McpTool* AddTool(McpTool* tool);
+    McpTool* AddTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
+    McpTool* AddUserOnlyTool(const std::string& name, const std::string& description, const PropertyList& properties, std::function<ReturnValue(const PropertyList&)> callback);
     void ParseMessage(const cJSON* json);
     void ParseMessage(const std::string& message);
 
@@ -336,9 +391,44 @@ private:
     void ReplyError(int id, const std::string& message);
 
     void GetToolsList(int id, const std::string& cursor, bool list_user_only_tools);
-    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments);
+    bool BuildToolsListPage(size_t& index, bool list_user_only_tools, std::string& result);
+    void DoToolCall(int id, const std::string& tool_name, const cJSON* tool_arguments, const cJSON* progress_token);
+    void RunTool(McpTool* tool, const PropertyList& arguments, McpCallContext& context);
+    void CancelCall(int id);
+    void RemoveCall(const McpCallContext& context);
+    void CheckCallTimeouts();
+    void StartWorkers();
+    void WorkerLoop();
 
     std::vector<McpTool*> tools_;
+    // Serialized once when the tool is added, in the same order as tools_
+    std::vector<std::string> tools_json_;
+    // Tool name to its index in tools_
+    std::unordered_map<std::string, size_t> tools_index_;
+
+    // Complete tools/list results, split at the payload size limit
+    struct ToolsListPage {
+        std::string cursor;     // Name of the first tool, empty for the first page
+        std::string result;
+    };
+    // Indexed by list_user_only_tools, cleared by AddTool
+    std::vector<ToolsListPage> tools_list_pages_[2];
+
+    // Calls that have not been answered yet, by request id
+    std::mutex calls_mutex_;
+    std::map<int, std::shared_ptr<McpCallContext>> calls_;
+    esp_timer_handle_t timeout_timer_ = nullptr;
+
+    // Background tool calls waiting for a worker
+    struct Job {
+        McpTool* tool;
+        PropertyList arguments;
+        std::shared_ptr<McpCallContext> context;
+    };
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cv_;
+    std::deque<Job> jobs_;
+    bool workers_started_ = false;
 };
 
 #endif // MCP_SERVER_H
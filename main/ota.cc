@@ -1,6 +1,8 @@
 #include "ota.h"
 #include "system_info.h"
 #include "settings.h"
+#include "partition_writer.h"
+#include "ota_delta.h"
 #include "assets/lang_config.h"
 
 #include <cJSON.h>
@@ -15,12 +17,18 @@
 #endif
 
 #include <cstring>
+#include <cstdio>
 #include <vector>
 #include <sstream>
 #include <algorithm>
+#include <atomic>
 
 #define TAG "Ota"
 
+#define OTA_MAX_RETRIES 5
+// Bytes written between two persisted resume points
+#define OTA_CHECKPOINT_INTERVAL (64 * 1024)
+
 
 Ota::Ota() {
 #ifdef ESP_EFUSE_BLOCK_USR_DATA
@@ -264,7 +272,6 @@ void Ota::MarkCurrentVersionValid() {
 
 bool Ota::Upgrade(const std::string& firmware_url) {
     ESP_LOGI(TAG, "Upgrading firmware from %s", firmware_url.c_str());
-    esp_ota_handle_t update_handle = 0;
     auto update_partition = esp_ota_get_next_update_partition(NULL);
     if (update_partition == NULL) {
         ESP_LOGE(TAG, "Failed to get update partition");
@@ -272,99 +279,278 @@ bool Ota::Upgrade(const std::string& firmware_url) {
     }
 
     ESP_LOGI(TAG, "Writing to partition %s at offset 0x%lx", update_partition->label, update_partition->address);
-    bool image_header_checked = false;
-    std::string image_header;
-
-    auto network = Board::GetInstance().GetNetwork();
-    auto http = network->CreateHttp(0);
-    if (!http->Open("GET", firmware_url)) {
-        ESP_LOGE(TAG, "Failed to open HTTP connection");
-        return false;
-    }
-
-    if (http->GetStatusCode() != 200) {
-        ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
-        return false;
-    }
-
-    size_t content_length = http->GetBodyLength();
-    if (content_length == 0) {
-        ESP_LOGE(TAG, "Failed to get content length");
-        return false;
+    const size_t sector_size = esp_partition_get_main_flash_sector_size();
+
+    // Resume a download that was interrupted by a reboot, if it is the same image
+    size_t image_size = 0;
+    size_t offset = 0;
+    std::string etag;
+    {
+        Settings settings("ota", false);
+        if (settings.GetString("url") == firmware_url && settings.GetString("partition") == update_partition->label) {
+            image_size = settings.GetInt("size");
+            // Writing resumes on a sector boundary, which also keeps it aligned to the flash encryption blocks
+            offset = settings.GetInt("offset") / sector_size * sector_size;
+            etag = settings.GetString("etag");
+        }
+        if (offset > image_size) {
+            offset = 0;
+        }
     }
 
-    char buffer[512];
-    size_t total_read = 0, recent_read = 0;
-    auto last_calc_time = esp_timer_get_time();
-    while (true) {
-        int ret = http->Read(buffer, sizeof(buffer));
-        if (ret < 0) {
-            ESP_LOGE(TAG, "Failed to read HTTP data: %s", esp_err_to_name(ret));
-            return false;
+    // The checkpoint only advances after the data is written, so it is always safe to resume from.
+    // It is updated by the writer task and read by this one, hence the atomics
+    std::atomic<size_t> checkpoint = offset;
+    std::atomic<bool> resumable = true;
+    PartitionWriter writer(update_partition);
+    writer.OnWritten([&checkpoint, &resumable, sector_size](size_t written) {
+        if (resumable && written - checkpoint >= OTA_CHECKPOINT_INTERVAL) {
+            size_t aligned = written / sector_size * sector_size;
+            checkpoint = aligned;
+            Settings settings("ota", true);
+            settings.SetInt("offset", aligned);
+            Settings::Commit();
         }
+    });
 
+    auto network = Board::GetInstance().GetNetwork();
+    int retries = 0;
+    size_t downloaded = 0, recent_read = 0, target_size = 0;
+    bool is_delta = false;
+    auto last_calc_time = esp_timer_get_time();
+    auto report_progress = [&](size_t received) {
         // Calculate speed and progress every second
-        recent_read += ret;
-        total_read += ret;
-        if (esp_timer_get_time() - last_calc_time >= 1000000 || ret == 0) {
-            size_t progress = total_read * 100 / content_length;
-            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, total_read, content_length, recent_read);
+        if (esp_timer_get_time() - last_calc_time >= 1000000 || received == image_size) {
+            size_t progress = received * 100 / image_size;
+            ESP_LOGI(TAG, "Progress: %u%% (%u/%u), Speed: %uB/s", progress, received, image_size, recent_read);
             if (upgrade_callback_) {
                 upgrade_callback_(progress, recent_read);
             }
             last_calc_time = esp_timer_get_time();
             recent_read = 0;
         }
+    };
+    while (true) {
+        auto http = network->CreateHttp(0);
+        if (offset > 0) {
+            ESP_LOGI(TAG, "Resuming firmware download at %u/%u", offset, image_size);
+            http->SetHeader("Range", "bytes=" + std::to_string(offset) + "-");
+            if (!etag.empty()) {
+                http->SetHeader("If-Range", etag);
+            }
+        }
 
-        if (ret == 0) {
-            break;
+        bool body_ready = false;
+        if (!http->Open("GET", firmware_url)) {
+            ESP_LOGE(TAG, "Failed to open HTTP connection");
+        } else if (http->GetStatusCode() == 200 || (http->GetStatusCode() == 416 && offset > 0)) {
+            if (offset > 0) {
+                ESP_LOGW(TAG, "Server sent the whole image (status %d), restarting download", http->GetStatusCode());
+            }
+            if (http->GetStatusCode() == 200) {
+                offset = 0;
+                image_size = http->GetBodyLength();
+                etag = http->GetResponseHeader("ETag");
+                checkpoint = 0;
+                Settings settings("ota", true);
+                settings.SetString("url", firmware_url);
+                settings.SetString("partition", update_partition->label);
+                settings.SetInt("size", image_size);
+                settings.SetString("etag", etag);
+                settings.SetInt("offset", 0);
+                // A stale offset of an earlier image must not survive the first write to the partition
+                Settings::Commit();
+                body_ready = true;
+            } else {
+                // The saved range no longer fits the image, ask for all of it
+                http->Close();
+                offset = 0;
+                etag.clear();
+                continue;
+            }
+        } else if (http->GetStatusCode() == 206 && offset > 0) {
+            // Content-Range: bytes <first>-<last>/<total>
+            unsigned int first = 0, last = 0, total = 0;
+            auto content_range = http->GetResponseHeader("Content-Range");
+            if (sscanf(content_range.c_str(), "bytes %u-%u/%u", &first, &last, &total) != 3 || first != offset || total != image_size) {
+                ESP_LOGW(TAG, "Unexpected Content-Range \"%s\", restarting download", content_range.c_str());
+                http->Close();
+                offset = 0;
+                etag.clear();
+                continue;
+            }
+            body_ready = true;
+        } else if (http->GetStatusCode() < 500) {
+            ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
+            return false;
+        } else {
+            ESP_LOGE(TAG, "Failed to get firmware, status code: %d", http->GetStatusCode());
         }
 
-        if (!image_header_checked) {
-            image_header.append(buffer, ret);
-            if (image_header.size() >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
-                esp_app_desc_t new_app_info;
-                memcpy(&new_app_info, image_header.data() + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
-                
-                auto current_version = esp_app_get_description()->version;
-                ESP_LOGI(TAG, "Current version: %s, New version: %s", current_version, new_app_info.version);
-
-                if (esp_ota_begin(update_partition, OTA_WITH_SEQUENTIAL_WRITES, &update_handle)) {
-                    esp_ota_abort(update_handle);
-                    ESP_LOGE(TAG, "Failed to begin OTA");
-                    return false;
+        bool read_error = !body_ready;
+        if (body_ready) {
+            if (image_size == 0) {
+                ESP_LOGE(TAG, "Failed to get content length");
+                return false;
+            }
+            if (image_size > update_partition->size) {
+                ESP_LOGE(TAG, "Firmware size (%u) is larger than partition size (%lu)", image_size, update_partition->size);
+                return false;
+            }
+            if (!writer.Begin(offset)) {
+                return false;
+            }
+
+            // A compressed image or patch is recognized by its header, it is rebuilt while it downloads
+            OtaDeltaHeader delta_header;
+            size_t head_len = 0;
+            if (offset == 0) {
+                while (head_len < sizeof(delta_header) && head_len < image_size) {
+                    int ret = http->Read((char*)&delta_header + head_len, sizeof(delta_header) - head_len);
+                    if (ret <= 0) {
+                        ESP_LOGE(TAG, "Failed to read HTTP data at %u: %d", head_len, ret);
+                        read_error = true;
+                        break;
+                    }
+                    head_len += ret;
+                    downloaded += ret;
+                    recent_read += ret;
+                }
+                is_delta = OtaDeltaDecoder::IsDeltaImage((const uint8_t*)&delta_header, head_len);
+                if (is_delta) {
+                    // The output can only be resumed at an operation boundary, so patches restart instead
+                    resumable = false;
+                    Settings settings("ota", true);
+                    settings.EraseAll();
                 }
+            }
 
-                image_header_checked = true;
-                std::string().swap(image_header);
+            if (is_delta && !read_error) {
+                OtaDeltaDecoder decoder(writer);
+                if (!decoder.Begin(delta_header, update_partition)) {
+                    return false;
+                }
+                target_size = delta_header.target_size;
+                size_t received = head_len;
+                char buffer[1024];
+                while (received < image_size) {
+                    int ret = http->Read(buffer, std::min(sizeof(buffer), image_size - received));
+                    if (ret <= 0) {
+                        ESP_LOGE(TAG, "Failed to read HTTP data at %u: %d", received, ret);
+                        read_error = true;
+                        break;
+                    }
+                    if (!decoder.Feed((const uint8_t*)buffer, ret)) {
+                        return false;
+                    }
+                    received += ret;
+                    downloaded += ret;
+                    recent_read += ret;
+                    report_progress(received);
+                }
+                if (!read_error && !decoder.Finish()) {
+                    return false;
+                }
+            } else if (!read_error) {
+                // Network reads fill the pool while the writer task erases and writes the previous buffers
+                target_size = image_size;
+                size_t received = offset;
+                while (received < image_size && !read_error) {
+                    auto buffer = writer.Acquire();
+                    if (buffer == nullptr) {
+                        break;
+                    }
+                    if (head_len > 0) {
+                        memcpy(buffer->data, &delta_header, head_len);
+                        buffer->len = head_len;
+                        head_len = 0;
+                    }
+                    while (buffer->len < writer.buffer_size() && received + buffer->len < image_size) {
+                        size_t size = std::min(writer.buffer_size() - buffer->len, image_size - received - buffer->len);
+                        int ret = http->Read((char*)buffer->data + buffer->len, size);
+                        if (ret <= 0) {
+                            ESP_LOGE(TAG, "Failed to read HTTP data at %u: %d", received + buffer->len, ret);
+                            read_error = true;
+                            break;
+                        }
+                        buffer->len += ret;
+                        downloaded += ret;
+                        recent_read += ret;
+                    }
+
+                    if (read_error) {
+                        // The rest is downloaded again from the last written sector
+                        buffer->len -= buffer->len % PARTITION_WRITER_WRITE_ALIGN;
+                    }
+                    if (received == 0 && buffer->len > 0) {
+                        if (!CheckImageHeader(buffer->data, buffer->len)) {
+                            buffer->len = 0;
+                            writer.Submit(buffer);
+                            return false;
+                        }
+                    }
+                    received += buffer->len;
+                    writer.Submit(buffer);
+                    report_progress(received);
+                }
             }
         }
-        auto err = esp_ota_write(update_handle, buffer, ret);
-        if (err != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to write OTA data: %s", esp_err_to_name(err));
-            esp_ota_abort(update_handle);
+        http->Close();
+
+        if (!writer.Flush()) {
             return false;
         }
+        if (!read_error) {
+            break;
+        }
+
+        // Continue from the last written sector, give up after several attempts without progress
+        size_t resume_offset = is_delta ? 0 : std::max(offset, writer.written() / sector_size * sector_size);
+        if (resume_offset > offset) {
+            retries = 0;
+        }
+        offset = resume_offset;
+        if (++retries > OTA_MAX_RETRIES) {
+            ESP_LOGE(TAG, "Firmware download failed after %d retries, it resumes at %u next time", OTA_MAX_RETRIES, checkpoint.load());
+            return false;
+        }
+        ESP_LOGW(TAG, "Retrying firmware download in %d seconds (%d/%d)", retries, retries, OTA_MAX_RETRIES);
+        vTaskDelay(pdMS_TO_TICKS(retries * 1000));
     }
-    http->Close();
+    ESP_LOGI(TAG, "Downloaded %u bytes for a %u byte image", downloaded, target_size);
 
-    esp_err_t err = esp_ota_end(update_handle);
+    {
+        // The image is complete or corrupted, either way the next download starts over
+        Settings settings("ota", true);
+        settings.EraseAll();
+    }
+
+    // Verifies the image before switching to it
+    esp_err_t err = esp_ota_set_boot_partition(update_partition);
     if (err != ESP_OK) {
         if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
             ESP_LOGE(TAG, "Image validation failed, image is corrupted");
         } else {
-            ESP_LOGE(TAG, "Failed to end OTA: %s", esp_err_to_name(err));
+            ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
         }
         return false;
     }
 
-    err = esp_ota_set_boot_partition(update_partition);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
+    ESP_LOGI(TAG, "Firmware upgrade successful");
+    return true;
+}
+
+bool Ota::CheckImageHeader(const uint8_t* data, size_t len) {
+    if (data[0] != ESP_IMAGE_HEADER_MAGIC) {
+        ESP_LOGE(TAG, "Invalid firmware image, magic byte 0x%02x", data[0]);
         return false;
     }
-
-    ESP_LOGI(TAG, "Firmware upgrade successful");
+    if (len >= sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t) + sizeof(esp_app_desc_t)) {
+        esp_app_desc_t new_app_info;
+        memcpy(&new_app_info, data + sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t), sizeof(esp_app_desc_t));
+        auto current_version = esp_app_get_description()->version;
+        ESP_LOGI(TAG, "Current version: %s, New version: %s", current_version, new_app_info.version);
+    }
     return true;
 }
 
@@ -0,0 +1,260 @@
+#include "ota_delta.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+#include <esp_ota_ops.h>
+#include <cstring>
+#include <algorithm>
+
+#define TAG "OtaDelta"
+
+#define OTA_DELTA_OP_LITERAL 0x00
+#define OTA_DELTA_OP_SOURCE 0x01
+#define OTA_DELTA_OP_WINDOW 0x02
+#define OTA_DELTA_OP_END 0xff
+
+OtaDeltaDecoder::OtaDeltaDecoder(PartitionWriter& writer) : writer_(writer) {
+    mbedtls_sha256_init(&sha256_);
+}
+
+OtaDeltaDecoder::~OtaDeltaDecoder() {
+    if (buffer_ != nullptr) {
+        buffer_->len = 0;
+        writer_.Submit(buffer_);
+    }
+    if (window_ != nullptr) {
+        heap_caps_free(window_);
+    }
+    mbedtls_sha256_free(&sha256_);
+}
+
+bool OtaDeltaDecoder::IsDeltaImage(const uint8_t* data, size_t len) {
+    return len >= sizeof(OtaDeltaHeader) && memcmp(data, OTA_DELTA_MAGIC, 4) == 0;
+}
+
+bool OtaDeltaDecoder::Begin(const OtaDeltaHeader& header, const esp_partition_t* target_partition) {
+    header_ = header;
+    if (header_.target_size == 0 || header_.target_size > target_partition->size) {
+        ESP_LOGE(TAG, "Invalid target size %lu", header_.target_size);
+        return false;
+    }
+
+    if (header_.flags & OTA_DELTA_FLAG_HAS_SOURCE) {
+        source_ = esp_ota_get_running_partition();
+        if (source_ == nullptr || header_.source_size > source_->size || !VerifySource()) {
+            ESP_LOGE(TAG, "Patch does not match the running firmware");
+            return false;
+        }
+    }
+
+    window_ = (uint8_t*)heap_caps_malloc(OTA_DELTA_WINDOW_SIZE, MALLOC_CAP_SPIRAM);
+    if (window_ == nullptr) {
+        window_ = (uint8_t*)heap_caps_malloc(OTA_DELTA_WINDOW_SIZE, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+        if (window_ == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate window");
+            return false;
+        }
+    }
+    mbedtls_sha256_starts(&sha256_, 0);
+    ESP_LOGI(TAG, "Decoding %s image of %lu bytes", source_ != nullptr ? "patch" : "compressed", header_.target_size);
+    return true;
+}
+
+bool OtaDeltaDecoder::VerifySource() {
+    mbedtls_sha256_context sha256;
+    mbedtls_sha256_init(&sha256);
+    mbedtls_sha256_starts(&sha256, 0);
+    uint8_t buffer[512];
+    bool ok = true;
+    for (size_t offset = 0; offset < header_.source_size && ok; offset += sizeof(buffer)) {
+        size_t len = std::min(sizeof(buffer), header_.source_size - offset);
+        ok = esp_partition_read(source_, offset, buffer, len) == ESP_OK;
+        mbedtls_sha256_update(&sha256, buffer, len);
+    }
+    uint8_t hash[32];
+    mbedtls_sha256_finish(&sha256, hash);
+    mbedtls_sha256_free(&sha256);
+    return ok && memcmp(hash, header_.source_sha256, sizeof(hash)) == 0;
+}
+
+bool OtaDeltaDecoder::Feed(const uint8_t* data, size_t len) {
+    while (len > 0 && !failed_) {
+        if (literal_remaining_ > 0) {
+            size_t n = std::min<size_t>(len, literal_remaining_);
+            if (!Output(data, n)) {
+                return false;
+            }
+            literal_remaining_ -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (done_ || op_len_ == sizeof(op_)) {
+            ESP_LOGE(TAG, "Invalid data after %u output bytes", output_size_);
+            failed_ = true;
+            break;
+        }
+        op_[op_len_++] = *data++;
+        len--;
+        if (ParseOp()) {
+            op_len_ = 0;
+        }
+    }
+    return !failed_;
+}
+
+// Returns true once the operation in op_ is complete and has been applied
+bool OtaDeltaDecoder::ParseOp() {
+    int fields;
+    switch (op_[0]) {
+    case OTA_DELTA_OP_LITERAL:
+        fields = 1;
+        break;
+    case OTA_DELTA_OP_SOURCE:
+    case OTA_DELTA_OP_WINDOW:
+        fields = 2;
+        break;
+    case OTA_DELTA_OP_END:
+        done_ = true;
+        return true;
+    default:
+        ESP_LOGE(TAG, "Invalid operation 0x%02x", op_[0]);
+        failed_ = true;
+        return false;
+    }
+
+    uint32_t values[2] = {};
+    size_t pos = 1;
+    for (int i = 0; i < fields; i++) {
+        int shift = 0;
+        while (true) {
+            if (pos == op_len_) {
+                return false;
+            }
+            uint8_t byte = op_[pos++];
+            values[i] |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+            if (byte < 0x80) {
+                break;
+            }
+            if (shift > 28) {
+                failed_ = true;
+                return false;
+            }
+        }
+    }
+
+    switch (op_[0]) {
+    case OTA_DELTA_OP_LITERAL:
+        literal_remaining_ = values[0];
+        return true;
+    case OTA_DELTA_OP_SOURCE: {
+        // Zigzag encoded distance from the end of the previous copy
+        int32_t delta = (values[0] & 1) ? -(int32_t)((values[0] + 1) >> 1) : (int32_t)(values[0] >> 1);
+        failed_ = !CopySource(delta, values[1]);
+        return !failed_;
+    }
+    default:
+        failed_ = !CopyWindow(values[0], values[1]);
+        return !failed_;
+    }
+}
+
+bool OtaDeltaDecoder::CopySource(int32_t delta, uint32_t len) {
+    int64_t position = (int64_t)source_cursor_ + delta;
+    if (source_ == nullptr || position < 0 || position + len > header_.source_size) {
+        ESP_LOGE(TAG, "Source copy out of range");
+        return false;
+    }
+    source_cursor_ = position;
+
+    uint8_t buffer[512];
+    while (len > 0) {
+        size_t n = std::min<size_t>(len, sizeof(buffer));
+        if (esp_partition_read(source_, source_cursor_, buffer, n) != ESP_OK || !Output(buffer, n)) {
+            return false;
+        }
+        source_cursor_ += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool OtaDeltaDecoder::CopyWindow(uint32_t distance, uint32_t len) {
+    if (distance == 0 || distance > OTA_DELTA_WINDOW_SIZE || distance > output_size_) {
+        ESP_LOGE(TAG, "Invalid window distance %lu", distance);
+        return false;
+    }
+
+    // The copy may overlap its own output, so go at most one distance at a time
+    uint8_t buffer[512];
+    while (len > 0) {
+        size_t n = std::min<size_t>({len, distance, sizeof(buffer)});
+        size_t from = (output_size_ - distance) % OTA_DELTA_WINDOW_SIZE;
+        size_t first = std::min(n, OTA_DELTA_WINDOW_SIZE - from);
+        memcpy(buffer, window_ + from, first);
+        memcpy(buffer + first, window_, n - first);
+        if (!Output(buffer, n)) {
+            return false;
+        }
+        len -= n;
+    }
+    return true;
+}
+
+bool OtaDeltaDecoder::Output(const uint8_t* data, size_t len) {
+    if (output_size_ + len > header_.target_size) {
+        ESP_LOGE(TAG, "Output exceeds target size %lu", header_.target_size);
+        failed_ = true;
+        return false;
+    }
+    mbedtls_sha256_update(&sha256_, data, len);
+
+    // The window is a ring indexed by the output position
+    for (size_t done = 0; done < len;) {
+        size_t at = (output_size_ + done) % OTA_DELTA_WINDOW_SIZE;
+        size_t n = std::min(len - done, OTA_DELTA_WINDOW_SIZE - at);
+        memcpy(window_ + at, data + done, n);
+        done += n;
+    }
+    output_size_ += len;
+
+    while (len > 0) {
+        if (buffer_ == nullptr) {
+            buffer_ = writer_.Acquire();
+            if (buffer_ == nullptr) {
+                failed_ = true;
+                return false;
+            }
+        }
+        size_t n = std::min(len, writer_.buffer_size() - buffer_->len);
+        memcpy(buffer_->data + buffer_->len, data, n);
+        buffer_->len += n;
+        data += n;
+        len -= n;
+        if (buffer_->len == writer_.buffer_size()) {
+            writer_.Submit(buffer_);
+            buffer_ = nullptr;
+        }
+    }
+    return true;
+}
+
+bool OtaDeltaDecoder::Finish() {
+    if (buffer_ != nullptr) {
+        writer_.Submit(buffer_);
+        buffer_ = nullptr;
+    }
+    if (failed_ || !done_ || literal_remaining_ > 0 || output_size_ != header_.target_size) {
+        ESP_LOGE(TAG, "Incomplete image, %u of %lu bytes", output_size_, header_.target_size);
+        return false;
+    }
+
+    uint8_t hash[32];
+    mbedtls_sha256_finish(&sha256_, hash);
+    if (memcmp(hash, header_.target_sha256, sizeof(hash)) != 0) {
+        ESP_LOGE(TAG, "Image hash mismatch");
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,72 @@
+#ifndef OTA_DELTA_H
+#define OTA_DELTA_H
+
+#include <esp_partition.h>
+#include <mbedtls/sha256.h>
+
+#include <cstdint>
+#include <cstddef>
+
+#include "partition_writer.h"
+
+// Format written by scripts/ota_delta.py, see there for the operations
+#define OTA_DELTA_MAGIC "XZD1"
+#define OTA_DELTA_FLAG_HAS_SOURCE 1
+#define OTA_DELTA_WINDOW_SIZE (32 * 1024)
+
+struct OtaDeltaHeader {
+    char magic[4];
+    uint32_t flags;
+    uint32_t target_size;
+    uint32_t source_size;
+    uint8_t target_sha256[32];
+    uint8_t source_sha256[32];
+};
+static_assert(sizeof(OtaDeltaHeader) == 80, "OtaDeltaHeader must match the file header");
+
+/*
+ * Rebuilds a firmware image from a compressed image or a patch against the running firmware
+ * while it is downloaded. Feed() accepts the stream in chunks of any size, the output goes to
+ * a PartitionWriter, and RAM use is bounded by the 32KB back-reference window.
+ */
+class OtaDeltaDecoder {
+public:
+    OtaDeltaDecoder(PartitionWriter& writer);
+    ~OtaDeltaDecoder();
+
+    static bool IsDeltaImage(const uint8_t* data, size_t len);
+
+    // Checks the header and, for a patch, that the running firmware is its source
+    bool Begin(const OtaDeltaHeader& header, const esp_partition_t* target_partition);
+    bool Feed(const uint8_t* data, size_t len);
+    // Checks that the image is complete and matches the SHA-256 of the header
+    bool Finish();
+
+    size_t output_size() const { return output_size_; }
+
+private:
+    PartitionWriter& writer_;
+    OtaDeltaHeader header_;
+    const esp_partition_t* source_ = nullptr;
+    mbedtls_sha256_context sha256_;
+
+    uint8_t* window_ = nullptr;
+    size_t output_size_ = 0;
+    uint32_t source_cursor_ = 0;
+    PartitionWriterBuffer* buffer_ = nullptr;
+
+    // An operation and its varints are collected here when they span two Feed() calls
+    uint8_t op_[16];
+    size_t op_len_ = 0;
+    uint32_t literal_remaining_ = 0;
+    bool done_ = false;
+    bool failed_ = false;
+
+    bool ParseOp();
+    bool CopySource(int32_t delta, uint32_t len);
+    bool CopyWindow(uint32_t distance, uint32_t len);
+    bool Output(const uint8_t* data, size_t len);
+    bool VerifySource();
+};
+
+#endif // OTA_DELTA_H
@@ -0,0 +1,142 @@
+#include "partition_writer.h"
+
+#include <esp_log.h>
+#include <esp_heap_caps.h>
+
+#define TAG "PartitionWriter"
+
+PartitionWriter::PartitionWriter(const esp_partition_t* partition) : partition_(partition) {
+    buffer_count_ = PARTITION_WRITER_BUFFER_COUNT;
+    buffer_size_ = PARTITION_WRITER_BUFFER_SIZE;
+    uint32_t caps = MALLOC_CAP_SPIRAM;
+    if (heap_caps_get_free_size(MALLOC_CAP_SPIRAM) < buffer_count_ * buffer_size_ * 2) {
+        buffer_count_ = PARTITION_WRITER_INTERNAL_BUFFER_COUNT;
+        buffer_size_ = PARTITION_WRITER_INTERNAL_BUFFER_SIZE;
+        caps = MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT;
+    }
+
+    buffers_ = new PartitionWriterBuffer[buffer_count_];
+    free_queue_ = xQueueCreate(buffer_count_, sizeof(PartitionWriterBuffer*));
+    write_queue_ = xQueueCreate(buffer_count_, sizeof(PartitionWriterBuffer*));
+    for (int i = 0; i < buffer_count_; i++) {
+        buffers_[i].data = (uint8_t*)heap_caps_malloc(buffer_size_, caps);
+        buffers_[i].len = 0;
+        if (buffers_[i].data == nullptr) {
+            ESP_LOGE(TAG, "Failed to allocate buffer %d of %u bytes", i, buffer_size_);
+            failed_ = true;
+            continue;
+        }
+        auto buffer = &buffers_[i];
+        xQueueSend(free_queue_, &buffer, 0);
+    }
+
+    xTaskCreate([](void* arg) {
+        auto writer = (PartitionWriter*)arg;
+        writer->WriterTask();
+    }, "partition_writer", 4096, this, 4, &writer_task_);
+}
+
+PartitionWriter::~PartitionWriter() {
+    Flush();
+    if (writer_task_ != nullptr) {
+        vTaskDelete(writer_task_);
+    }
+    vQueueDelete(free_queue_);
+    vQueueDelete(write_queue_);
+    for (int i = 0; i < buffer_count_; i++) {
+        heap_caps_free(buffers_[i].data);
+    }
+    delete[] buffers_;
+}
+
+bool PartitionWriter::Begin(size_t offset) {
+    Flush();
+    const size_t sector_size = esp_partition_get_main_flash_sector_size();
+    if (offset % sector_size != 0 || offset > partition_->size) {
+        ESP_LOGE(TAG, "Invalid start offset %u", offset);
+        return false;
+    }
+    written_ = offset;
+    erased_end_ = offset;
+    failed_ = false;
+    for (int i = 0; i < buffer_count_; i++) {
+        if (buffers_[i].data == nullptr) {
+            failed_ = true;
+        }
+    }
+    return !failed_;
+}
+
+PartitionWriterBuffer* PartitionWriter::Acquire() {
+    PartitionWriterBuffer* buffer = nullptr;
+    while (!failed_) {
+        if (xQueueReceive(free_queue_, &buffer, pdMS_TO_TICKS(100)) == pdTRUE) {
+            buffer->len = 0;
+            return buffer;
+        }
+    }
+    return nullptr;
+}
+
+void PartitionWriter::Submit(PartitionWriterBuffer* buffer) {
+    if (buffer->len == 0 || failed_) {
+        xQueueSend(free_queue_, &buffer, portMAX_DELAY);
+        return;
+    }
+    pending_++;
+    xQueueSend(write_queue_, &buffer, portMAX_DELAY);
+}
+
+bool PartitionWriter::Flush() {
+    while (pending_ > 0) {
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return !failed_;
+}
+
+void PartitionWriter::WriterTask() {
+    PartitionWriterBuffer* buffer = nullptr;
+    while (true) {
+        xQueueReceive(write_queue_, &buffer, portMAX_DELAY);
+        // After a failure the remaining buffers are only drained
+        if (!failed_ && !Write(buffer)) {
+            failed_ = true;
+        }
+        xQueueSend(free_queue_, &buffer, portMAX_DELAY);
+        if (!failed_ && on_written_) {
+            on_written_(written_);
+        }
+        pending_--;
+    }
+}
+
+bool PartitionWriter::Write(const PartitionWriterBuffer* buffer) {
+    size_t offset = written_;
+    size_t end = offset + buffer->len;
+    if (end > partition_->size) {
+        ESP_LOGE(TAG, "Write end (%u) exceeds partition size (%lu)", end, partition_->size);
+        return false;
+    }
+
+    // Erase ahead of the data in whole blocks, which the flash erases faster than single sectors
+    if (end > erased_end_) {
+        size_t erase_end = (end + PARTITION_WRITER_ERASE_BLOCK_SIZE - 1) / PARTITION_WRITER_ERASE_BLOCK_SIZE * PARTITION_WRITER_ERASE_BLOCK_SIZE;
+        if (erase_end > partition_->size) {
+            erase_end = partition_->size;
+        }
+        esp_err_t err = esp_partition_erase_range(partition_, erased_end_, erase_end - erased_end_);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Failed to erase 0x%x-0x%x: %s", erased_end_, erase_end, esp_err_to_name(err));
+            return false;
+        }
+        erased_end_ = erase_end;
+    }
+
+    esp_err_t err = esp_partition_write(partition_, offset, buffer->data, buffer->len);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write at offset %u: %s", offset, esp_err_to_name(err));
+        return false;
+    }
+    written_ = end;
+    return true;
+}
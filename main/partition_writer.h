@@ -0,0 +1,79 @@
+#ifndef PARTITION_WRITER_H
+#define PARTITION_WRITER_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/task.h>
+#include <esp_partition.h>
+
+#include <atomic>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#define PARTITION_WRITER_BUFFER_SIZE (16 * 1024)
+#define PARTITION_WRITER_BUFFER_COUNT 4
+// Without PSRAM the pool falls back to a smaller one in internal RAM
+#define PARTITION_WRITER_INTERNAL_BUFFER_SIZE (4 * 1024)
+#define PARTITION_WRITER_INTERNAL_BUFFER_COUNT 2
+// Erase granularity ahead of the data, a multiple of the flash sector size
+#define PARTITION_WRITER_ERASE_BLOCK_SIZE (64 * 1024)
+// Flash encryption writes whole 16 or 32 byte blocks depending on the chip, a write cut short by an error
+// keeps only whole blocks so the next one starts aligned
+#define PARTITION_WRITER_WRITE_ALIGN 32
+
+struct PartitionWriterBuffer {
+    uint8_t* data;
+    size_t len;
+};
+
+/*
+ * Writes a sequential stream into a flash partition from a background task.
+ *
+ * The producer fills buffers taken from a fixed pool with Acquire() and hands them back with
+ * Submit(), so the network keeps receiving while the previous buffers are erased and written.
+ * Flash is erased ahead of the data in 64KB blocks, starting from the offset given to Begin(),
+ * which lets a download resume in a partition that already holds the first part of the image.
+ */
+class PartitionWriter {
+public:
+    PartitionWriter(const esp_partition_t* partition);
+    ~PartitionWriter();
+
+    // Starts writing at a sector aligned offset, waits for pending writes of a previous run
+    bool Begin(size_t offset);
+    // Blocks until a free buffer is available, returns nullptr if writing has failed
+    PartitionWriterBuffer* Acquire();
+    // Queues the buffer for writing, an empty buffer is returned to the pool
+    void Submit(PartitionWriterBuffer* buffer);
+    // Waits for the queued buffers, returns false if any write failed
+    bool Flush();
+
+    // Bytes written to flash since offset 0
+    size_t written() const { return written_; }
+    size_t buffer_size() const { return buffer_size_; }
+    bool failed() const { return failed_; }
+
+    // Called from the writer task after every write, e.g. to persist a checkpoint
+    void OnWritten(std::function<void(size_t written)> callback) { on_written_ = callback; }
+
+private:
+    const esp_partition_t* partition_;
+    PartitionWriterBuffer* buffers_ = nullptr;
+    int buffer_count_ = 0;
+    size_t buffer_size_ = 0;
+    QueueHandle_t free_queue_ = nullptr;
+    QueueHandle_t write_queue_ = nullptr;
+    TaskHandle_t writer_task_ = nullptr;
+    std::atomic<int> pending_ = 0;
+
+    std::atomic<size_t> written_ = 0;
+    size_t erased_end_ = 0;
+    std::atomic<bool> failed_ = false;
+    std::function<void(size_t written)> on_written_;
+
+    void WriterTask();
+    bool Write(const PartitionWriterBuffer* buffer);
+};
+
+#endif // PARTITION_WRITER_H
@@ -0,0 +1,53 @@
+#include "audio_packet_pool.h"
+
+#include <esp_log.h>
+
+#define TAG "AudioPacketPool"
+
+AudioPacketPool::AudioPacketPool() {
+    // Packets are allocated on first use, so boards that never stream audio pay nothing
+    free_packets_.reserve(AUDIO_PACKET_POOL_SIZE);
+}
+
+std::unique_ptr<AudioStreamPacket> AudioPacketPool::Allocate() {
+    auto packet = std::make_unique<AudioStreamPacket>();
+    packet->payload.reserve(AUDIO_PACKET_SLAB_SIZE);
+    allocations_++;
+    return packet;
+}
+
+std::unique_ptr<AudioStreamPacket> AudioPacketPool::Acquire() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!free_packets_.empty()) {
+            auto packet = std::move(free_packets_.back());
+            free_packets_.pop_back();
+            return packet;
+        }
+    }
+    ESP_LOGD(TAG, "Pool exhausted, allocating a new packet");
+    return Allocate();
+}
+
+void AudioPacketPool::Release(std::unique_ptr<AudioStreamPacket> packet) {
+    if (!packet) {
+        return;
+    }
+    packet->sample_rate = 0;
+    packet->frame_duration = 0;
+    packet->timestamp = 0;
+    packet->trace_id = 0;
+    packet->payload.clear();
+    // The payload may have been moved out or grown past the slab, only keep slab sized buffers
+    if (packet->payload.capacity() < AUDIO_PACKET_SLAB_SIZE) {
+        packet->payload.reserve(AUDIO_PACKET_SLAB_SIZE);
+    } else if (packet->payload.capacity() > AUDIO_PACKET_SLAB_SIZE * 2) {
+        std::vector<uint8_t>().swap(packet->payload);
+        packet->payload.reserve(AUDIO_PACKET_SLAB_SIZE);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (free_packets_.size() < AUDIO_PACKET_POOL_SIZE) {
+        free_packets_.push_back(std::move(packet));
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef AUDIO_PACKET_POOL_H
+#define AUDIO_PACKET_POOL_H
+
+#include "protocol.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Payload capacity reserved for every pooled packet, enough for a 60ms Opus frame at 24kHz
+#define AUDIO_PACKET_SLAB_SIZE 512
+// Enough to cover a full decode queue plus the packets in flight
+#define AUDIO_PACKET_POOL_SIZE 48
+
+/*
+ * Recycles AudioStreamPacket objects together with their payload buffers, so a long TTS stream
+ * does not malloc/free a packet and a payload for every frame.
+ *
+ * Packets are plain std::unique_ptr<AudioStreamPacket>, a packet that is never released back
+ * is simply freed, so call sites that do not care about pooling keep working.
+ */
+class AudioPacketPool {
+public:
+    static AudioPacketPool& GetInstance() {
+        static AudioPacketPool instance;
+        return instance;
+    }
+
+    std::unique_ptr<AudioStreamPacket> Acquire();
+    void Release(std::unique_ptr<AudioStreamPacket> packet);
+
+    // Number of packets that had to be allocated because the pool was empty
+    uint32_t allocations() const { return allocations_; }
+
+private:
+    AudioPacketPool();
+    AudioPacketPool(const AudioPacketPool&) = delete;
+    AudioPacketPool& operator=(const AudioPacketPool&) = delete;
+
+    std::unique_ptr<AudioStreamPacket> Allocate();
+
+    std::mutex mutex_;
+    std::vector<std::unique_ptr<AudioStreamPacket>> free_packets_;
+    std::atomic<uint32_t> allocations_ = 0;
+};
+
+#endif // AUDIO_PACKET_POOL_H
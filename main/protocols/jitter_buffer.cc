@@ -0,0 +1,159 @@
+#include "jitter_buffer.h"
+#include "audio_packet_pool.h"
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <cmath>
+#include <algorithm>
+
+#define TAG "JitterBuffer"
+
+// Sequence numbers wrap around, compare them by signed distance
+static inline int32_t SequenceDistance(uint32_t a, uint32_t b) {
+    return static_cast<int32_t>(a - b);
+}
+
+void JitterBuffer::Reset(int sample_rate, int frame_duration) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+        slot.reset();
+    }
+    statistics_ = JitterBufferStatistics();
+    sample_rate_ = sample_rate;
+    frame_duration_ = frame_duration;
+    target_depth_ = JITTER_BUFFER_MIN_DEPTH;
+    buffered_ = 0;
+    concealed_run_ = 0;
+    started_ = false;
+    next_sequence_ = 0;
+    highest_sequence_ = 0;
+    jitter_ms_ = 0;
+    has_last_arrival_ = false;
+}
+
+void JitterBuffer::UpdateJitter(uint32_t sequence) {
+    int64_t now = esp_timer_get_time();
+    if (has_last_arrival_ && SequenceDistance(sequence, last_arrival_sequence_) > 0) {
+        float arrival_delta = (now - last_arrival_us_) / 1000.0f;
+        float expected_delta = SequenceDistance(sequence, last_arrival_sequence_) * frame_duration_;
+        jitter_ms_ += (std::fabs(arrival_delta - expected_delta) - jitter_ms_) / 16.0f;
+
+        int depth = 1 + static_cast<int>(std::ceil(2.0f * jitter_ms_ / frame_duration_));
+        target_depth_ = std::clamp(depth, JITTER_BUFFER_MIN_DEPTH, JITTER_BUFFER_MAX_DEPTH);
+    }
+    if (!has_last_arrival_ || SequenceDistance(sequence, last_arrival_sequence_) > 0) {
+        has_last_arrival_ = true;
+        last_arrival_us_ = now;
+        last_arrival_sequence_ = sequence;
+    }
+}
+
+void JitterBuffer::Put(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    statistics_.received++;
+    if (frame_duration_ > 0) {
+        UpdateJitter(sequence);
+    }
+
+    if (buffered_ == 0 && !started_) {
+        next_sequence_ = sequence;
+        highest_sequence_ = sequence;
+    } else if (SequenceDistance(sequence, next_sequence_) < 0) {
+        if (started_ || SequenceDistance(highest_sequence_, sequence) >= JITTER_BUFFER_SLOTS) {
+            statistics_.late++;
+            ESP_LOGD(TAG, "Late packet: %lu, playing: %lu", sequence, next_sequence_);
+            return;
+        }
+        // Still buffering, an earlier packet arrived after a later one
+        next_sequence_ = sequence;
+    }
+
+    // Keep the window in range if the sender bursts far ahead, dropping the oldest packets
+    while (SequenceDistance(sequence, next_sequence_) >= JITTER_BUFFER_SLOTS) {
+        auto& slot = slots_[next_sequence_ % JITTER_BUFFER_SLOTS];
+        if (slot && slot_sequences_[next_sequence_ % JITTER_BUFFER_SLOTS] == next_sequence_) {
+            slot.reset();
+            buffered_--;
+        }
+        next_sequence_++;
+    }
+
+    auto index = sequence % JITTER_BUFFER_SLOTS;
+    if (slots_[index] && slot_sequences_[index] == sequence) {
+        statistics_.duplicated++;
+        return;
+    }
+    if (SequenceDistance(sequence, highest_sequence_) < 0) {
+        statistics_.reordered++;
+    } else {
+        highest_sequence_ = sequence;
+    }
+    if (!slots_[index]) {
+        buffered_++;
+    }
+    slots_[index] = std::move(packet);
+    slot_sequences_[index] = sequence;
+}
+
+bool JitterBuffer::FindOldestBuffered(uint32_t& sequence) const {
+    for (uint32_t i = 0; i < JITTER_BUFFER_SLOTS; i++) {
+        uint32_t candidate = next_sequence_ + i;
+        auto index = candidate % JITTER_BUFFER_SLOTS;
+        if (slots_[index] && slot_sequences_[index] == candidate) {
+            sequence = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void JitterBuffer::Tick(const std::function<void(std::unique_ptr<AudioStreamPacket>)>& output) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!started_) {
+        if (buffered_ == 0 || buffered_ < target_depth_) {
+            return;
+        }
+        started_ = true;
+    }
+
+    if (buffered_ == 0) {
+        // Either the stream ended or the network stalled, rebuffer before playing again
+        statistics_.underruns++;
+        started_ = false;
+        concealed_run_ = 0;
+        return;
+    }
+
+    // Normally one frame per tick, release the surplus at once when the sender runs ahead
+    int release = 1 + std::max(0, buffered_ - target_depth_);
+    while (release > 0 && buffered_ > 0) {
+        auto index = next_sequence_ % JITTER_BUFFER_SLOTS;
+        if (slots_[index] && slot_sequences_[index] == next_sequence_) {
+            output(std::move(slots_[index]));
+            buffered_--;
+            concealed_run_ = 0;
+        } else if (concealed_run_ < JITTER_BUFFER_MAX_CONCEALED_FRAMES) {
+            auto packet = AudioPacketPool::GetInstance().Acquire();
+            packet->sample_rate = sample_rate_;
+            packet->frame_duration = frame_duration_;
+            output(std::move(packet));
+            statistics_.concealed++;
+            concealed_run_++;
+        } else {
+            // Too many frames lost in a row, concealment would only produce noise
+            uint32_t oldest;
+            if (FindOldestBuffered(oldest)) {
+                next_sequence_ = oldest;
+            }
+            concealed_run_ = 0;
+            continue;
+        }
+        next_sequence_++;
+        release--;
+    }
+}
+
+JitterBufferStatistics JitterBuffer::statistics() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return statistics_;
+}
@@ -0,0 +1,69 @@
+#ifndef JITTER_BUFFER_H
+#define JITTER_BUFFER_H
+
+#include "protocol.h"
+
+#include <array>
+#include <memory>
+#include <mutex>
+#include <functional>
+
+#define JITTER_BUFFER_SLOTS 64
+#define JITTER_BUFFER_MIN_DEPTH 1
+#define JITTER_BUFFER_MAX_DEPTH 8
+#define JITTER_BUFFER_MAX_CONCEALED_FRAMES 3
+
+struct JitterBufferStatistics {
+    uint32_t received = 0;
+    uint32_t late = 0;
+    uint32_t duplicated = 0;
+    uint32_t reordered = 0;
+    uint32_t concealed = 0;
+    uint32_t underruns = 0;
+};
+
+/*
+ * Reorders incoming audio packets by sequence number and releases them once per frame
+ * duration after holding a target depth of frames. The target depth follows the measured
+ * inter-arrival jitter (RFC 3550 estimator), so it grows on a congested link and shrinks
+ * back when the link is stable.
+ *
+ * A packet that is still missing at its playout time is replaced by a packet with an empty
+ * payload, which the Opus decoder turns into packet loss concealment.
+ */
+class JitterBuffer {
+public:
+    void Reset(int sample_rate, int frame_duration);
+    void Put(uint32_t sequence, std::unique_ptr<AudioStreamPacket> packet);
+    // Called once per frame duration, hands the packets due for playout to output
+    void Tick(const std::function<void(std::unique_ptr<AudioStreamPacket>)>& output);
+
+    JitterBufferStatistics statistics();
+    int target_depth() const { return target_depth_; }
+
+private:
+    std::mutex mutex_;
+    std::array<std::unique_ptr<AudioStreamPacket>, JITTER_BUFFER_SLOTS> slots_;
+    std::array<uint32_t, JITTER_BUFFER_SLOTS> slot_sequences_ = {};
+    JitterBufferStatistics statistics_;
+
+    int sample_rate_ = 0;
+    int frame_duration_ = 0;
+    int target_depth_ = JITTER_BUFFER_MIN_DEPTH;
+    int buffered_ = 0;
+    int concealed_run_ = 0;
+    bool started_ = false;
+    uint32_t next_sequence_ = 0;
+    uint32_t highest_sequence_ = 0;
+
+    // Inter-arrival jitter estimate in milliseconds
+    float jitter_ms_ = 0;
+    bool has_last_arrival_ = false;
+    int64_t last_arrival_us_ = 0;
+    uint32_t last_arrival_sequence_ = 0;
+
+    void UpdateJitter(uint32_t sequence);
+    bool FindOldestBuffered(uint32_t& sequence) const;
+};
+
+#endif // JITTER_BUFFER_H
@@ -0,0 +1,264 @@
+#include "json_envelope.h"
+
+#include <iterator>
+
+static constexpr JsonKeyword<JsonEnvelopeField> kEnvelopeFields[] = {
+    {"type", kJsonFieldType},
+    {"state", kJsonFieldState},
+    {"text", kJsonFieldText},
+    {"emotion", kJsonFieldEmotion},
+    {"session_id", kJsonFieldSessionId},
+    {"command", kJsonFieldCommand},
+    {"status", kJsonFieldStatus},
+    {"message", kJsonFieldMessage},
+};
+static constexpr JsonKeywordTable<JsonEnvelopeField, std::size(kEnvelopeFields)> kEnvelopeFieldTable(kEnvelopeFields);
+static_assert(kEnvelopeFieldTable.perfect(), "Envelope fields need a perfect hash");
+
+static inline void SkipWhitespace(char*& pos, char* end) {
+    while (pos < end && (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r')) {
+        pos++;
+    }
+}
+
+static int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static bool ParseHex4(const char* pos, const char* end, uint32_t& value) {
+    if (end - pos < 4) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < 4; i++) {
+        int digit = HexValue(pos[i]);
+        if (digit < 0) {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+    return true;
+}
+
+JsonEnvelope::~JsonEnvelope() {
+    Clear();
+}
+
+void JsonEnvelope::Clear() {
+    if (root_ != nullptr) {
+        cJSON_Delete(root_);
+        root_ = nullptr;
+    }
+}
+
+const cJSON* JsonEnvelope::root() const {
+    if (root_ == nullptr && data_ != nullptr) {
+        root_ = cJSON_Parse(data_);
+    }
+    return root_;
+}
+
+bool JsonEnvelope::Parse(const char* data, size_t len) {
+    Clear();
+    data_ = data;
+    for (auto& field : fields_) {
+        field = nullptr;
+    }
+    // assign() keeps the capacity of earlier messages
+    buffer_.assign(data, len);
+    if (!Tokenize(buffer_.data(), buffer_.data() + len)) {
+        // A malformed message has no envelope, even if some fields came before the error
+        for (auto& field : fields_) {
+            field = nullptr;
+        }
+        return false;
+    }
+    return true;
+}
+
+bool JsonEnvelope::Tokenize(char* pos, char* end) {
+    SkipWhitespace(pos, end);
+    if (pos == end || *pos++ != '{') {
+        return false;
+    }
+    SkipWhitespace(pos, end);
+    if (pos < end && *pos == '}') {
+        return true;
+    }
+    while (pos < end) {
+        char* key;
+        size_t key_len;
+        SkipWhitespace(pos, end);
+        if (pos == end || *pos != '"' || !ParseString(pos, end, key, key_len)) {
+            return false;
+        }
+        SkipWhitespace(pos, end);
+        if (pos == end || *pos++ != ':') {
+            return false;
+        }
+        SkipWhitespace(pos, end);
+        if (pos == end) {
+            return false;
+        }
+        if (*pos == '"') {
+            char* value;
+            size_t value_len;
+            if (!ParseString(pos, end, value, value_len)) {
+                return false;
+            }
+            auto field = kEnvelopeFieldTable.Find(key, key_len, kJsonFieldUnknown);
+            // Like cJSON_GetObjectItem, the first of duplicate keys wins
+            if (field != kJsonFieldUnknown && fields_[field] == nullptr) {
+                fields_[field] = value;
+            }
+        } else if (!SkipValue(pos, end)) {
+            return false;
+        }
+        SkipWhitespace(pos, end);
+        if (pos == end) {
+            return false;
+        }
+        char c = *pos++;
+        if (c == '}') {
+            return true;
+        }
+        if (c != ',') {
+            return false;
+        }
+    }
+    return false;
+}
+
+// Unescapes the string at pos in place and null terminates it, pos is left after the closing quote
+bool JsonEnvelope::ParseString(char*& pos, char* end, char*& str, size_t& len) {
+    char* read = pos + 1;
+    char* write = read;
+    str = write;
+    while (read < end) {
+        char c = *read++;
+        if (c == '"') {
+            // The output is never longer than the input, so the terminator fits before the quote
+            *write = '\0';
+            len = write - str;
+            pos = read;
+            return true;
+        }
+        if ((uint8_t)c < 0x20) {
+            return false;
+        }
+        if (c != '\\') {
+            *write++ = c;
+            continue;
+        }
+        if (read == end) {
+            return false;
+        }
+        c = *read++;
+        switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            *write++ = c;
+            break;
+        case 'b':
+            *write++ = '\b';
+            break;
+        case 'f':
+            *write++ = '\f';
+            break;
+        case 'n':
+            *write++ = '\n';
+            break;
+        case 'r':
+            *write++ = '\r';
+            break;
+        case 't':
+            *write++ = '\t';
+            break;
+        case 'u': {
+            uint32_t code;
+            if (!ParseHex4(read, end, code)) {
+                return false;
+            }
+            read += 4;
+            if (code >= 0xD800 && code <= 0xDBFF) {
+                uint32_t low;
+                if (end - read < 6 || read[0] != '\\' || read[1] != 'u' || !ParseHex4(read + 2, end, low) ||
+                    low < 0xDC00 || low > 0xDFFF) {
+                    return false;
+                }
+                read += 6;
+                code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+            } else if (code >= 0xDC00 && code <= 0xDFFF) {
+                return false;
+            }
+            if (code < 0x80) {
+                *write++ = code;
+            } else if (code < 0x800) {
+                *write++ = 0xC0 | (code >> 6);
+                *write++ = 0x80 | (code & 0x3F);
+            } else if (code < 0x10000) {
+                *write++ = 0xE0 | (code >> 12);
+                *write++ = 0x80 | ((code >> 6) & 0x3F);
+                *write++ = 0x80 | (code & 0x3F);
+            } else {
+                *write++ = 0xF0 | (code >> 18);
+                *write++ = 0x80 | ((code >> 12) & 0x3F);
+                *write++ = 0x80 | ((code >> 6) & 0x3F);
+                *write++ = 0x80 | (code & 0x3F);
+            }
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+    return false;
+}
+
+// Skips a number, literal, object or array, nested values are only checked for balance
+bool JsonEnvelope::SkipValue(char*& pos, char* end) {
+    int depth = 0;
+    while (pos < end) {
+        char c = *pos;
+        if (c == '"') {
+            // Brackets inside strings do not count
+            pos++;
+            while (pos < end && *pos != '"') {
+                if (*pos == '\\') {
+                    pos++;
+                }
+                pos++;
+            }
+            if (pos >= end) {
+                return false;
+            }
+            pos++;
+            continue;
+        }
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (depth == 0) {
+                return true;
+            }
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            return true;
+        }
+        pos++;
+        if (depth == 0 && (c == '}' || c == ']')) {
+            return true;
+        }
+    }
+    return depth == 0;
+}
@@ -0,0 +1,147 @@
+#ifndef JSON_ENVELOPE_H
+#define JSON_ENVELOPE_H
+
+#include <cJSON.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+
+// Slots of a JsonKeywordTable, a power of two comfortably above the number of keywords
+#define JSON_KEYWORD_SLOTS 32
+
+template <typename T>
+struct JsonKeyword {
+    const char* name;
+    T value;
+};
+
+// FNV-1a, seeded so that a table can search for a seed without collisions
+constexpr uint32_t JsonKeywordHash(const char* str, size_t len, uint32_t seed) {
+    uint32_t hash = seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (uint8_t)str[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*
+ * A perfect hash table of keywords, built at compile time. Looking up a string costs one hash
+ * and one compare instead of a strcmp per keyword. Define tables as constexpr and check them
+ * with static_assert(table.perfect()).
+ */
+template <typename T, size_t N>
+class JsonKeywordTable {
+public:
+    constexpr JsonKeywordTable(const JsonKeyword<T> (&keywords)[N]) {
+        static_assert(N <= JSON_KEYWORD_SLOTS / 2, "Too many keywords");
+        for (size_t i = 0; i < N; i++) {
+            keywords_[i] = keywords[i];
+            lengths_[i] = std::char_traits<char>::length(keywords[i].name);
+        }
+        for (uint32_t seed = 2166136261u; seed < 2166136261u + 1024; seed++) {
+            if (TrySeed(seed)) {
+                seed_ = seed;
+                perfect_ = true;
+                return;
+            }
+        }
+    }
+
+    constexpr bool perfect() const { return perfect_; }
+
+    T Find(const char* str, size_t len, T not_found) const {
+        int index = slots_[JsonKeywordHash(str, len, seed_) & (JSON_KEYWORD_SLOTS - 1)];
+        if (index >= 0 && lengths_[index] == len && memcmp(keywords_[index].name, str, len) == 0) {
+            return keywords_[index].value;
+        }
+        return not_found;
+    }
+
+    T Find(const char* str, T not_found) const {
+        return str != nullptr ? Find(str, strlen(str), not_found) : not_found;
+    }
+
+private:
+    JsonKeyword<T> keywords_[N] = {};
+    size_t lengths_[N] = {};
+    int8_t slots_[JSON_KEYWORD_SLOTS] = {};
+    uint32_t seed_ = 0;
+    bool perfect_ = false;
+
+    constexpr bool TrySeed(uint32_t seed) {
+        for (auto& slot : slots_) {
+            slot = -1;
+        }
+        for (size_t i = 0; i < N; i++) {
+            auto& slot = slots_[JsonKeywordHash(keywords_[i].name, lengths_[i], seed) & (JSON_KEYWORD_SLOTS - 1)];
+            if (slot >= 0) {
+                return false;
+            }
+            slot = i;
+        }
+        return true;
+    }
+};
+
+enum JsonEnvelopeField {
+    kJsonFieldType,
+    kJsonFieldState,
+    kJsonFieldText,
+    kJsonFieldEmotion,
+    kJsonFieldSessionId,
+    kJsonFieldCommand,
+    kJsonFieldStatus,
+    kJsonFieldMessage,
+    kJsonFieldCount,
+    kJsonFieldUnknown = kJsonFieldCount,
+};
+
+/*
+ * The top level string fields of a server message, read in a single pass without building a
+ * cJSON tree. The strings are unescaped in place in a buffer that is kept across messages, so a
+ * stream of small TTS messages does not allocate.
+ *
+ * Messages that need more than the envelope, like mcp payloads, get the full tree from root(),
+ * which parses the original data on first use. The data passed to Parse() must stay valid and
+ * null terminated until the message has been handled.
+ */
+class JsonEnvelope {
+public:
+    JsonEnvelope() = default;
+    ~JsonEnvelope();
+    JsonEnvelope(const JsonEnvelope&) = delete;
+    JsonEnvelope& operator=(const JsonEnvelope&) = delete;
+
+    // Returns false if data is not a JSON object
+    bool Parse(const char* data, size_t len);
+    // Frees the tree built by root()
+    void Clear();
+
+    // nullptr when the field is missing or not a string
+    inline const char* type() const { return fields_[kJsonFieldType]; }
+    inline const char* state() const { return fields_[kJsonFieldState]; }
+    inline const char* text() const { return fields_[kJsonFieldText]; }
+    inline const char* emotion() const { return fields_[kJsonFieldEmotion]; }
+    inline const char* session_id() const { return fields_[kJsonFieldSessionId]; }
+    inline const char* command() const { return fields_[kJsonFieldCommand]; }
+    inline const char* status() const { return fields_[kJsonFieldStatus]; }
+    inline const char* message() const { return fields_[kJsonFieldMessage]; }
+    inline const char* data() const { return data_; }
+
+    const cJSON* root() const;
+
+private:
+    const char* data_ = nullptr;
+    std::string buffer_;
+    const char* fields_[kJsonFieldCount] = {};
+    mutable cJSON* root_ = nullptr;
+
+    bool Tokenize(char* pos, char* end);
+    bool ParseString(char*& pos, char* end, char*& str, size_t& len);
+    bool SkipValue(char*& pos, char* end);
+};
+
+#endif // JSON_ENVELOPE_H
@@ -1,4 +1,6 @@
 #include "mqtt_protocol.h"
+#include "audio_packet_pool.h"
+#include "latency_trace.h"
 #include "board.h"
 #include "application.h"
 #include "settings.h"
@@ -28,6 +30,22 @@ MqttProtocol::MqttProtocol() {
         .arg = this,
     };
     esp_timer_create(&reconnect_timer_args, &reconnect_timer_);
+
+    esp_timer_create_args_t playout_timer_args = {
+        .callback = [](void* arg) {
+            MqttProtocol* protocol = (MqttProtocol*)arg;
+            protocol->jitter_buffer_.Tick([protocol](std::unique_ptr<AudioStreamPacket> packet) {
+                if (protocol->on_incoming_audio_ != nullptr) {
+                    protocol->on_incoming_audio_(std::move(packet));
+                }
+            });
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "udp_playout",
+        .skip_unhandled_events = true,
+    };
+    esp_timer_create(&playout_timer_args, &playout_timer_);
 }
 
 MqttProtocol::~MqttProtocol() {
@@ -36,6 +54,10 @@ MqttProtocol::~MqttProtocol() {
         esp_timer_stop(reconnect_timer_);
         esp_timer_delete(reconnect_timer_);
     }
+    if (playout_timer_ != nullptr) {
+        esp_timer_stop(playout_timer_);
+        esp_timer_delete(playout_timer_);
+    }
 
     udp_.reset();
     mqtt_.reset();
@@ -91,32 +113,31 @@ bool MqttProtocol::StartMqttClient(bool report_error) {
     });
 
     mqtt_->OnMessage([this](const std::string& topic, const std::string& payload) {
-        cJSON* root = cJSON_Parse(payload.c_str());
-        if (root == nullptr) {
+        // Only the envelope is parsed, the full tree is built when a handler asks for it
+        if (!incoming_json_.Parse(payload.c_str(), payload.size())) {
             ESP_LOGE(TAG, "Failed to parse json message %s", payload.c_str());
             return;
         }
-        cJSON* type = cJSON_GetObjectItem(root, "type");
-        if (!cJSON_IsString(type)) {
+        auto type = incoming_json_.type();
+        if (type == nullptr) {
             ESP_LOGE(TAG, "Message type is invalid");
-            cJSON_Delete(root);
             return;
         }
 
-        if (strcmp(type->valuestring, "hello") == 0) {
-            ParseServerHello(root);
-        } else if (strcmp(type->valuestring, "goodbye") == 0) {
-            auto session_id = cJSON_GetObjectItem(root, "session_id");
-            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id->valuestring : "null");
-            if (session_id == nullptr || session_id_ == session_id->valuestring) {
+        if (strcmp(type, "hello") == 0) {
+            ParseServerHello(incoming_json_.root());
+        } else if (strcmp(type, "goodbye") == 0) {
+            auto session_id = incoming_json_.session_id();
+            ESP_LOGI(TAG, "Received goodbye message, session_id: %s", session_id ? session_id : "null");
+            if (session_id == nullptr || session_id_ == session_id) {
                 Application::GetInstance().Schedule([this]() {
                     CloseAudioChannel();
                 });
             }
         } else if (on_incoming_json_ != nullptr) {
-            on_incoming_json_(root);
+            on_incoming_json_(incoming_json_);
         }
-        cJSON_Delete(root);
+        incoming_json_.Clear();
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
@@ -158,24 +179,37 @@ bool MqttProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
         return false;
     }
 
-    std::string nonce(aes_nonce_);
-    *(uint16_t*)&nonce[2] = htons(packet->payload.size());
-    *(uint32_t*)&nonce[8] = htonl(packet->timestamp);
-    *(uint32_t*)&nonce[12] = htonl(++local_sequence_);
-
-    std::string encrypted;
-    encrypted.resize(aes_nonce_.size() + packet->payload.size());
-    memcpy(encrypted.data(), nonce.data(), nonce.size());
+    if (aes_nonce_.size() != sizeof(BinaryProtocolUdp)) {
+        ESP_LOGE(TAG, "Invalid AES nonce size: %u", aes_nonce_.size());
+        return false;
+    }
 
+    // The header doubles as the AES-CTR nonce, the cipher writes straight behind it
+    udp_send_buffer_.resize(sizeof(BinaryProtocolUdp) + packet->payload.size());
+    auto header = (BinaryProtocolUdp*)udp_send_buffer_.data();
+    memcpy(header, aes_nonce_.data(), sizeof(BinaryProtocolUdp));
+    header->payload_size = htons(packet->payload.size());
+    header->timestamp = htonl(packet->timestamp);
+    header->sequence = htonl(++local_sequence_);
+
+    // mbedtls advances the counter block in place, so work on a copy of the nonce
+    uint8_t nonce_counter[sizeof(BinaryProtocolUdp)];
+    memcpy(nonce_counter, header, sizeof(nonce_counter));
     size_t nc_off = 0;
     uint8_t stream_block[16] = {0};
-    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, (uint8_t*)nonce.c_str(), stream_block,
-        (uint8_t*)packet->payload.data(), (uint8_t*)&encrypted[nonce.size()]) != 0) {
+    if (mbedtls_aes_crypt_ctr(&aes_ctx_, packet->payload.size(), &nc_off, nonce_counter, stream_block,
+        packet->payload.data(), header->payload) != 0) {
         ESP_LOGE(TAG, "Failed to encrypt audio data");
         return false;
     }
+    uint32_t trace_id = packet->trace_id;
+    AudioPacketPool::GetInstance().Release(std::move(packet));
 
-    return udp_->Send(encrypted) > 0;
+    if (udp_->Send(udp_send_buffer_) <= 0) {
+        return false;
+    }
+    AUDIO_TRACE(kTraceNetworkSent, trace_id, 0);
+    return true;
 }
 
 void MqttProtocol::CloseAudioChannel() {
@@ -183,6 +217,10 @@ void MqttProtocol::CloseAudioChannel() {
         std::lock_guard<std::mutex> lock(channel_mutex_);
         udp_.reset();
     }
+    esp_timer_stop(playout_timer_);
+    auto stats = jitter_buffer_.statistics();
+    ESP_LOGI(TAG, "Jitter buffer: received %lu, late %lu, duplicated %lu, reordered %lu, concealed %lu, underruns %lu, depth %d",
+        stats.received, stats.late, stats.duplicated, stats.reordered, stats.concealed, stats.underruns, jitter_buffer_.target_depth());
 
     std::string message = "{";
     message += "\"session_id\":\"" + session_id_ + "\",";
@@ -221,6 +259,7 @@ bool MqttProtocol::OpenAudioChannel() {
     }
 
     std::lock_guard<std::mutex> lock(channel_mutex_);
+    jitter_buffer_.Reset(server_sample_rate_, server_frame_duration_);
     auto network = Board::GetInstance().GetNetwork();
     udp_ = network->CreateUdp(2);
     udp_->OnMessage([this](const std::string& data) {
@@ -239,38 +278,38 @@ bool MqttProtocol::OpenAudioChannel() {
         }
         uint32_t timestamp = ntohl(*(uint32_t*)&data[8]);
         uint32_t sequence = ntohl(*(uint32_t*)&data[12]);
-        if (sequence < remote_sequence_) {
-            ESP_LOGW(TAG, "Received audio packet with old sequence: %lu, expected: %lu", sequence, remote_sequence_);
-            return;
-        }
-        if (sequence != remote_sequence_ + 1) {
-            ESP_LOGW(TAG, "Received audio packet with wrong sequence: %lu, expected: %lu", sequence, remote_sequence_ + 1);
-        }
 
         size_t decrypted_size = data.size() - aes_nonce_.size();
         size_t nc_off = 0;
         uint8_t stream_block[16] = {0};
         auto nonce = (uint8_t*)data.data();
         auto encrypted = (uint8_t*)data.data() + aes_nonce_.size();
-        auto packet = std::make_unique<AudioStreamPacket>();
+        auto packet = AudioPacketPool::GetInstance().Acquire();
         packet->sample_rate = server_sample_rate_;
         packet->frame_duration = server_frame_duration_;
         packet->timestamp = timestamp;
+        packet->trace_id = AUDIO_TRACE_NEW_ID();
         packet->payload.resize(decrypted_size);
         int ret = mbedtls_aes_crypt_ctr(&aes_ctx_, decrypted_size, &nc_off, nonce, stream_block, encrypted, (uint8_t*)packet->payload.data());
         if (ret != 0) {
             ESP_LOGE(TAG, "Failed to decrypt audio data, ret: %d", ret);
+            AudioPacketPool::GetInstance().Release(std::move(packet));
             return;
         }
-        if (on_incoming_audio_ != nullptr) {
-            on_incoming_audio_(std::move(packet));
+        AUDIO_TRACE(kTraceNetworkReceived, packet->trace_id, 0);
+        // Late, duplicated and out of order packets are sorted out by the jitter buffer
+        jitter_buffer_.Put(sequence, std::move(packet));
+        if (static_cast<int32_t>(sequence - remote_sequence_) > 0) {
+            remote_sequence_ = sequence;
         }
-        remote_sequence_ = sequence;
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
 
     udp_->Connect(udp_server_, udp_port_);
 
+    esp_timer_stop(playout_timer_);
+    esp_timer_start_periodic(playout_timer_, server_frame_duration_ * 1000);
+
     if (on_audio_channel_opened_ != nullptr) {
         on_audio_channel_opened_();
     }
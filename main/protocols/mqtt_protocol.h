@@ -3,6 +3,7 @@
 
 
 #include "protocol.h"
+#include "jitter_buffer.h"
 #include <mqtt.h>
 #include <udp.h>
 #include <cJSON.h>
@@ -47,6 +48,11 @@ private:
     uint32_t local_sequence_;
     uint32_t remote_sequence_;
     esp_timer_handle_t reconnect_timer_;
+    // UDP packets go through the jitter buffer, the playout timer releases them once per frame
+    JitterBuffer jitter_buffer_;
+    esp_timer_handle_t playout_timer_ = nullptr;
+    // Reused for framing outgoing audio, guarded by channel_mutex_
+    std::string udp_send_buffer_;
 
     bool StartMqttClient(bool report_error=false);
     void ParseServerHello(const cJSON* root);
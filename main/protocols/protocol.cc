@@ -4,7 +4,7 @@
 
 #define TAG "Protocol"
 
-void Protocol::OnIncomingJson(std::function<void(const cJSON* root)> callback) {
+void Protocol::OnIncomingJson(std::function<void(const JsonEnvelope& message)> callback) {
     on_incoming_json_ = callback;
 }
 
@@ -1,6 +1,8 @@
 #ifndef PROTOCOL_H
 #define PROTOCOL_H
 
+#include "json_envelope.h"
+
 #include <cJSON.h>
 #include <string>
 #include <functional>
@@ -11,6 +13,8 @@ struct AudioStreamPacket {
     int sample_rate = 0;
     int frame_duration = 0;
     uint32_t timestamp = 0;
+    // Follows the frame through the pipeline when latency tracing is enabled, 0 otherwise
+    uint32_t trace_id = 0;
     std::vector<uint8_t> payload;
 };
 
@@ -30,6 +34,17 @@ struct BinaryProtocol3 {
     uint8_t payload[];
 } __attribute__((packed));
 
+// UDP audio packet, the header is also the AES-CTR nonce of the encrypted payload
+struct BinaryProtocolUdp {
+    uint8_t type;
+    uint8_t flags;
+    uint16_t payload_size;
+    uint32_t ssrc;
+    uint32_t timestamp;
+    uint32_t sequence;
+    uint8_t payload[];
+} __attribute__((packed));
+
 enum AbortReason {
     kAbortReasonNone,
     kAbortReasonWakeWordDetected
@@ -56,7 +71,7 @@ public:
     }
 
     void OnIncomingAudio(std::function<void(std::unique_ptr<AudioStreamPacket> packet)> callback);
-    void OnIncomingJson(std::function<void(const cJSON* root)> callback);
+    void OnIncomingJson(std::function<void(const JsonEnvelope& message)> callback);
     void OnAudioChannelOpened(std::function<void()> callback);
     void OnAudioChannelClosed(std::function<void()> callback);
     void OnNetworkError(std::function<void(const std::string& message)> callback);
@@ -78,7 +93,7 @@ public:
     virtual void sendAskAndExecuteCommandText(const std::string& command);
 
 protected:
-    std::function<void(const cJSON* root)> on_incoming_json_;
+    std::function<void(const JsonEnvelope& message)> on_incoming_json_;
     std::function<void(std::unique_ptr<AudioStreamPacket> packet)> on_incoming_audio_;
     std::function<void()> on_audio_channel_opened_;
     std::function<void()> on_audio_channel_closed_;
@@ -91,6 +106,8 @@ protected:
     bool error_occurred_ = false;
     std::string session_id_;
     std::chrono::time_point<std::chrono::steady_clock> last_incoming_time_;
+    // Reused for every incoming JSON message, only touched by the transport receive callback
+    JsonEnvelope incoming_json_;
 
     virtual bool SendText(const std::string& text) = 0;
     virtual void SetError(const std::string& message);
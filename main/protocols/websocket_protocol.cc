@@ -1,10 +1,13 @@
 #include "websocket_protocol.h"
+#include "audio_packet_pool.h"
+#include "latency_trace.h"
 #include "board.h"
 #include "system_info.h"
 #include "application.h"
 #include "settings.h"
 
 #include <cstring>
+#include <algorithm>
 #include <cJSON.h>
 #include <esp_log.h>
 #include <arpa/inet.h>
@@ -30,31 +33,34 @@ bool WebsocketProtocol::SendAudio(std::unique_ptr<AudioStreamPacket> packet) {
         return false;
     }
 
+    bool sent;
     if (version_ == 2) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol2) + packet->payload.size());
-        auto bp2 = (BinaryProtocol2*)serialized.data();
+        // The send buffer keeps its capacity, so framing a packet never allocates
+        send_buffer_.resize(sizeof(BinaryProtocol2) + packet->payload.size());
+        auto bp2 = (BinaryProtocol2*)send_buffer_.data();
         bp2->version = htons(version_);
         bp2->type = 0;
         bp2->reserved = 0;
         bp2->timestamp = htonl(packet->timestamp);
         bp2->payload_size = htonl(packet->payload.size());
         memcpy(bp2->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
     } else if (version_ == 3) {
-        std::string serialized;
-        serialized.resize(sizeof(BinaryProtocol3) + packet->payload.size());
-        auto bp3 = (BinaryProtocol3*)serialized.data();
+        send_buffer_.resize(sizeof(BinaryProtocol3) + packet->payload.size());
+        auto bp3 = (BinaryProtocol3*)send_buffer_.data();
         bp3->type = 0;
         bp3->reserved = 0;
         bp3->payload_size = htons(packet->payload.size());
         memcpy(bp3->payload, packet->payload.data(), packet->payload.size());
-
-        return websocket_->Send(serialized.data(), serialized.size(), true);
+        sent = websocket_->Send(send_buffer_.data(), send_buffer_.size(), true);
     } else {
-        return websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+        sent = websocket_->Send(packet->payload.data(), packet->payload.size(), true);
+    }
+    if (sent) {
+        AUDIO_TRACE(kTraceNetworkSent, packet->trace_id, 0);
     }
+    AudioPacketPool::GetInstance().Release(std::move(packet));
+    return sent;
 }
 
 bool WebsocketProtocol::SendText(const std::string& text) {
@@ -111,55 +117,53 @@ bool WebsocketProtocol::OpenAudioChannel() {
     websocket_->OnData([this](const char* data, size_t len, bool binary) {
         if (binary) {
             if (on_incoming_audio_ != nullptr) {
+                // Read the header in place and copy the payload straight into a pooled packet
+                const uint8_t* payload = (const uint8_t*)data;
+                size_t payload_size = len;
+                uint32_t timestamp = 0;
                 if (version_ == 2) {
-                    BinaryProtocol2* bp2 = (BinaryProtocol2*)data;
-                    bp2->version = ntohs(bp2->version);
-                    bp2->type = ntohs(bp2->type);
-                    bp2->timestamp = ntohl(bp2->timestamp);
-                    bp2->payload_size = ntohl(bp2->payload_size);
-                    auto payload = (uint8_t*)bp2->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = bp2->timestamp,
-                        .payload = std::vector<uint8_t>(payload, payload + bp2->payload_size)
-                    }));
+                    if (len < sizeof(BinaryProtocol2)) {
+                        ESP_LOGE(TAG, "Invalid binary packet size: %u", len);
+                        return;
+                    }
+                    auto bp2 = (const BinaryProtocol2*)data;
+                    timestamp = ntohl(bp2->timestamp);
+                    payload = bp2->payload;
+                    payload_size = std::min<size_t>(ntohl(bp2->payload_size), len - sizeof(BinaryProtocol2));
                 } else if (version_ == 3) {
-                    BinaryProtocol3* bp3 = (BinaryProtocol3*)data;
-                    bp3->type = bp3->type;
-                    bp3->payload_size = ntohs(bp3->payload_size);
-                    auto payload = (uint8_t*)bp3->payload;
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>(payload, payload + bp3->payload_size)
-                    }));
-                } else {
-                    on_incoming_audio_(std::make_unique<AudioStreamPacket>(AudioStreamPacket{
-                        .sample_rate = server_sample_rate_,
-                        .frame_duration = server_frame_duration_,
-                        .timestamp = 0,
-                        .payload = std::vector<uint8_t>((uint8_t*)data, (uint8_t*)data + len)
-                    }));
+                    if (len < sizeof(BinaryProtocol3)) {
+                        ESP_LOGE(TAG, "Invalid binary packet size: %u", len);
+                        return;
+                    }
+                    auto bp3 = (const BinaryProtocol3*)data;
+                    payload = bp3->payload;
+                    payload_size = std::min<size_t>(ntohs(bp3->payload_size), len - sizeof(BinaryProtocol3));
                 }
+                auto packet = AudioPacketPool::GetInstance().Acquire();
+                packet->sample_rate = server_sample_rate_;
+                packet->frame_duration = server_frame_duration_;
+                packet->timestamp = timestamp;
+                packet->trace_id = AUDIO_TRACE_NEW_ID();
+                packet->payload.assign(payload, payload + payload_size);
+                AUDIO_TRACE(kTraceNetworkReceived, packet->trace_id, 0);
+                on_incoming_audio_(std::move(packet));
             }
         } else {
-            // Parse JSON data
-            auto root = cJSON_Parse(data);
-            auto type = cJSON_GetObjectItem(root, "type");
-            if (cJSON_IsString(type)) {
-                if (strcmp(type->valuestring, "hello") == 0) {
-                    ParseServerHello(root);
+            // Only the envelope is parsed, the full tree is built when a handler asks for it
+            incoming_json_.Parse(data, len);
+            auto type = incoming_json_.type();
+            if (type != nullptr) {
+                if (strcmp(type, "hello") == 0) {
+                    ParseServerHello(incoming_json_.root());
                 } else {
                     if (on_incoming_json_ != nullptr) {
-                        on_incoming_json_(root);
+                        on_incoming_json_(incoming_json_);
                     }
                 }
             } else {
                 ESP_LOGE(TAG, "Missing message type, data: %s", data);
             }
-            cJSON_Delete(root);
+            incoming_json_.Clear();
         }
         last_incoming_time_ = std::chrono::steady_clock::now();
     });
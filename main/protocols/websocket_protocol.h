@@ -25,6 +25,8 @@ private:
     EventGroupHandle_t event_group_handle_;
     std::unique_ptr<WebSocket> websocket_;
     int version_ = 1;
+    // Reused for framing outgoing audio, only touched by the task calling SendAudio
+    std::vector<uint8_t> send_buffer_;
 
     void ParseServerHello(const cJSON* root);
     bool SendText(const std::string& text) override;
@@ -0,0 +1,80 @@
+#include "schedule_queue.h"
+
+static_assert((SCHEDULE_QUEUE_SIZE & (SCHEDULE_QUEUE_SIZE - 1)) == 0, "SCHEDULE_QUEUE_SIZE must be a power of two");
+
+ScheduleQueue::ScheduleQueue() {
+    // A slot is free for the producer whose position equals its sequence, and holds a task
+    // for the consumer when the sequence is one past the position
+    for (uint32_t i = 0; i < SCHEDULE_QUEUE_SIZE; i++) {
+        slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool ScheduleQueue::PushRing(ScheduledTask& task) {
+    uint32_t position = tail_.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &slots_[position & (SCHEDULE_QUEUE_SIZE - 1)];
+        uint32_t sequence = slot->sequence.load(std::memory_order_acquire);
+        int32_t diff = (int32_t)(sequence - position);
+        if (diff == 0) {
+            if (tail_.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The consumer has not freed this slot yet
+            return false;
+        } else {
+            position = tail_.load(std::memory_order_relaxed);
+        }
+    }
+    slot->task = std::move(task);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+}
+
+bool ScheduleQueue::PopRing(ScheduledTask& task) {
+    Slot& slot = slots_[head_ & (SCHEDULE_QUEUE_SIZE - 1)];
+    uint32_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if ((int32_t)(sequence - (head_ + 1)) < 0) {
+        return false;
+    }
+    task = std::move(slot.task);
+    slot.sequence.store(head_ + SCHEDULE_QUEUE_SIZE, std::memory_order_release);
+    head_++;
+    return true;
+}
+
+bool ScheduleQueue::Push(ScheduledTask& task) {
+    if (!overflowed_.load(std::memory_order_acquire) && PushRing(task)) {
+        return true;
+    }
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    // The consumer may have drained the list since, then the ring has room again
+    if (overflow_.empty() && PushRing(task)) {
+        return true;
+    }
+    overflow_.push_back(std::move(task));
+    overflowed_.store(true, std::memory_order_release);
+    return false;
+}
+
+bool ScheduleQueue::Pop(ScheduledTask& task) {
+    // Tasks in the ring were pushed before the ones that overflowed
+    if (PopRing(task)) {
+        return true;
+    }
+    if (!overflowed_.load(std::memory_order_acquire)) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(overflow_mutex_);
+    if (overflow_.empty()) {
+        return false;
+    }
+    task = std::move(overflow_.front());
+    overflow_.pop_front();
+    if (overflow_.empty()) {
+        overflowed_.store(false, std::memory_order_release);
+    }
+    return true;
+}
@@ -0,0 +1,163 @@
+#ifndef SCHEDULE_QUEUE_H
+#define SCHEDULE_QUEUE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Callables up to this size are stored in the queue slot, e.g. a lambda capturing this,
+// a pointer and a std::string, or a std::function
+#define SCHEDULE_TASK_INLINE_SIZE 64
+// Slots per priority lane, a power of two
+#define SCHEDULE_QUEUE_SIZE 32
+
+enum SchedulePriority {
+    // Work that must not wait behind UI updates, e.g. aborting speech
+    kSchedulePriorityHigh,
+    kSchedulePriorityNormal,
+    kSchedulePriorityCount,
+};
+
+/*
+ * A move-only void() callable like std::function, but small callables live in the object
+ * itself instead of on the heap. Larger ones fall back to the heap, see on_heap().
+ */
+class ScheduledTask {
+public:
+    ScheduledTask() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, ScheduledTask>>>
+    ScheduledTask(F&& callable) {
+        using T = std::decay_t<F>;
+        if constexpr (sizeof(T) <= SCHEDULE_TASK_INLINE_SIZE && alignof(T) <= alignof(std::max_align_t) &&
+                std::is_nothrow_move_constructible_v<T>) {
+            new (storage_) T(std::forward<F>(callable));
+            ops_ = &InlineOps<T>::ops;
+        } else {
+            *reinterpret_cast<T**>(storage_) = new T(std::forward<F>(callable));
+            ops_ = &HeapOps<T>::ops;
+        }
+    }
+
+    ScheduledTask(ScheduledTask&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    ScheduledTask& operator=(ScheduledTask&& other) noexcept {
+        if (this != &other) {
+            Reset();
+            if (other.ops_ != nullptr) {
+                other.ops_->move(other.storage_, storage_);
+                ops_ = other.ops_;
+                other.ops_ = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    ScheduledTask(const ScheduledTask&) = delete;
+    ScheduledTask& operator=(const ScheduledTask&) = delete;
+
+    ~ScheduledTask() {
+        Reset();
+    }
+
+    void operator()() {
+        ops_->invoke(storage_);
+    }
+
+    explicit operator bool() const { return ops_ != nullptr; }
+    bool on_heap() const { return ops_ != nullptr && ops_->heap; }
+
+    void Reset() {
+        if (ops_ != nullptr) {
+            ops_->destroy(storage_);
+            ops_ = nullptr;
+        }
+    }
+
+private:
+    struct Ops {
+        void (*invoke)(void* storage);
+        // Moves the callable into empty storage and destroys what is left in from
+        void (*move)(void* from, void* to);
+        void (*destroy)(void* storage);
+        bool heap;
+    };
+
+    template <typename T>
+    struct InlineOps {
+        static void Invoke(void* storage) {
+            (*static_cast<T*>(storage))();
+        }
+        static void Move(void* from, void* to) {
+            new (to) T(std::move(*static_cast<T*>(from)));
+            static_cast<T*>(from)->~T();
+        }
+        static void Destroy(void* storage) {
+            static_cast<T*>(storage)->~T();
+        }
+        static constexpr Ops ops = {Invoke, Move, Destroy, false};
+    };
+
+    template <typename T>
+    struct HeapOps {
+        static void Invoke(void* storage) {
+            (**static_cast<T**>(storage))();
+        }
+        static void Move(void* from, void* to) {
+            *static_cast<T**>(to) = *static_cast<T**>(from);
+        }
+        static void Destroy(void* storage) {
+            delete *static_cast<T**>(storage);
+        }
+        static constexpr Ops ops = {Invoke, Move, Destroy, true};
+    };
+
+    alignas(std::max_align_t) unsigned char storage_[SCHEDULE_TASK_INLINE_SIZE];
+    const Ops* ops_ = nullptr;
+};
+
+/*
+ * A multi-producer, single-consumer queue of tasks. Producers on any task claim a slot of a
+ * bounded ring with a compare-and-swap and publish it through the slot sequence number, so a
+ * push into a ring with room never takes a lock or allocates.
+ *
+ * When the ring is full, tasks spill into a locked overflow list instead of blocking the
+ * producer, and later tasks follow them there until the consumer has drained the list, so
+ * tasks still run in the order they were pushed. Pop() may only be called from the consuming task.
+ */
+class ScheduleQueue {
+public:
+    ScheduleQueue();
+
+    // Moves task into the queue, returns false if it went to the overflow list
+    bool Push(ScheduledTask& task);
+    // Returns false if the queue is empty or the next task is still being written
+    bool Pop(ScheduledTask& task);
+
+private:
+    struct Slot {
+        std::atomic<uint32_t> sequence;
+        ScheduledTask task;
+    };
+
+    Slot slots_[SCHEDULE_QUEUE_SIZE];
+    std::atomic<uint32_t> tail_ = 0;
+    uint32_t head_ = 0;
+
+    std::mutex overflow_mutex_;
+    std::deque<ScheduledTask> overflow_;
+    // Set while overflow_ holds tasks, so producers skip the ring and keep the order
+    std::atomic<bool> overflowed_ = false;
+
+    bool PushRing(ScheduledTask& task);
+    bool PopRing(ScheduledTask& task);
+};
+
+#endif // SCHEDULE_QUEUE_H
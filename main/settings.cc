@@ -1,79 +1,430 @@
 #include "settings.h"
 
 #include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
 #include <nvs_flash.h>
 
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
 #define TAG "Settings"
 
-Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
-    nvs_open(ns.c_str(), read_write_ ? NVS_READWRITE : NVS_READONLY, &nvs_handle_);
+enum SettingType {
+    kSettingInt,
+    kSettingUint,
+    kSettingBool,
+    kSettingString,
+};
+
+struct SettingEntry {
+    SettingType type = kSettingInt;
+    // False if the key is not in NVS, or has been erased
+    bool present = false;
+    bool dirty = false;
+    // Order of the last write, pending entries are flushed in this order
+    uint32_t sequence = 0;
+    // int32_t, uint32_t and bool values
+    uint32_t number = 0;
+    std::string string;
+};
+
+struct SettingsNamespace {
+    // Read only until the first flush, 0 if the namespace does not exist yet
+    nvs_handle_t handle = 0;
+    bool writable = false;
+    std::map<std::string, SettingEntry> entries;
+};
+
+/*
+ * Keeps every key that has been read or written, per namespace, with one NVS handle per
+ * namespace for the lifetime of the process.
+ */
+class SettingsCache {
+public:
+    static SettingsCache& GetInstance() {
+        static SettingsCache instance;
+        return instance;
+    }
+
+    // Delete copy constructor and assignment operator
+    SettingsCache(const SettingsCache&) = delete;
+    SettingsCache& operator=(const SettingsCache&) = delete;
+
+    bool GetNumber(const std::string& ns, const std::string& key, SettingType type, uint32_t& value);
+    bool GetString(const std::string& ns, const std::string& key, std::string& value);
+    void SetNumber(const std::string& ns, const std::string& key, SettingType type, uint32_t value);
+    void SetString(const std::string& ns, const std::string& key, const std::string& value);
+    void Erase(const std::string& ns, const std::string& key);
+    void EraseAll(const std::string& ns);
+    void Commit();
+
+private:
+    SettingsCache();
+
+    std::mutex mutex_;
+    std::map<std::string, SettingsNamespace> namespaces_;
+    esp_timer_handle_t commit_timer_ = nullptr;
+    uint32_t sequence_ = 0;
+    uint32_t retry_delay_ms_ = SETTINGS_COMMIT_DELAY_MS;
+    uint32_t commits_ = 0;
+    uint32_t writes_ = 0;
+
+    SettingsNamespace& GetNamespace(const std::string& name);
+    bool OpenWritable(const std::string& name, SettingsNamespace& ns);
+    SettingEntry& Load(SettingsNamespace& ns, const std::string& key, SettingType type);
+    SettingEntry& Store(SettingsNamespace& ns, const std::string& key, SettingType type);
+    void MarkDirty(SettingEntry& entry);
+    void CommitLocked();
+};
+
+SettingsCache::SettingsCache() {
+    esp_timer_create_args_t timer_args = {
+        .callback = [](void* arg) {
+            static_cast<SettingsCache*>(arg)->Commit();
+        },
+        .arg = this,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "settings_commit",
+        .skip_unhandled_events = true,
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &commit_timer_));
+    // esp_restart() runs the shutdown handlers, so a reboot right after a change keeps it
+    esp_register_shutdown_handler([]() {
+        SettingsCache::GetInstance().Commit();
+    });
 }
 
-Settings::~Settings() {
-    if (nvs_handle_ != 0) {
-        if (read_write_ && dirty_) {
-            ESP_ERROR_CHECK(nvs_commit(nvs_handle_));
+SettingsNamespace& SettingsCache::GetNamespace(const std::string& name) {
+    auto it = namespaces_.find(name);
+    if (it != namespaces_.end()) {
+        return it->second;
+    }
+    auto& ns = namespaces_[name];
+    // Opening read only does not create the namespace
+    if (nvs_open(name.c_str(), NVS_READONLY, &ns.handle) != ESP_OK) {
+        ns.handle = 0;
+    }
+    return ns;
+}
+
+bool SettingsCache::OpenWritable(const std::string& name, SettingsNamespace& ns) {
+    if (ns.writable) {
+        return true;
+    }
+    if (ns.handle != 0) {
+        nvs_close(ns.handle);
+        ns.handle = 0;
+    }
+    esp_err_t err = nvs_open(name.c_str(), NVS_READWRITE, &ns.handle);
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open namespace %s: %s", name.c_str(), esp_err_to_name(err));
+        ns.handle = 0;
+        return false;
+    }
+    ns.writable = true;
+    return true;
+}
+
+// Returns the cached entry, reading it from NVS on first use
+SettingEntry& SettingsCache::Load(SettingsNamespace& ns, const std::string& key, SettingType type) {
+    auto it = ns.entries.find(key);
+    if (it != ns.entries.end() && (it->second.type == type || it->second.dirty)) {
+        // A pending write of another type replaces the key, so it is not there as this type
+        return it->second;
+    }
+
+    auto& entry = ns.entries[key];
+    entry = SettingEntry();
+    entry.type = type;
+    if (ns.handle == 0) {
+        return entry;
+    }
+    switch (type) {
+    case kSettingInt: {
+        int32_t value;
+        if (nvs_get_i32(ns.handle, key.c_str(), &value) == ESP_OK) {
+            entry.present = true;
+            entry.number = value;
         }
-        nvs_close(nvs_handle_);
+        break;
     }
+    case kSettingUint:
+        entry.present = nvs_get_u32(ns.handle, key.c_str(), &entry.number) == ESP_OK;
+        break;
+    case kSettingBool: {
+        uint8_t value;
+        if (nvs_get_u8(ns.handle, key.c_str(), &value) == ESP_OK) {
+            entry.present = true;
+            entry.number = value;
+        }
+        break;
+    }
+    case kSettingString: {
+        size_t length = 0;
+        if (nvs_get_str(ns.handle, key.c_str(), nullptr, &length) != ESP_OK) {
+            break;
+        }
+        entry.string.resize(length);
+        entry.present = nvs_get_str(ns.handle, key.c_str(), entry.string.data(), &length) == ESP_OK;
+        while (!entry.string.empty() && entry.string.back() == '\0') {
+            entry.string.pop_back();
+        }
+        break;
+    }
+    }
+    return entry;
 }
 
-std::string Settings::GetString(const std::string& key, const std::string& default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
+// Returns the entry to write, reset if it held a value of another type
+SettingEntry& SettingsCache::Store(SettingsNamespace& ns, const std::string& key, SettingType type) {
+    auto& entry = ns.entries[key];
+    if (entry.type != type) {
+        entry.string.clear();
+        entry.number = 0;
+        entry.present = false;
     }
+    entry.type = type;
+    return entry;
+}
 
-    size_t length = 0;
-    if (nvs_get_str(nvs_handle_, key.c_str(), nullptr, &length) != ESP_OK) {
-        return default_value;
+void SettingsCache::MarkDirty(SettingEntry& entry) {
+    entry.dirty = true;
+    entry.sequence = ++sequence_;
+    if (!esp_timer_is_active(commit_timer_)) {
+        esp_timer_start_once(commit_timer_, SETTINGS_COMMIT_DELAY_MS * 1000);
+    }
+}
+
+bool SettingsCache::GetNumber(const std::string& ns, const std::string& key, SettingType type, uint32_t& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = Load(GetNamespace(ns), key, type);
+    if (!entry.present || entry.type != type) {
+        return false;
+    }
+    value = entry.number;
+    return true;
+}
+
+bool SettingsCache::GetString(const std::string& ns, const std::string& key, std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = Load(GetNamespace(ns), key, kSettingString);
+    if (!entry.present || entry.type != kSettingString) {
+        return false;
+    }
+    value = entry.string;
+    return true;
+}
+
+void SettingsCache::SetNumber(const std::string& ns, const std::string& key, SettingType type, uint32_t value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& name_space = GetNamespace(ns);
+    // Load first, so writing the value that is already stored costs nothing
+    auto& entry = Load(name_space, key, type);
+    if (entry.type == type && entry.present && entry.number == value) {
+        return;
+    }
+    auto& stored = Store(name_space, key, type);
+    stored.number = value;
+    stored.present = true;
+    MarkDirty(stored);
+}
+
+void SettingsCache::SetString(const std::string& ns, const std::string& key, const std::string& value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& name_space = GetNamespace(ns);
+    auto& entry = Load(name_space, key, kSettingString);
+    if (entry.type == kSettingString && entry.present && entry.string == value) {
+        return;
+    }
+    auto& stored = Store(name_space, key, kSettingString);
+    stored.string = value;
+    stored.present = true;
+    MarkDirty(stored);
+}
+
+void SettingsCache::Erase(const std::string& ns, const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& name_space = GetNamespace(ns);
+    auto it = name_space.entries.find(key);
+    if (it == name_space.entries.end()) {
+        // The type does not matter for erasing, only that the entry exists
+        it = name_space.entries.emplace(key, SettingEntry()).first;
+        it->second.type = kSettingString;
+        it->second.present = true;
+    }
+    if (!it->second.present && !it->second.dirty) {
+        return;
+    }
+    it->second.present = false;
+    it->second.string.clear();
+    MarkDirty(it->second);
+}
+
+void SettingsCache::EraseAll(const std::string& ns) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Earlier writes to other namespaces must not land after this
+    CommitLocked();
+    auto& name_space = GetNamespace(ns);
+    name_space.entries.clear();
+    if (!OpenWritable(ns, name_space)) {
+        return;
+    }
+    esp_err_t err = nvs_erase_all(name_space.handle);
+    if (err == ESP_OK) {
+        err = nvs_commit(name_space.handle);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to erase namespace %s: %s", ns.c_str(), esp_err_to_name(err));
+    }
+}
+
+void SettingsCache::Commit() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    CommitLocked();
+}
+
+void SettingsCache::CommitLocked() {
+    struct PendingWrite {
+        const std::string* ns_name;
+        SettingsNamespace* ns;
+        const std::string* key;
+        SettingEntry* entry;
+    };
+    std::vector<PendingWrite> pending;
+    for (auto& [ns_name, ns] : namespaces_) {
+        for (auto& [key, entry] : ns.entries) {
+            if (entry.dirty) {
+                pending.push_back({&ns_name, &ns, &key, &entry});
+            }
+        }
+    }
+    if (pending.empty()) {
+        return;
+    }
+    esp_timer_stop(commit_timer_);
+
+    // NVS writes every item on its own, so the order of the writes is what a power loss sees
+    std::sort(pending.begin(), pending.end(), [](const PendingWrite& a, const PendingWrite& b) {
+        return a.entry->sequence < b.entry->sequence;
+    });
+
+    std::vector<SettingsNamespace*> written;
+    size_t done = 0;
+    for (auto& write : pending) {
+        auto entry = write.entry;
+        if (!OpenWritable(*write.ns_name, *write.ns)) {
+            break;
+        }
+        auto handle = write.ns->handle;
+        const char* key = write.key->c_str();
+        esp_err_t err;
+        if (!entry->present) {
+            err = nvs_erase_key(handle, key);
+            if (err == ESP_ERR_NVS_NOT_FOUND) {
+                err = ESP_OK;
+            }
+        } else {
+            switch (entry->type) {
+            case kSettingInt:
+                err = nvs_set_i32(handle, key, (int32_t)entry->number);
+                break;
+            case kSettingUint:
+                err = nvs_set_u32(handle, key, entry->number);
+                break;
+            case kSettingBool:
+                err = nvs_set_u8(handle, key, entry->number != 0 ? 1 : 0);
+                break;
+            default:
+                err = nvs_set_str(handle, key, entry->string.c_str());
+                break;
+            }
+        }
+        if (err != ESP_OK) {
+            // This and the later keys stay dirty and are retried with the next commit, in order
+            ESP_LOGE(TAG, "Failed to write %s.%s: %s", write.ns_name->c_str(), key, esp_err_to_name(err));
+            break;
+        }
+        entry->dirty = false;
+        done++;
+        writes_++;
+        if (std::find(written.begin(), written.end(), write.ns) == written.end()) {
+            written.push_back(write.ns);
+        }
+    }
+    size_t committed = done;
+    for (auto ns : written) {
+        esp_err_t err = nvs_commit(ns->handle);
+        if (err != ESP_OK) {
+            // The keys of this namespace may not be in flash, they stay dirty and keep their order
+            ESP_LOGE(TAG, "Failed to commit settings: %s", esp_err_to_name(err));
+            for (size_t i = 0; i < done; i++) {
+                if (pending[i].ns == ns) {
+                    pending[i].entry->dirty = true;
+                    committed--;
+                }
+            }
+            continue;
+        }
+        commits_++;
     }
+    ESP_LOGI(TAG, "Committed %u of %u pending keys, %lu commits and %lu writes so far",
+        committed, pending.size(), commits_, writes_);
 
+    if (committed == pending.size()) {
+        retry_delay_ms_ = SETTINGS_COMMIT_DELAY_MS;
+        return;
+    }
+    // Keys left dirty by a failure must not wait for the next change, retry with a growing delay
+    ESP_LOGW(TAG, "Retrying %u keys in %lu ms", pending.size() - committed, retry_delay_ms_);
+    esp_timer_start_once(commit_timer_, (uint64_t)retry_delay_ms_ * 1000);
+    retry_delay_ms_ = std::min<uint32_t>(retry_delay_ms_ * 2, SETTINGS_COMMIT_MAX_RETRY_MS);
+}
+
+Settings::Settings(const std::string& ns, bool read_write) : ns_(ns), read_write_(read_write) {
+}
+
+void Settings::Commit() {
+    SettingsCache::GetInstance().Commit();
+}
+
+std::string Settings::GetString(const std::string& key, const std::string& default_value) {
     std::string value;
-    value.resize(length);
-    ESP_ERROR_CHECK(nvs_get_str(nvs_handle_, key.c_str(), value.data(), &length));
-    while (!value.empty() && value.back() == '\0') {
-        value.pop_back();
+    if (!SettingsCache::GetInstance().GetString(ns_, key, value)) {
+        return default_value;
     }
     return value;
 }
 
 void Settings::SetString(const std::string& key, const std::string& value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_str(nvs_handle_, key.c_str(), value.c_str()));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetString(ns_, key, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 int32_t Settings::GetInt(const std::string& key, int32_t default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
-    int32_t value;
-    if (nvs_get_i32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    uint32_t value;
+    if (!SettingsCache::GetInstance().GetNumber(ns_, key, kSettingInt, value)) {
         return default_value;
     }
-    return value;
+    return (int32_t)value;
 }
 
 void Settings::SetInt(const std::string& key, int32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_i32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetNumber(ns_, key, kSettingInt, (uint32_t)value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 uint32_t Settings::getUint32(const std::string& key, uint32_t default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
     uint32_t value;
-    if (nvs_get_u32(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    if (!SettingsCache::GetInstance().GetNumber(ns_, key, kSettingUint, value)) {
         return default_value;
     }
     return value;
@@ -81,20 +432,15 @@ uint32_t Settings::getUint32(const std::string& key, uint32_t default_value) {
 
 void Settings::setUint32(const std::string& key, uint32_t value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_u32(nvs_handle_, key.c_str(), value));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetNumber(ns_, key, kSettingUint, value);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
 }
 
 bool Settings::GetBool(const std::string& key, bool default_value) {
-    if (nvs_handle_ == 0) {
-        return default_value;
-    }
-
-    uint8_t value;
-    if (nvs_get_u8(nvs_handle_, key.c_str(), &value) != ESP_OK) {
+    uint32_t value;
+    if (!SettingsCache::GetInstance().GetNumber(ns_, key, kSettingBool, value)) {
         return default_value;
     }
     return value != 0;
@@ -102,8 +448,7 @@ bool Settings::GetBool(const std::string& key, bool default_value) {
 
 void Settings::SetBool(const std::string& key, bool value) {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_set_u8(nvs_handle_, key.c_str(), value ? 1 : 0));
-        dirty_ = true;
+        SettingsCache::GetInstance().SetNumber(ns_, key, kSettingBool, value ? 1 : 0);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -111,10 +456,7 @@ void Settings::SetBool(const std::string& key, bool value) {
 
 void Settings::EraseKey(const std::string& key) {
     if (read_write_) {
-        auto ret = nvs_erase_key(nvs_handle_, key.c_str());
-        if (ret != ESP_ERR_NVS_NOT_FOUND) {
-            ESP_ERROR_CHECK(ret);
-        }
+        SettingsCache::GetInstance().Erase(ns_, key);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
@@ -122,7 +464,7 @@ void Settings::EraseKey(const std::string& key) {
 
 void Settings::EraseAll() {
     if (read_write_) {
-        ESP_ERROR_CHECK(nvs_erase_all(nvs_handle_));
+        SettingsCache::GetInstance().EraseAll(ns_);
     } else {
         ESP_LOGW(TAG, "Namespace %s is not open for writing", ns_.c_str());
     }
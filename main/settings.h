@@ -4,10 +4,20 @@
 #include <string>
 #include <nvs_flash.h>
 
+// Dirty settings are written to NVS at most this long after the first change
+#define SETTINGS_COMMIT_DELAY_MS 1000
+// A failed commit is retried after SETTINGS_COMMIT_DELAY_MS, doubling up to this limit
+#define SETTINGS_COMMIT_MAX_RETRY_MS 60000
+
+/*
+ * Reads and writes go through a process wide cache, so constructing a Settings per change is
+ * cheap. Writes are applied to the cache at once and reach NVS in batches, in the order of the
+ * last write to each key, so a key written after another never lands in flash before it.
+ * Pending writes are also flushed by esp_restart(), call Commit() before other power downs.
+ */
 class Settings {
 public:
     Settings(const std::string& ns, bool read_write = false);
-    ~Settings();
 
     std::string GetString(const std::string& key, const std::string& default_value = "");
     void SetString(const std::string& key, const std::string& value);
@@ -18,15 +28,16 @@ public:
     void EraseKey(const std::string& key);
     void EraseAll();
 
-    
+
     uint32_t getUint32(const std::string& key, uint32_t default_value = 0);
     void setUint32(const std::string& key, uint32_t value);
 
+    // Writes all pending changes of every namespace to NVS now
+    static void Commit();
+
 private:
     std::string ns_;
-    nvs_handle_t nvs_handle_ = 0;
     bool read_write_ = false;
-    bool dirty_ = false;
 };
 
 #endif
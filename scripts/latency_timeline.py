@@ -0,0 +1,90 @@
+import argparse
+import csv
+import sys
+from collections import defaultdict
+
+
+'''
+  Turn a latency trace dump (the raw output of the MCP tool self.audio.get_latency_trace,
+  "time_us,event,id,depth" lines) into a per-frame timeline of the voice pipeline.
+  Build the firmware with CONFIG_USE_AUDIO_LATENCY_TRACE enabled to record it.
+'''
+
+UPLINK = ["encode_enqueue", "encode_dequeue", "send_enqueue", "send_dequeue", "network_sent"]
+DOWNLINK = ["network_received", "decode_enqueue", "decode_dequeue", "playback_enqueue",
+            "playback_dequeue", "speaker_done"]
+STAGE_MARKS = "QEQN" + "BQDQS"
+
+
+def load(path):
+    frames = defaultdict(dict)
+    with open(path, newline="") as f:
+        for row in csv.DictReader(line for line in f if line.strip()):
+            frame = frames[int(row["id"])]
+            # Keep the first time of each event, like the device side summary
+            frame.setdefault(row["event"], (int(row["time_us"]), int(row["depth"])))
+    return frames
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[(len(values) - 1) * p // 100]
+
+
+def print_timeline(frames, events, width, scale_us):
+    rows = [(fid, ev) for fid, ev in sorted(frames.items()) if events[0] in ev or events[-1] in ev]
+    if not rows:
+        return
+    start = min(t for _, ev in rows for name, (t, _) in ev.items() if name in events)
+    direction = "uplink" if events is UPLINK else "downlink"
+    print(f"{direction}: one column = {scale_us / 1000:g} ms, marks are the stage a frame is in")
+    for fid, ev in rows:
+        line = [" "] * width
+        times = [ev[name][0] if name in ev else None for name in events]
+        for i in range(len(events) - 1):
+            if times[i] is None or times[i + 1] is None:
+                continue
+            first = (times[i] - start) // scale_us
+            last = max(first, (times[i + 1] - start) // scale_us)
+            mark = STAGE_MARKS[i] if events is UPLINK else STAGE_MARKS[4 + i]
+            for col in range(first, min(last + 1, width)):
+                line[col] = mark
+        known = [t for t in times if t is not None]
+        total = (max(known) - min(known)) / 1000
+        print(f"{fid:>8} |{''.join(line)}| {total:8.1f} ms")
+    print()
+
+
+def print_stages(frames, events):
+    for i in range(len(events) - 1):
+        durations = [ev[events[i + 1]][0] - ev[events[i]][0] for ev in frames.values()
+                     if events[i] in ev and events[i + 1] in ev]
+        if durations:
+            print(f"{events[i]:>18} -> {events[i + 1]:<18} n={len(durations):<5} "
+                  f"p50={percentile(durations, 50) / 1000:7.1f} ms  "
+                  f"p95={percentile(durations, 95) / 1000:7.1f} ms  "
+                  f"p99={percentile(durations, 99) / 1000:7.1f} ms")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay an audio latency trace as a timeline")
+    parser.add_argument("trace", help="file with the raw trace dump")
+    parser.add_argument("--width", type=int, default=100, help="timeline width in columns")
+    parser.add_argument("--scale", type=float, default=20, help="milliseconds per column")
+    args = parser.parse_args()
+
+    frames = load(args.trace)
+    if not frames:
+        print("No events in trace", file=sys.stderr)
+        sys.exit(1)
+
+    print("Legend: uplink Q=encode queue E=encode Q=send queue N=network, "
+          "downlink B=receive buffer Q=decode queue D=decode Q=playback queue S=speaker\n")
+    for events in (UPLINK, DOWNLINK):
+        print_timeline(frames, events, args.width, int(args.scale * 1000))
+    print_stages(frames, UPLINK)
+    print_stages(frames, DOWNLINK)
+
+
+if __name__ == "__main__":
+    main()
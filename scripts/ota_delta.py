@@ -0,0 +1,240 @@
+import argparse
+import hashlib
+import struct
+import sys
+import time
+
+
+'''
+  Compressed and delta firmware images for the OTA updater (main/ota_delta.cc).
+
+  A file starts with an 80 byte header:
+    "XZD1", flags (bit 0: patch against the running firmware), target size, source size,
+    SHA-256 of the target image, SHA-256 of the source image (zero without a source)
+  followed by a stream of operations, lengths and offsets are LEB128 varints:
+    0x00 len <bytes>     literal bytes
+    0x01 zigzag(d) len   copy from the source image, d is relative to the end of the last copy
+    0x02 distance len    copy from the last 32KB of the output
+    0xff                 end
+  Without a source it is a plain LZ77 compression of the image, with one it is a patch that
+  copies the unchanged parts of the running firmware.
+'''
+
+MAGIC = b"XZD1"
+FLAG_HAS_SOURCE = 1
+HEADER = struct.Struct("<4sIII32s32s")
+WINDOW_SIZE = 32 * 1024
+
+OP_LITERAL = 0x00
+OP_SOURCE = 0x01
+OP_WINDOW = 0x02
+OP_END = 0xff
+
+# Source positions are indexed every SOURCE_STRIDE bytes by the SOURCE_KEY bytes that follow,
+# so every match of SOURCE_KEY + SOURCE_STRIDE - 1 bytes or more is found
+SOURCE_KEY = 16
+SOURCE_STRIDE = 8
+WINDOW_KEY = 6
+WINDOW_STRIDE = 2
+# Shorter copies cost more than the literal bytes they replace
+MIN_SOURCE_MATCH = 12
+MIN_WINDOW_MATCH = 8
+
+
+def _varint(value):
+    out = bytearray()
+    while value >= 0x80:
+        out.append((value & 0x7f) | 0x80)
+        value >>= 7
+    out.append(value)
+    return out
+
+
+def _read_varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if byte < 0x80:
+            return value, pos
+
+
+def _zigzag(value):
+    return (value << 1) if value >= 0 else ((-value << 1) - 1)
+
+
+def _unzigzag(value):
+    return (value >> 1) if not value & 1 else -((value + 1) >> 1)
+
+
+def _match_length(a, a_pos, b, b_pos, limit):
+    length = 0
+    # Compare in blocks first, matches of unchanged code are long
+    while length + 64 <= limit and a[a_pos + length:a_pos + length + 64] == b[b_pos + length:b_pos + length + 64]:
+        length += 64
+    while length < limit and a[a_pos + length] == b[b_pos + length]:
+        length += 1
+    return length
+
+
+def encode(target, source=None):
+    target = bytes(target)
+    source_index = {}
+    if source is not None:
+        source = bytes(source)
+        for pos in range(len(source) - SOURCE_KEY, -1, -SOURCE_STRIDE):
+            # Walk backwards so the first occurrence wins
+            source_index[source[pos:pos + SOURCE_KEY]] = pos
+
+    out = bytearray()
+    literal_start = 0
+    source_cursor = 0
+    # Two generations of window keys, so the index never holds much more than the window
+    window_index, old_window_index = {}, {}
+    window_generation = 0
+
+    def flush_literal(end):
+        if end > literal_start:
+            out.append(OP_LITERAL)
+            out.extend(_varint(end - literal_start))
+            out.extend(target[literal_start:end])
+
+    def index_window(begin, end):
+        nonlocal window_index, old_window_index, window_generation
+        first = (begin + WINDOW_STRIDE - 1) // WINDOW_STRIDE * WINDOW_STRIDE
+        for pos in range(first, min(end, len(target) - WINDOW_KEY + 1), WINDOW_STRIDE):
+            if pos // WINDOW_SIZE != window_generation:
+                window_generation = pos // WINDOW_SIZE
+                old_window_index, window_index = window_index, {}
+            window_index[target[pos:pos + WINDOW_KEY]] = pos
+
+    i = 0
+    n = len(target)
+    while i < n:
+        best_len, best_op, best_pos = 0, None, 0
+        if source_index and i + SOURCE_KEY <= n:
+            pos = source_index.get(target[i:i + SOURCE_KEY])
+            if pos is not None:
+                best_len = _match_length(target, i, source, pos, min(n - i, len(source) - pos))
+                best_op, best_pos = OP_SOURCE, pos
+        if i + WINDOW_KEY <= n and best_len < 256:
+            key = target[i:i + WINDOW_KEY]
+            pos = window_index.get(key)
+            if pos is None or i - pos > WINDOW_SIZE:
+                pos = old_window_index.get(key)
+            if pos is not None and 0 < i - pos <= WINDOW_SIZE:
+                length = _match_length(target, i, target, pos, n - i)
+                if length > best_len:
+                    best_len, best_op, best_pos = length, OP_WINDOW, pos
+
+        if best_len < (MIN_SOURCE_MATCH if best_op == OP_SOURCE else MIN_WINDOW_MATCH):
+            i += 1
+            if i % WINDOW_STRIDE == 0:
+                index_window(i - WINDOW_STRIDE, i)
+            continue
+
+        # Grow the match backwards into the pending literal
+        start = i
+        while start > literal_start and best_pos > 0 and \
+                target[start - 1] == (source if best_op == OP_SOURCE else target)[best_pos - 1]:
+            start -= 1
+            best_pos -= 1
+            best_len += 1
+
+        flush_literal(start)
+        if best_op == OP_SOURCE:
+            out.append(OP_SOURCE)
+            out.extend(_varint(_zigzag(best_pos - source_cursor)))
+            source_cursor = best_pos + best_len
+        else:
+            out.append(OP_WINDOW)
+            out.extend(_varint(start - best_pos))
+        out.extend(_varint(best_len))
+        index_window(i, start + best_len)
+        i = start + best_len
+        literal_start = i
+    flush_literal(n)
+    out.append(OP_END)
+
+    flags = FLAG_HAS_SOURCE if source is not None else 0
+    header = HEADER.pack(MAGIC, flags, len(target), len(source) if source is not None else 0,
+                         hashlib.sha256(target).digest(),
+                         hashlib.sha256(source).digest() if source is not None else bytes(32))
+    return header + bytes(out)
+
+
+def decode(data, source=None):
+    magic, flags, target_size, source_size, target_hash, source_hash = HEADER.unpack_from(data)
+    if magic != MAGIC:
+        raise ValueError("not a delta image")
+    if flags & FLAG_HAS_SOURCE:
+        if source is None or len(source) != source_size or hashlib.sha256(source).digest() != source_hash:
+            raise ValueError("patch does not match the source image")
+    out = bytearray()
+    pos = HEADER.size
+    source_cursor = 0
+    while True:
+        op = data[pos]
+        pos += 1
+        if op == OP_END:
+            break
+        if op == OP_LITERAL:
+            length, pos = _read_varint(data, pos)
+            out.extend(data[pos:pos + length])
+            pos += length
+        elif op == OP_SOURCE:
+            delta, pos = _read_varint(data, pos)
+            length, pos = _read_varint(data, pos)
+            source_cursor += _unzigzag(delta)
+            out.extend(source[source_cursor:source_cursor + length])
+            source_cursor += length
+        elif op == OP_WINDOW:
+            distance, pos = _read_varint(data, pos)
+            length, pos = _read_varint(data, pos)
+            if distance == 0 or distance > min(WINDOW_SIZE, len(out)):
+                raise ValueError("invalid window distance")
+            for _ in range(length):
+                out.append(out[-distance])
+        else:
+            raise ValueError(f"invalid operation 0x{op:02x}")
+    if len(out) != target_size or hashlib.sha256(out).digest() != target_hash:
+        raise ValueError("decoded image does not match its hash")
+    return bytes(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Create a compressed or delta OTA image")
+    parser.add_argument("target", help="new application image (build/<project>.bin)")
+    parser.add_argument("-s", "--source", help="application image currently on the devices, creates a patch")
+    parser.add_argument("-o", "--output", help="output file, default <target>.xzd")
+    parser.add_argument("--verify", action="store_true", help="decode the result and compare it with the target")
+    args = parser.parse_args()
+
+    with open(args.target, "rb") as f:
+        target = f.read()
+    source = None
+    if args.source:
+        with open(args.source, "rb") as f:
+            source = f.read()
+
+    start = time.time()
+    data = encode(target, source)
+    elapsed = time.time() - start
+    output = args.output or args.target + ".xzd"
+    with open(output, "wb") as f:
+        f.write(data)
+    print(f"{output}: {len(data)} bytes, {len(data) * 100 / len(target):.1f}% of {len(target)}, "
+          f"encoded in {elapsed:.1f}s")
+
+    if args.verify:
+        start = time.time()
+        if decode(data, source) != target:
+            print("Verification failed", file=sys.stderr)
+            sys.exit(1)
+        print(f"Verified, decoded in {time.time() - start:.2f}s")
+
+
+if __name__ == "__main__":
+    main()
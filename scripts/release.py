@@ -1,11 +1,14 @@
 import sys
 import os
 import json
+import shutil
 import zipfile
 import argparse
 from pathlib import Path
 from typing import Optional
 
+import ota_delta
+
 # Switch to project root directory
 os.chdir(Path(__file__).resolve().parent.parent)
 
@@ -67,6 +70,35 @@ def zip_bin(name: str, version: str) -> None:
         zipf.write("build/merged-binary.bin", arcname="merged-binary.bin")
     print(f"zip bin to {output_path} done")
 
+
+def ota_images(name: str, version: str, delta_from: Optional[str] = None) -> None:
+    """Write the app image, its compressed OTA image and an optional patch to releases/{name}/v{version}/
+
+    delta_from: an earlier version released to the same directory, the patch is made against its app image
+    """
+    with Path("build/project_description.json").open() as f:
+        app_bin = json.load(f)["app_bin"]
+    out_dir = Path(f"releases/{name}/v{version}")
+    out_dir.mkdir(parents=True, exist_ok=True)
+    shutil.copy(Path("build") / app_bin, out_dir / app_bin)
+    target = (out_dir / app_bin).read_bytes()
+
+    images = [(out_dir / f"{app_bin}.xzd", None)]
+    if delta_from:
+        source_path = Path(f"releases/{name}/v{delta_from}") / app_bin
+        if source_path.exists():
+            images.append((out_dir / f"v{delta_from}_to_v{version}_{name}.xzd", source_path.read_bytes()))
+        else:
+            print(f"[WARN] {source_path} 不存在，跳过差分包")
+
+    for path, source in images:
+        data = ota_delta.encode(target, source)
+        if ota_delta.decode(data, source) != target:
+            print(f"{path} 校验失败", file=sys.stderr)
+            sys.exit(1)
+        path.write_bytes(data)
+        print(f"ota image {path}: {len(data)} bytes, {len(data) * 100 / len(target):.1f}% of {len(target)}")
+
 ################################################################################
 # board / variant related functions
 ################################################################################
@@ -136,13 +168,15 @@ def _board_type_exists(board_type: str) -> bool:
 # Compile implementation
 ################################################################################
 
-def release(board_type: str, config_filename: str = "config.json", *, filter_name: Optional[str] = None) -> None:
+def release(board_type: str, config_filename: str = "config.json", *, filter_name: Optional[str] = None,
+            delta_from: Optional[str] = None) -> None:
     """Compile and package all/specified variants of the specified board_type
 
     Args:
         board_type: directory name under main/boards
         config_filename: config.json name (default: config.json)
         filter_name: if specified, only compile the build["name"] that matches
+        delta_from: if specified, also create OTA patches from this earlier version
     """
     cfg_path = _BOARDS_DIR / board_type / config_filename
     if not cfg_path.exists():
@@ -208,6 +242,9 @@ def release(board_type: str, config_filename: str = "config.json", *, filter_nam
         # Zip
         zip_bin(name, project_version)
 
+        # Compressed OTA image and patch
+        ota_images(name, project_version, delta_from)
+
 ################################################################################
 # CLI entry
 ################################################################################
@@ -219,6 +256,7 @@ if __name__ == "__main__":
     parser.add_argument("--list-boards", action="store_true", help="列出所有支持的 board 及变体列表")
     parser.add_argument("--json", action="store_true", help="配合 --list-boards，JSON 格式输出")
     parser.add_argument("--name", help="指定变体名称，仅编译匹配的变体")
+    parser.add_argument("--delta-from", help="生成从该历史版本升级的 OTA 差分包，例如 1.8.0")
 
     args = parser.parse_args()
 
@@ -241,6 +279,7 @@ if __name__ == "__main__":
             sys.exit(1)
         project_ver = get_project_version()
         zip_bin(curr_board_type, project_ver)
+        ota_images(curr_board_type, project_ver, args.delta_from)
         sys.exit(0)
 
     # Compile mode
@@ -269,4 +308,5 @@ if __name__ == "__main__":
         if bt == board_type_input and not cfg_path.exists():
             print(f"开发板 {bt} 未定义 {args.config} 配置文件，跳过")
             sys.exit(0)
-        release(bt, config_filename=args.config, filter_name=name_filter if bt == board_type_input else None)
+        release(bt, config_filename=args.config, filter_name=name_filter if bt == board_type_input else None,
+                delta_from=args.delta_from)
@@ -12,6 +12,8 @@ import numpy as np
 import importlib
 import subprocess
 import urllib.request
+import struct
+import zlib
 
 from PIL import Image
 from datetime import datetime
@@ -56,6 +58,39 @@ def compute_checksum(data):
     checksum = sum(data) & 0xFFFF
     return checksum
 
+# Name of the v2 lookup index, always the last asset so the indices of the other assets do not change
+ASSET_INDEX_NAME = '.assets_index'
+
+def fnv1a32(data):
+    value = 0x811c9dc5
+    for byte in data:
+        value = ((value ^ byte) * 0x01000193) & 0xFFFFFFFF
+    return value
+
+def append_asset_index(file_info_list, merged_data, max_name_len=32):
+    """
+    Append the v2 lookup index as the last asset: "AIX2", entry count, CRC32 of the entries,
+    reserved, then (FNV-1a hash of the name, table index, CRC32 of the asset) sorted by hash.
+    The firmware finds assets by binary search and checks each CRC32 on first use, instead of
+    checksumming the whole partition at boot. Older firmware sees one more asset.
+    """
+    entries = []
+    for index, (file_name, offset, file_size, _, _) in enumerate(file_info_list):
+        name = file_name.ljust(max_name_len, '\0')[:max_name_len].encode('utf-8').split(b'\0')[0]
+        data_crc = zlib.crc32(merged_data[offset + 2:offset + 2 + file_size])
+        entries.append((fnv1a32(name), index, data_crc))
+    entries.sort()
+    body = b''.join(struct.pack('<III', *entry) for entry in entries)
+    index_data = b'AIX2' + struct.pack('<III', len(entries), zlib.crc32(body), 0) + body
+
+    # Keep the index 4-byte aligned in the partition: 12 byte header, the table, then "ZZ"
+    table_size = (len(file_info_list) + 1) * (max_name_len + 12)
+    while (12 + table_size + len(merged_data) + 2) % 4 != 0:
+        merged_data.append(0)
+    file_info_list.append((ASSET_INDEX_NAME, len(merged_data), len(index_data), 0, 0))
+    merged_data.extend(b'\x5A' * 2)
+    merged_data.extend(index_data)
+
 def sort_key(filename):
     basename, extension = os.path.splitext(filename)
     return extension, basename
@@ -438,6 +473,7 @@ def pack_assets(config: PackModelsConfig):
 
         merged_data.extend(bin_data)
 
+    append_asset_index(file_info_list, merged_data, int(max_name_len))
     total_files = len(file_info_list)
 
     mmap_table = bytearray()
@@ -482,6 +518,8 @@ def pack_assets(config: PackModelsConfig):
         output_header.write(f'enum MMAP_{asset_name.upper()}_LISTS {{\n')
 
         for i, (file_name, _, _, _, _) in enumerate(file_info_list):
+            if file_name == ASSET_INDEX_NAME:
+                continue
             enum_name = file_name.replace('.', '_')
             output_header.write(f'    MMAP_{asset_name.upper()}_{enum_name.upper()} = {i},        /*!< {file_name} */\n')
 